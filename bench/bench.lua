@@ -0,0 +1,227 @@
+-- luapgsql benchmarks against a live PostgreSQL server
+--
+-- Usage: lua bench/bench.lua [pattern]
+--
+-- The connection is made using the usual PG* environment variables;
+-- bench/run.sh starts a throwaway server and sets them.  If a pattern
+-- is given, only cases whose name matches it are run.
+
+package.path = 'bench/?.lua;' .. package.path
+
+local pgsql = require 'pgsql'
+local harness = require 'harness'
+
+local run = harness.run
+
+if arg and arg[1] then
+	harness.filter(arg[1])
+end
+
+local conn = pgsql.connectdb(os.getenv('BENCH_CONNINFO') or '')
+if conn:status() ~= pgsql.CONNECTION_OK then
+	io.stderr:write('bench: ' .. conn:errorMessage())
+	os.exit(1)
+end
+
+local function check(res, ...)
+	local status = res:status()
+	for _, ok in ipairs({...}) do
+		if status == ok then
+			return res
+		end
+	end
+	error(res:errorMessage(), 2)
+end
+
+local function exec(sql)
+	return check(conn:exec(sql), pgsql.PGRES_COMMAND_OK,
+	    pgsql.PGRES_TUPLES_OK)
+end
+
+exec('set client_min_messages to warning')
+exec('drop table if exists bench_copy')
+exec('create table bench_copy (id integer, name text, amount float8, '
+    .. 'flag boolean)')
+
+harness.header('luapgsql ' .. pgsql._VERSION .. ', server '
+    .. conn:serverVersion())
+
+--
+-- Round trip cost of the three execution paths
+--
+run('exec', { iterations = 5000 }, function ()
+	conn:exec('select 1')
+end)
+
+run('execParams', { iterations = 5000 }, function (i)
+	conn:execParams('select $1::int8', i)
+end)
+
+check(conn:prepare('bench_select', 'select $1::int8', 0),
+    pgsql.PGRES_COMMAND_OK)
+run('execPrepared', { iterations = 5000 }, function (i)
+	conn:execPrepared('bench_select', i)
+end)
+
+local stmt = assert(conn:prepareStatement('select $1::int4'))
+run('statement exec', { iterations = 5000 }, function (i)
+	stmt:exec(i)
+end)
+
+--
+-- Parameter marshalling: varying counts and value sizes
+--
+local function placeholders(n)
+	local t = {}
+	for i = 1, n do
+		t[i] = '$' .. i .. ' is not null'
+	end
+	return 'select ' .. table.concat(t, ' and ')
+end
+
+for _, n in ipairs({ 1, 8, 32, 128 }) do
+	local sql = placeholders(n)
+	local ints, strs = {}, {}
+	for i = 1, n do
+		ints[i] = i
+		strs[i] = 'value ' .. i
+	end
+	run('params/int x' .. n, { iterations = 2000 }, function ()
+		conn:execParams(sql, ints)
+	end)
+	run('params/text x' .. n, { iterations = 2000 }, function ()
+		conn:execParams(sql, strs)
+	end)
+end
+
+for _, size in ipairs({ 16, 1024, 65536, 1048576 }) do
+	local value = string.rep('x', size)
+	run('params/text ' .. size .. 'B', {
+	    iterations = size > 65536 and 100 or 2000 }, function ()
+		conn:execParams('select $1 is not null', value)
+	end)
+end
+
+--
+-- Result conversion
+--
+local rows = 10000
+local convertsql = 'select i, i::text || \'-name\', i * 1.5::float8, '
+    .. 'i % 2 = 0 from generate_series(1, ' .. rows .. ') as i'
+
+run('convert/fetch only', { iterations = 50 }, function ()
+	conn:exec(convertsql)
+end)
+
+run('convert/getvalue', { iterations = 50 }, function ()
+	local res = conn:exec(convertsql)
+	local nfields = res:nfields()
+	for r = 1, res:ntuples() do
+		for c = 1, nfields do
+			local v = res:getvalue(r, c)
+		end
+	end
+end)
+
+run('convert/getvalue+tonumber', { iterations = 50 }, function ()
+	local res = conn:exec(convertsql)
+	local t = {}
+	for r = 1, res:ntuples() do
+		t[r] = {
+			tonumber(res:getvalue(r, 1)),
+			res:getvalue(r, 2),
+			tonumber(res:getvalue(r, 3)),
+			res:getvalue(r, 4) == 't'
+		}
+	end
+end)
+
+local convertstmt = assert(conn:prepareStatement(convertsql))
+run('convert/statement exec', { iterations = 50 }, function ()
+	convertstmt:exec()
+end)
+
+for _, fetch in ipairs({ 100, 1000 }) do
+	run('cursor/rows fetch=' .. fetch, { iterations = 20, warmup = 2 },
+	    function ()
+		exec('begin')
+		local cur = assert(conn:cursor(convertsql, nil,
+		    { fetch = fetch }))
+		for row in cur:rows() do
+		end
+		cur:close()
+		exec('commit')
+	end)
+end
+
+--
+-- COPY in and out
+--
+local copylines = {}
+for i = 1, rows do
+	copylines[i] = string.format('%d\tname %d\t%g\t%s\n', i, i, i * 1.5,
+	    i % 2 == 0 and 't' or 'f')
+end
+
+run('copy/in ' .. rows .. ' rows', { iterations = 20, warmup = 2,
+    teardown = function () exec('truncate bench_copy') end }, function ()
+	check(conn:exec('copy bench_copy from stdin'), pgsql.PGRES_COPY_IN)
+	for i = 1, rows do
+		conn:putCopyData(copylines[i])
+	end
+	conn:putCopyEnd()
+	check(conn:getResult(), pgsql.PGRES_COMMAND_OK)
+	while conn:getResult() do end
+end)
+
+exec('truncate bench_copy')
+check(conn:exec('copy bench_copy from stdin'), pgsql.PGRES_COPY_IN)
+for i = 1, rows do
+	conn:putCopyData(copylines[i])
+end
+conn:putCopyEnd()
+while conn:getResult() do end
+
+run('copy/out ' .. rows .. ' rows', { iterations = 20, warmup = 2 },
+    function ()
+	check(conn:exec('copy bench_copy to stdout'), pgsql.PGRES_COPY_OUT)
+	while conn:getCopyData() do end
+	while conn:getResult() do end
+end)
+
+--
+-- Large object I/O
+--
+for _, chunk in ipairs({ 256, 8192, 65536 }) do
+	local total = 1048576
+	local data = string.rep('l', chunk)
+	local oid
+
+	run('lo/write 1MB in ' .. chunk .. 'B', { iterations = 20,
+	    warmup = 2 }, function ()
+		exec('begin')
+		oid = conn:lo_create()
+		local lo = conn:lo_open(oid, pgsql.INV_WRITE)
+		for n = 1, total / chunk do
+			lo:write(data)
+		end
+		lo:close()
+		exec('commit')
+	end)
+
+	run('lo/read 1MB in ' .. chunk .. 'B', { iterations = 20, warmup = 2,
+	    teardown = function ()
+		exec('select lo_unlink(oid) from pg_largeobject_metadata')
+	    end }, function ()
+		exec('begin')
+		local lo = conn:lo_open(oid, pgsql.INV_READ)
+		for n = 1, total / chunk do
+			lo:read(chunk)
+		end
+		lo:close()
+		exec('commit')
+	end)
+end
+
+exec('drop table bench_copy')
+conn:finish()
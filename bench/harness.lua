@@ -0,0 +1,102 @@
+-- Benchmark harness shared by the luapgsql benchmarks
+
+local harness = {}
+
+-- Wall clock with sub-millisecond resolution if one is available,
+-- falling back to CPU time.
+local now, clockname
+do
+	local ok, socket = pcall(require, 'socket')
+	if ok and socket.gettime then
+		now, clockname = socket.gettime, 'socket.gettime'
+	else
+		local ok, ptime = pcall(require, 'posix.time')
+		if ok and ptime.clock_gettime then
+			now = function ()
+				local ts = ptime.clock_gettime(ptime.CLOCK_MONOTONIC)
+				return ts.tv_sec + ts.tv_nsec / 1e9
+			end
+			clockname = 'clock_gettime'
+		else
+			now, clockname = os.clock, 'os.clock (CPU time only)'
+		end
+	end
+end
+harness.now = now
+harness.clockname = clockname
+
+local function percentile(sorted, p)
+	local n = #sorted
+	if n == 0 then
+		return 0
+	end
+	local i = math.ceil(n * p)
+	if i < 1 then i = 1 end
+	return sorted[i]
+end
+
+local filter
+
+function harness.filter(pattern)
+	filter = pattern
+end
+
+--
+-- Run fn(i) iterations times after warmup runs and report throughput,
+-- latency percentiles, the peak Lua heap growth during the run and the
+-- heap still retained after a full collection.
+-- setup and teardown, if given, run outside of the measurement.
+--
+function harness.run(name, opts, fn)
+	if filter and not name:find(filter) then
+		return
+	end
+	local iterations = opts.iterations or 1000
+	local warmup = opts.warmup or math.floor(iterations / 10)
+	local ctx = opts.setup and opts.setup() or nil
+
+	for i = 1, warmup do
+		fn(i, ctx)
+	end
+
+	local lat = {}
+	for i = 1, iterations do
+		lat[i] = 0
+	end
+	collectgarbage('collect')
+	local mem0 = collectgarbage('count')
+	local peak = mem0
+	local t0 = now()
+	for i = 1, iterations do
+		local s = now()
+		fn(i, ctx)
+		lat[i] = now() - s
+		local m = collectgarbage('count')
+		if m > peak then
+			peak = m
+		end
+	end
+	local total = now() - t0
+	collectgarbage('collect')
+	local retained = collectgarbage('count') - mem0
+
+	if opts.teardown then
+		opts.teardown(ctx)
+	end
+
+	table.sort(lat)
+	local ops = total > 0 and iterations / total or 0
+	print(string.format('%-36s %8d %12.1f %10.1f %10.1f %10.1f %10.1f %10.1f',
+	    name, iterations, ops,
+	    percentile(lat, 0.50) * 1e6, percentile(lat, 0.95) * 1e6,
+	    percentile(lat, 0.99) * 1e6, peak - mem0, retained))
+end
+
+function harness.header(title)
+	print(title .. ' (clock: ' .. clockname .. ')')
+	print(string.format('%-36s %8s %12s %10s %10s %10s %10s %10s',
+	    'case', 'iter', 'ops/s', 'p50 us', 'p95 us', 'p99 us',
+	    'peak KB', 'kept KB'))
+end
+
+return harness
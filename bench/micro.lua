@@ -0,0 +1,173 @@
+-- luapgsql microbenchmarks that do not need a server
+--
+-- Usage: lua bench/micro.lua [rows=N] [cols=N] [size=N] [types=list]
+--                            [pattern]
+--
+-- Results are built synthetically with makeEmptyPGresult,
+-- setResultAttrs and setvalue, so the client side decoding and
+-- encoding paths are measured in isolation and deterministically.
+-- These only exist in a module built with -DLUAPGSQL_BENCH, which
+-- "make microbench" builds as bench/pgsql.so.
+-- types is a comma separated list of int8, float8, bool and text
+-- that is repeated over the columns.
+
+package.path = 'bench/?.lua;' .. package.path
+
+local pgsql = require 'pgsql'
+local harness = require 'harness'
+
+local run = harness.run
+
+local shape = { rows = 10000, cols = 8, size = 16,
+    types = 'int8,text,float8,bool' }
+for _, a in ipairs(arg or {}) do
+	local k, v = a:match('^(%w+)=(.*)$')
+	if k then
+		shape[k] = tonumber(v) or v
+	else
+		harness.filter(a)
+	end
+end
+
+local typeoids = { int8 = 20, text = 25, float8 = 701, bool = 16 }
+local types = {}
+for t in shape.types:gmatch('[^,]+') do
+	assert(typeoids[t], 'unknown type ' .. t)
+	types[#types + 1] = t
+end
+
+-- A connection that never reaches a server; it is only needed as the
+-- owner of synthetic results and for the escaping functions.
+local conn = pgsql.connectStart('host=/nonexistent/luapgsql-bench')
+
+local function value(t, r, c)
+	if t == 'int8' then
+		return tostring(r * c)
+	elseif t == 'float8' then
+		return tostring(r * c / 7)
+	elseif t == 'bool' then
+		return (r + c) % 2 == 0 and 't' or 'f'
+	end
+	return string.rep(string.char(97 + (r + c) % 26), shape.size)
+end
+
+local function synthetic(rows, cols)
+	local res = conn:makeEmptyPGresult(pgsql.PGRES_TUPLES_OK)
+	local attrs, coltypes = {}, {}
+	for c = 1, cols do
+		coltypes[c] = types[(c - 1) % #types + 1]
+		attrs[c] = { name = 'c' .. c, typid = typeoids[coltypes[c]] }
+	end
+	assert(res:setResultAttrs(attrs))
+	for r = 1, rows do
+		for c = 1, cols do
+			res:setvalue(r, c, value(coltypes[c], r, c))
+		end
+	end
+	return res
+end
+
+local res = synthetic(shape.rows, shape.cols)
+
+harness.header(string.format('luapgsql %s microbenchmarks, %d rows x %d '
+    .. 'columns (%s), %d byte text', pgsql._VERSION, shape.rows, shape.cols,
+    shape.types, shape.size))
+
+--
+-- Result decoding
+--
+run('decode/getvalue', { iterations = 20, warmup = 2 }, function ()
+	local nfields = res:nfields()
+	for r = 1, res:ntuples() do
+		for c = 1, nfields do
+			local v = res:getvalue(r, c)
+		end
+	end
+end)
+
+run('decode/getvalue+getisnull', { iterations = 20, warmup = 2 },
+    function ()
+	local nfields = res:nfields()
+	for r = 1, res:ntuples() do
+		for c = 1, nfields do
+			local v
+			if not res:getisnull(r, c) then
+				v = res:getvalue(r, c)
+			end
+		end
+	end
+end)
+
+run('decode/fnumber', { iterations = 20, warmup = 2 }, function ()
+	local name = 'c' .. shape.cols
+	for r = 1, res:ntuples() do
+		local v = res:getvalue(r, res:fnumber(name))
+	end
+end)
+
+run('decode/row proxy, 3 fields by name', { iterations = 20, warmup = 2 },
+    function ()
+	local a, b, c = 'c1', 'c2', 'c' .. shape.cols
+	for i, row in res:rows() do
+		local x, y, z = row[a], row[b], row[c]
+	end
+end)
+
+run('decode/row proxy, all fields', { iterations = 20, warmup = 2 },
+    function ()
+	local nfields = res:nfields()
+	for i, row in res:rows() do
+		for c = 1, nfields do
+			local v = row[c]
+		end
+	end
+end)
+
+for _, threads in ipairs({ 1, 4 }) do
+	run('decode/pack, threads=' .. threads, { iterations = 20, warmup = 2 },
+	    function ()
+		res:pack({ threads = threads })
+	end)
+end
+
+run('serialize/toCSV', { iterations = 20, warmup = 2 }, function ()
+	res:toCSV()
+end)
+
+--
+-- Parameter encoding; the unconnected connection makes libpq return
+-- immediately after the binding has encoded the parameters.
+--
+for _, n in ipairs({ 1, 8, 64 }) do
+	local ints, strs = {}, {}
+	for i = 1, n do
+		ints[i] = i
+		strs[i] = string.rep('p', shape.size)
+	end
+	run('encode/int x' .. n, { iterations = 20000 }, function ()
+		conn:execParams('', ints)
+	end)
+	run('encode/text x' .. n, { iterations = 20000 }, function ()
+		conn:execParams('', strs)
+	end)
+end
+
+--
+-- Escaping
+--
+for _, size in ipairs({ 16, 4096, 262144 }) do
+	local s = string.rep('x\'', size / 2)
+	local iterations = size > 4096 and 200 or 20000
+	run('escape/literal ' .. size .. 'B', { iterations = iterations },
+	    function ()
+		conn:escapeLiteral(s)
+	end)
+	run('escape/string ' .. size .. 'B', { iterations = iterations },
+	    function ()
+		conn:escapeString(s)
+	end)
+	run('escape/bytea ' .. size .. 'B', { iterations = iterations },
+	    function ()
+		conn:escapeBytea(s)
+	end)
+end
@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# Run the luapgsql benchmarks against a throwaway PostgreSQL server.
+#
+# A new cluster is created with initdb in a temporary directory and
+# started listening on a unix socket only; it is stopped and removed
+# again when the benchmarks have finished.  Set PG_BINDIR to use a
+# specific PostgreSQL installation and LUA to pick the interpreter.
+#
+# Usage: bench/run.sh [benchmark script] [pattern]
+
+set -e
+
+LUA=${LUA:-lua}
+PG_BINDIR=${PG_BINDIR:-$(pg_config --bindir)}
+SCRIPT=${1:-bench/bench.lua}
+[ $# -gt 0 ] && shift
+
+TMPDIR=$(mktemp -d "${TMPDIR:-/tmp}/luapgsql-bench.XXXXXX")
+
+cleanup() {
+	"$PG_BINDIR/pg_ctl" -D "$TMPDIR/data" -m immediate stop \
+	    >/dev/null 2>&1 || true
+	rm -rf "$TMPDIR"
+}
+trap cleanup EXIT INT TERM
+
+"$PG_BINDIR/initdb" -D "$TMPDIR/data" -A trust -U bench -E UTF8 \
+    --no-locale -N >"$TMPDIR/initdb.log" 2>&1 || {
+	cat "$TMPDIR/initdb.log" >&2
+	exit 1
+}
+
+"$PG_BINDIR/pg_ctl" -D "$TMPDIR/data" -l "$TMPDIR/server.log" -w \
+    -o "-c listen_addresses='' -k $TMPDIR -c fsync=off \
+    -c synchronous_commit=off -c full_page_writes=off \
+    -c shared_buffers=128MB" start >/dev/null || {
+	cat "$TMPDIR/server.log" >&2
+	exit 1
+}
+
+PGHOST=$TMPDIR
+PGUSER=bench
+PGDATABASE=postgres
+export PGHOST PGUSER PGDATABASE
+
+LUA_CPATH="./?.so;${LUA_CPATH:-;}" "$LUA" "$SCRIPT" "$@"
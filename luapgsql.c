@@ -30,12 +30,28 @@
 #ifdef __APPLE__
 #include <libkern/OSByteOrder.h>
 #define htobe64(x) OSSwapHostToBigInt64(x)
+#define be64toh(x) OSSwapBigToHostInt64(x)
 #elif __linux__
+#define _GNU_SOURCE		/* fopencookie() */
 #include <endian.h>
 #endif
+#include <sys/mman.h>
+
+#include <arpa/inet.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <libpq-fe.h>
 #include <libpq/libpq-fs.h>
@@ -50,6 +66,13 @@
 #if LUA_VERSION_NUM < 502
 #define lua_setuservalue lua_setfenv
 #define lua_getuservalue lua_getfenv
+#define lua_rawlen lua_objlen
+#endif
+
+#if LUA_VERSION_NUM >= 503
+#define pgsql_pushint64(L, v)	lua_pushinteger(L, (lua_Integer)(v))
+#else
+#define pgsql_pushint64(L, v)	lua_pushnumber(L, (lua_Number)(v))
 #endif
 
 static PGconn **
@@ -92,6 +115,70 @@ pgsql_connectStart(lua_State *L)
 	return 1;
 }
 
+static void conn_types(lua_State *, int);
+
+/*
+ * A new result of the connection at idx, or of none if idx is 0.  It
+ * decodes its values with the types known to that connection.
+ */
+static PGresult **
+pgsql_res_new(lua_State *L, int idx)
+{
+	PGresult **res;
+
+	res = lua_newuserdata(L, sizeof(PGresult *));
+	*res = NULL;
+	luaL_getmetatable(L, RES_METATABLE);
+	lua_setmetatable(L, -2);
+	if (idx) {
+		conn_types(L, idx);
+		lua_setuservalue(L, -2);
+	}
+	return res;
+}
+
+/*
+ * The memory held by a PGresult is invisible to the Lua garbage
+ * collector, which only sees a pointer sized userdata.  Estimate the
+ * real size where libpq can not tell it.
+ */
+static size_t
+pgsql_res_size(const PGresult *r)
+{
+#if PG_VERSION_NUM >= 120000
+	return PQresultMemorySize(r);
+#else
+	size_t len;
+	int n, ntuples, nfields;
+
+	ntuples = PQntuples(r);
+	nfields = PQnfields(r);
+	len = 0;
+	if (ntuples > 0)
+		for (n = 0; n < nfields; n++)
+			len += PQgetlength(r, 0, n) + 1;
+	return sizeof(PGresult *) + nfields * 64
+	    + (size_t)ntuples * (len + nfields * 2 * sizeof(void *));
+#endif
+}
+
+/*
+ * Let the garbage collector do the amount of work it would have done
+ * if the result had been allocated by Lua, so that loops fetching
+ * large results collect the old ones before memory is exhausted.
+ */
+static void
+pgsql_res_account(lua_State *L, const PGresult *r)
+{
+	size_t kb;
+
+	if (r == NULL)
+		return;
+	kb = pgsql_res_size(r) >> 10;
+	if (kb > 0)
+		lua_gc(L, LUA_GCSTEP, kb > INT_MAX ? INT_MAX : (int)kb);
+}
+
 static PGconn *
 pgsql_conn(lua_State *L, int n)
 {
@@ -102,6 +189,19 @@ pgsql_conn(lua_State *L, int n)
 	return *data;
 }
 
+static void cursor_drain(lua_State *, PGconn *);
+
+/* The connection at n, ready for a query of its own */
+static PGconn *
+pgsql_conn_query(lua_State *L, int n)
+{
+	PGconn *conn;
+
+	conn = pgsql_conn(L, n);
+	cursor_drain(L, conn);
+	return conn;
+}
+
 static int
 pgsql_connectPoll(lua_State *L)
 {
@@ -140,6 +240,8 @@ pgsql_encryptPassword(lua_State *L)
 	return 1;
 }
 
+static void explain_off(lua_State *, int);
+
 static int
 conn_finish(lua_State *L)
 {
@@ -177,8 +279,17 @@ conn_finish(lua_State *L)
 			lua_getuservalue(L, 1);
 			lua_pushnil(L);
 			lua_setfield(L, -2, "trace_file");
+			lua_pushnil(L);
+			lua_setfield(L, -2, "trace_ring");
+			explain_off(L, 1);
 		} else
 			lua_pop(L, 1);
+	} else {
+		/* detached by execAsync(), the future finishes it */
+		lua_getuservalue(L, 1);
+		lua_pushboolean(L, 1);
+		lua_setfield(L, -2, "finished");
+		lua_pop(L, 1);
 	}
 	return 0;
 }
@@ -333,1254 +444,9975 @@ conn_connectionUsedPassword(lua_State *L)
 }
 
 /*
- * Command Execution Functions
+ * Resilient connections
+ *
+ * In resilient mode prepared statements and session settings are
+ * recorded in the "resilient" table of the connection's uservalue.
+ * When a call fails because the connection was lost, the connection
+ * is reset without blocking in libpq, the recorded state is replayed
+ * in one round trip.  With retry set, the call is then repeated if it
+ * looks like a plain read.  That is a guess from the SQL text: a SELECT
+ * calling a function with side effects would run twice, so retry is off
+ * unless asked for.
  */
+
+/* Push the resilient table of the connection at idx, if any */
 static int
-conn_exec(lua_State *L)
+conn_resilience(lua_State *L, int idx)
 {
-	PGresult **res;
-
-	res = lua_newuserdata(L, sizeof(PGresult *));
-	*res = PQexec(pgsql_conn(L, 1), luaL_checkstring(L, 2));
-	luaL_getmetatable(L, RES_METATABLE);
-	lua_setmetatable(L, -2);
-	return 1;
+	lua_getuservalue(L, idx);
+	if (lua_istable(L, -1)) {
+		lua_getfield(L, -1, "resilient");
+		lua_remove(L, -2);
+		if (lua_istable(L, -1))
+			return 1;
+	}
+	lua_pop(L, 1);
+	return 0;
 }
 
-static int
-get_sql_params(lua_State *L, int t, int n, Oid *paramTypes, char **paramValues,
-    int *paramLengths, int *paramFormats, int *count)
+static void
+pgsql_track_prepare(lua_State *L, int idx, const char *name,
+    const char *command, int nparams, const Oid *types)
 {
-	int k, c;
+	int n;
 
-	switch (lua_type(L, t)) {
-	case LUA_TBOOLEAN:
-		if (paramTypes != NULL)
-			paramTypes[n] = BOOLOID;
-		if (paramValues != NULL) {
-			paramValues[n] = malloc(1);
-			if (paramValues[n] == NULL)
-				return -1;
-			*(char *)paramValues[n] = lua_toboolean(L, t);
-			paramLengths[n] = 1;
-			paramFormats[n] = 1;
-		}
-		n = 1;
-		break;
-	case LUA_TNUMBER:
-		if (paramTypes != NULL)
-#if LUA_VERSION_NUM >= 503
-			if (lua_isinteger(L, t))
-				paramTypes[n] = INT8OID;
-			else
-#endif
-				paramTypes[n] = FLOAT8OID;
-		if (paramValues != NULL) {
-			union {
-				double v;
-				uint64_t i;
-			} swap;
+	if (!conn_resilience(L, idx))
+		return;
+	lua_getfield(L, -1, "prepared");
+	lua_createtable(L, nparams + 1, 0);
+	lua_pushstring(L, command);
+	lua_rawseti(L, -2, 1);
+	for (n = 0; n < nparams; n++) {
+		lua_pushinteger(L, types != NULL ? types[n] : 0);
+		lua_rawseti(L, -2, n + 2);
+	}
+	lua_setfield(L, -2, name);
+	lua_pop(L, 2);
+}
 
-#if LUA_VERSION_NUM >= 503
-			if (lua_isinteger(L, t))
-				swap.i = lua_tointeger(L, t);
-			else
-#endif
-				swap.v = lua_tonumber(L, t);
-			paramValues[n] = malloc(sizeof(uint64_t));
-			if (paramValues[n] == NULL)
-				return -1;
-			*(uint64_t *)paramValues[n] = htobe64(swap.i);
-			paramLengths[n] = sizeof(uint64_t);
-			paramFormats[n] = 1;
-		}
-		n = 1;
-		break;
-	case LUA_TSTRING:
-		if (paramTypes != NULL)
-			paramTypes[n] = TEXTOID;
-		if (paramValues != NULL) {
-			const char *s;
-			size_t len;
+static void
+pgsql_untrack_prepare(lua_State *L, int idx, const char *name)
+{
+	if (!conn_resilience(L, idx))
+		return;
+	lua_getfield(L, -1, "prepared");
+	lua_pushnil(L);
+	lua_setfield(L, -2, name);
+	lua_pop(L, 2);
+}
 
-			s = lua_tolstring(L, t, &len);
-			paramValues[n] = malloc(len + 1);
-			if (paramValues[n] == NULL)
-				return -1;
-			/*
-			 * lua_tolstring returns a string with '\0' after
-			 * the last character.
-			 */
-			memcpy(paramValues[n], s, len + 1);
+/*
+ * Whether a statement can safely be sent again; only single statements
+ * that look like they just read data qualify.  Several statements,
+ * locking clauses, SELECT INTO, DML and DDL keywords and calls of the
+ * well known functions that write are ruled out, words in quotes are
+ * skipped.  Names ending in '_' match as prefixes.  The classification
+ * is also used to route statements to replicas and for EXPLAIN ANALYZE.
+ */
+static int
+sql_readonly(const char *s)
+{
+	static const char *readonly[] = { "select", "values", "show",
+	    "table", NULL };
+	static const char *writes[] = { "into", "insert", "update", "delete",
+	    "merge", "truncate", "drop", "create", "alter", "copy", "call",
+	    "do", "execute", "grant", "revoke", "lock", "notify", "share",
+	    "nextval", "setval", "pg_advisory_", "pg_try_advisory_",
+	    "pg_notify", "set_config", "lo_", "pg_terminate_backend",
+	    "pg_cancel_backend", NULL };
+	const char *word;
+	size_t len, wlen;
+	int n;
+	char quote;
+
+	if (s == NULL)
+		return 0;
+	while (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r' ||
+	    *s == '(')
+		s++;
+	for (n = 0; readonly[n] != NULL; n++) {
+		len = strlen(readonly[n]);
+		if (!strncasecmp(s, readonly[n], len) &&
+		    (s[len] == '\0' || strchr(" \t\r\n(*", s[len]) != NULL))
+			break;
+	}
+	if (readonly[n] == NULL)
+		return 0;
+
+	while (*s != '\0') {
+		if (*s == '\'' || *s == '"') {
+			quote = *s++;
+			while (*s != '\0' && *s != quote)
+				s++;
+			if (*s != '\0')
+				s++;
+			continue;
 		}
-		n = 1;
-		break;
-	case LUA_TNIL:
-		if (paramValues != NULL)
-			paramValues[n] = NULL;
-		n = 1;
-		break;
-	case LUA_TTABLE:
-		for (k = 1;; k++) {
-			lua_pushinteger(L, k);
-			lua_gettable(L, t);
-			if (lua_isnil(L, -1))
-				break;
-			c = 0;
-			if (get_sql_params(L, -1, n, paramTypes, paramValues,
-			    paramLengths, paramFormats, &c))
-			    	return -1;
-			n += c;
-			lua_pop(L, 1);
+		if (*s == ';')
+			return 0;
+		if (!isalpha((unsigned char)*s) && *s != '_') {
+			s++;
+			continue;
+		}
+		word = s;
+		while (isalnum((unsigned char)*s) || *s == '_' || *s == '$')
+			s++;
+		len = s - word;
+		for (n = 0; writes[n] != NULL; n++) {
+			wlen = strlen(writes[n]);
+			if ((writes[n][wlen - 1] == '_' ? len >= wlen :
+			    len == wlen) && !strncasecmp(word, writes[n], wlen))
+				return 0;
 		}
-		lua_pop(L, 1);
-		break;
-	default:
-		return luaL_argerror(L, t, "unsupported type");
 	}
-	*count = n;
-	return 0;
+	return 1;
 }
 
+/* Whether the recorded statement name is read-only */
 static int
-conn_execParams(lua_State *L)
+stmt_readonly(lua_State *L, int idx, const char *name)
 {
-	PGresult **res;
-	Oid *paramTypes;
-	char **paramValues;
-	int n, nParams, sqlParams, *paramLengths, *paramFormats, count;
-
-	nParams = lua_gettop(L) - 2;	/* subtract connection and command */
-	if (nParams < 0)
-		nParams = 0;
-
-	for (n = 0, sqlParams = 0; n < nParams; n++) {
-		get_sql_params(L, 3 + n, sqlParams, NULL, NULL, NULL, NULL,
-		    &count);
-		sqlParams += count;
-	}
-	if (sqlParams) {
-		paramTypes = calloc(sqlParams, sizeof(Oid));
-		paramValues = calloc(sqlParams, sizeof(char *));
-		paramLengths = calloc(sqlParams, sizeof(int));
-		paramFormats = calloc(sqlParams, sizeof(int));
-
-		if (paramTypes == NULL || paramValues == NULL
-		    || paramLengths == NULL || paramFormats == NULL)
-		    	goto errout;
-
-		for (n = 0, sqlParams = 0; n < nParams; n++) {
-			if (get_sql_params(L, 3 + n, sqlParams, paramTypes,
-			    paramValues, paramLengths, paramFormats, &count))
-			    	goto errout;
-			sqlParams += count;
-		}
-	} else {
-		paramTypes = NULL;
-		paramValues = NULL;
-		paramLengths = NULL;
-		paramFormats = NULL;
+	int readonly = 0;
+
+	if (!conn_resilience(L, idx))
+		return 0;
+	lua_getfield(L, -1, "prepared");
+	lua_getfield(L, -1, name);
+	if (lua_istable(L, -1)) {
+		lua_rawgeti(L, -1, 1);
+		readonly = sql_readonly(lua_tostring(L, -1));
+		lua_pop(L, 1);
 	}
-	res = lua_newuserdata(L, sizeof(PGresult *));
-	*res = PQexecParams(pgsql_conn(L, 1),
-	    luaL_checkstring(L, 2), sqlParams, paramTypes,
-	    (const char * const*)paramValues, paramLengths, paramFormats, 0);
-	luaL_getmetatable(L, RES_METATABLE);
-	lua_setmetatable(L, -2);
-	if (sqlParams) {
-		for (n = 0; n < sqlParams; n++)
-			free((void *)paramValues[n]);
-		free(paramTypes);
-		free(paramValues);
-		free(paramLengths);
-		free(paramFormats);
+	lua_pop(L, 3);
+	return readonly;
+}
+
+static int
+pgsql_lost(PGconn *conn, const PGresult *r)
+{
+	return (r == NULL || PQresultStatus(r) == PGRES_FATAL_ERROR) &&
+	    PQstatus(conn) == CONNECTION_BAD;
+}
+
+static long
+elapsed_ms(const struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000L +
+	    (now.tv_nsec - since->tv_nsec) / 1000000L;
+}
+
+/* Reset the connection with PQresetStart/PQresetPoll */
+static int
+pgsql_reconnect(PGconn *conn, long timeout)
+{
+	PostgresPollingStatusType status;
+	struct pollfd pfd;
+	struct timespec start;
+	long left;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (!PQresetStart(conn))
+		return 0;
+	status = PGRES_POLLING_WRITING;
+	while (status != PGRES_POLLING_OK) {
+		if (status == PGRES_POLLING_FAILED)
+			return 0;
+		left = timeout - elapsed_ms(&start);
+		if (left <= 0)
+			return 0;
+		pfd.fd = PQsocket(conn);
+		pfd.events = status == PGRES_POLLING_READING ? POLLIN :
+		    POLLOUT;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, left) == -1 && errno != EINTR)
+			return 0;
+		status = PQresetPoll(conn);
 	}
 	return 1;
+}
 
-errout:
-	if (paramValues) {
-		for (n = 0; n < sqlParams; n++)
-			free((void *)paramValues[n]);
-		free(paramValues);
+static Oid *
+replay_types(lua_State *L, int t, int *nparams)
+{
+	Oid *types;
+	int n;
+
+	*nparams = lua_rawlen(L, t) - 1;
+	if (*nparams <= 0)
+		return NULL;
+	types = calloc(*nparams, sizeof(Oid));
+	if (types == NULL)
+		return NULL;
+	for (n = 0; n < *nparams; n++) {
+		lua_rawgeti(L, t, n + 2);
+		types[n] = lua_tointeger(L, -1);
+		lua_pop(L, 1);
 	}
-	free(paramTypes);
-	free(paramLengths);
-	free(paramFormats);
-	return luaL_error(L, "out of memory");
+	return types;
 }
 
-static int
-conn_prepare(lua_State *L)
+/*
+ * Replay the settings and prepared statements recorded in the
+ * resilient table on top of the stack.  With pipelining, every item
+ * gets its own sync so that one failure does not abort the rest.
+ */
+static void
+pgsql_replay(lua_State *L, PGconn *conn)
 {
-	PGresult **res;
-	Oid *paramTypes;
-	int n, nParams, sqlParams, count;
+	const char *values[2];
+	Oid *types;
+	int nparams;
+#ifdef LIBPQ_HAS_PIPELINING
+	PGresult *r;
+	int syncs = 0, pipeline;
+
+	pipeline = PQenterPipelineMode(conn);
+#endif
 
-	nParams = lua_gettop(L) - 3;	/* subtract connection, name, command */
-	if (nParams < 0)
-		nParams = 0;
+	lua_getfield(L, -1, "settings");
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		values[0] = lua_tostring(L, -2);
+		values[1] = lua_tostring(L, -1);
+#ifdef LIBPQ_HAS_PIPELINING
+		if (pipeline) {
+			if (PQsendQueryParams(conn, "SELECT pg_catalog."
+			    "set_config($1, $2, false)", 2, NULL, values,
+			    NULL, NULL, 0) && PQpipelineSync(conn))
+				syncs++;
+		} else
+#endif
+		PQclear(PQexecParams(conn, "SELECT pg_catalog."
+		    "set_config($1, $2, false)", 2, NULL, values, NULL, NULL,
+		    0));
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
 
-	for (n = 0, sqlParams = 0; n < nParams; n++) {
-		get_sql_params(L, 4 + n, sqlParams, NULL, NULL, NULL, NULL,
-		    &count);
-		sqlParams += count;
+	lua_getfield(L, -1, "prepared");
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		types = replay_types(L, lua_gettop(L), &nparams);
+		lua_rawgeti(L, -1, 1);
+#ifdef LIBPQ_HAS_PIPELINING
+		if (pipeline) {
+			if (PQsendPrepare(conn, lua_tostring(L, -3),
+			    lua_tostring(L, -1), types != NULL ? nparams : 0,
+			    types) && PQpipelineSync(conn))
+				syncs++;
+		} else
+#endif
+		PQclear(PQprepare(conn, lua_tostring(L, -3),
+		    lua_tostring(L, -1), types != NULL ? nparams : 0, types));
+		free(types);
+		lua_pop(L, 2);
 	}
-	if (sqlParams) {
-		paramTypes = calloc(sqlParams, sizeof(Oid));
-		if (paramTypes == NULL)
-			return luaL_error(L, "out of memory");
+	lua_pop(L, 1);
 
-		for (n = 0, sqlParams = 0; n < nParams; n++) {
-			if (get_sql_params(L, 4 + n, sqlParams,
-			    paramTypes, NULL, NULL, NULL, &count)) {
-			    	free(paramTypes);
-			    	return luaL_error(L, "out of memory");
+#ifdef LIBPQ_HAS_PIPELINING
+	if (pipeline) {
+		while (syncs > 0) {
+			r = PQgetResult(conn);
+			if (r == NULL) {
+				if (PQstatus(conn) == CONNECTION_BAD)
+					break;
+				continue;
 			}
-			sqlParams += count;
+			if (PQresultStatus(r) == PGRES_PIPELINE_SYNC)
+				syncs--;
+			PQclear(r);
 		}
-	} else
-		paramTypes = NULL;
-	res = lua_newuserdata(L, sizeof(PGresult *));
-	*res = PQprepare(pgsql_conn(L, 1), luaL_checkstring(L, 2),
-	    luaL_checkstring(L, 3), sqlParams, paramTypes);
-	luaL_getmetatable(L, RES_METATABLE);
-	lua_setmetatable(L, -2);
-	if (sqlParams)
-		free(paramTypes);
-	return 1;
+		PQexitPipelineMode(conn);
+	}
+#endif
 }
 
+/*
+ * Called after a call on the connection at idx failed.  If the
+ * connection was lost and is resilient, reconnect and replay.  Returns
+ * 1 if the failed call may be repeated; it must then also be read-only
+ * unless it was a prepare.
+ */
+static void cache_reconnected(lua_State *, int);
+
 static int
-conn_execPrepared(lua_State *L)
+pgsql_recover(lua_State *L, int idx, PGTransactionStatusType before)
 {
-	PGresult **res;
-	char **paramValues;
-	int n, nParams, sqlParams, *paramLengths, *paramFormats, count;
-
-	nParams = lua_gettop(L) - 2;	/* subtract connection and name */
-	if (nParams < 0)
-		nParams = 0;
-
-	for (n = 0, sqlParams = 0; n < nParams; n++) {
-		get_sql_params(L, 3 + n, sqlParams, NULL, NULL,  NULL, NULL,
-		    &count);
-		sqlParams += count;
+	PGconn *conn;
+	int retry;
+
+	conn = *(PGconn **)lua_touserdata(L, idx);
+	if (conn == NULL || PQstatus(conn) != CONNECTION_BAD ||
+	    !conn_resilience(L, idx))
+		return 0;
+	lua_getfield(L, -1, "timeout");
+	if (!pgsql_reconnect(conn, lua_tointeger(L, -1))) {
+		lua_pop(L, 2);
+		return 0;
 	}
-	if (sqlParams) {
-		paramValues = calloc(sqlParams, sizeof(char *));
-		paramLengths = calloc(sqlParams, sizeof(int));
-		paramFormats = calloc(sqlParams, sizeof(int));
-
-		if (paramValues == NULL || paramLengths == NULL
-		    || paramFormats == NULL)
-		    	goto errout;
+	lua_pop(L, 1);
+	pgsql_replay(L, conn);
+	cache_reconnected(L, idx);
+	lua_getfield(L, -1, "retry");
+	retry = lua_toboolean(L, -1) && before == PQTRANS_IDLE;
+	lua_pop(L, 2);
+	return retry;
+}
 
-		for (n = 0, sqlParams = 0; n < nParams; n++) {
-			if (get_sql_params(L, 3 + n, sqlParams, NULL,
-			    paramValues, paramLengths, paramFormats, &count))
-			    	goto errout;
-			sqlParams += count;
-		}
-	} else {
-		paramValues = NULL;
-		paramLengths = NULL;
-		paramFormats = NULL;
+/*
+ * conn:setResilient(opts) turns resilient mode on, conn:setResilient(false)
+ * turns it off.  opts.timeout limits a reconnect, in milliseconds (10000
+ * by default).  With opts.retry, a call that looks like a plain read and
+ * was made outside a transaction is sent again after a reconnect.
+ */
+static int
+conn_setResilient(lua_State *L)
+{
+	pgsql_conn(L, 1);
+	lua_getuservalue(L, 1);
+	if (!lua_istable(L, -1))
+		return luaL_error(L, "connection has no uservalue table");
+	if (!lua_toboolean(L, 2)) {
+		lua_pushnil(L);
+		lua_setfield(L, -2, "resilient");
+		return 0;
 	}
-	res = lua_newuserdata(L, sizeof(PGresult *));
-	*res = PQexecPrepared(pgsql_conn(L, 1), luaL_checkstring(L, 2),
-	    sqlParams, (const char * const*)paramValues, paramLengths,
-	    paramFormats, 0);
-	luaL_getmetatable(L, RES_METATABLE);
-	lua_setmetatable(L, -2);
-	if (sqlParams) {
-		for (n = 0; n < sqlParams; n++)
-			free((void *)paramValues[n]);
-		free(paramValues);
-		free(paramLengths);
-		free(paramFormats);
+	lua_getfield(L, -1, "resilient");
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		lua_createtable(L, 0, 4);
+		lua_newtable(L);
+		lua_setfield(L, -2, "prepared");
+		lua_newtable(L);
+		lua_setfield(L, -2, "settings");
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -3, "resilient");
 	}
-	return 1;
-errout:
-	if (paramValues) {
-		for (n = 0; n < sqlParams; n++)
-			free(paramValues[n]);
-		free(paramValues);
+	lua_pushboolean(L, 0);
+	lua_setfield(L, -2, "retry");
+	lua_pushinteger(L, 10000);
+	lua_setfield(L, -2, "timeout");
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "retry");
+		if (!lua_isnil(L, -1)) {
+			lua_pushboolean(L, lua_toboolean(L, -1));
+			lua_setfield(L, -3, "retry");
+		}
+		lua_pop(L, 1);
+		lua_getfield(L, 2, "timeout");
+		if (!lua_isnil(L, -1)) {
+			lua_pushinteger(L, luaL_checkinteger(L, -1));
+			lua_setfield(L, -3, "timeout");
+		}
+		lua_pop(L, 1);
 	}
-	free(paramLengths);
-	free(paramFormats);
-	return luaL_error(L, "out of memory");
+	return 0;
 }
 
+static void tx_flush(lua_State *, int);
+
+/* Change a session setting, it is restored after a reconnect */
 static int
-conn_describePrepared(lua_State *L)
+conn_set(lua_State *L)
 {
 	PGresult **res;
-	res = lua_newuserdata(L, sizeof(PGresult *));
-	*res = PQdescribePrepared(pgsql_conn(L, 1), luaL_checkstring(L, 2));
-	luaL_getmetatable(L, RES_METATABLE);
-	lua_setmetatable(L, -2);
+	PGconn *conn;
+	const char *values[2];
+
+	conn = pgsql_conn_query(L, 1);
+	values[0] = luaL_checkstring(L, 2);
+	values[1] = luaL_checkstring(L, 3);
+	tx_flush(L, 1);
+	res = pgsql_res_new(L, 1);
+	*res = PQexecParams(conn, "SELECT pg_catalog.set_config($1, $2, "
+	    "false)", 2, NULL, values, NULL, NULL, 0);
+	pgsql_res_account(L, *res);
+	if (PQresultStatus(*res) == PGRES_TUPLES_OK &&
+	    conn_resilience(L, 1)) {
+		lua_getfield(L, -1, "settings");
+		lua_pushvalue(L, 3);
+		lua_setfield(L, -2, values[0]);
+		lua_pop(L, 2);
+	}
 	return 1;
 }
 
+/*
+ * Query deadlines
+ *
+ * A query that runs past its deadline is cancelled by a watchdog
+ * thread using the cancel handle cached in the connection's uservalue.
+ * Armed deadlines live on the stack of the calling function and are
+ * linked into a list that the watchdog walks; a deadline is only
+ * unlinked with the lock held, so the watchdog never sees a stale one.
+ * PQcancel() talks to the server, so the watchdog sends it without the
+ * lock; a deadline being fired is not unlinked until the cancel is sent.
+ */
+
+static pthread_mutex_t watchdog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t watchdog_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t watchdog_fired = PTHREAD_COND_INITIALIZER;
+static pthread_t watchdog_thread;
+static deadline *watchdog_list;
+static int watchdog_running, watchdog_stop;
+
 static int
-conn_describePortal(lua_State *L)
+timespec_before(const struct timespec *a, const struct timespec *b)
 {
-	PGresult **res;
-	res = lua_newuserdata(L, sizeof(PGresult *));
-	*res = PQdescribePortal(pgsql_conn(L, 1), luaL_checkstring(L, 2));
-	luaL_getmetatable(L, RES_METATABLE);
-	lua_setmetatable(L, -2);
-	return 1;
+	return a->tv_sec < b->tv_sec ||
+	    (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
 }
 
-static int
-conn_escapeString(lua_State *L)
+static void *
+watchdog(void *arg)
 {
-	PGconn *d;
-	size_t len;
-	char *buf;
-	const char *str;
-	int error;
-
-	d = pgsql_conn(L, 1);
+	deadline *d, *next;
+	PGcancel *cancel;
+	struct timespec now;
+	char errbuf[256];
 
-	str = lua_tolstring(L, 2, &len);
-	if (str == NULL) {
-		lua_pushnil(L);
-		return 1;
+	pthread_mutex_lock(&watchdog_lock);
+	while (!watchdog_stop) {
+		next = NULL;
+		clock_gettime(CLOCK_REALTIME, &now);
+		for (d = watchdog_list; d != NULL; d = d->next) {
+			if (d->fired)
+				continue;
+			if (!timespec_before(&now, &d->at))
+				break;
+			if (next == NULL || timespec_before(&d->at, &next->at))
+				next = d;
+		}
+		if (d != NULL) {
+			/* d stays linked until firing is cleared */
+			d->fired = d->firing = 1;
+			cancel = d->cancel;
+			pthread_mutex_unlock(&watchdog_lock);
+			PQcancel(cancel, errbuf, sizeof errbuf);
+			pthread_mutex_lock(&watchdog_lock);
+			d->firing = 0;
+			pthread_cond_broadcast(&watchdog_fired);
+			continue;
+		}
+		if (next != NULL)
+			pthread_cond_timedwait(&watchdog_cond, &watchdog_lock,
+			    &next->at);
+		else
+			pthread_cond_wait(&watchdog_cond, &watchdog_lock);
 	}
-	buf = calloc(len + 1, 2);
-	if (buf == NULL)
-		return luaL_error(L, "out of memory");
+	watchdog_running = 0;
+	pthread_mutex_unlock(&watchdog_lock);
+	return NULL;
+}
 
-	PQescapeStringConn(d, buf, str, len, &error);
-	if (!error)
-		lua_pushstring(L, buf);
-	else
-		lua_pushnil(L);
-	free(buf);
-	return 1;
+/* Stop the watchdog thread, if it is running */
+static void
+watchdog_shutdown(void)
+{
+	int join = 0;
+
+	pthread_mutex_lock(&watchdog_lock);
+	if (watchdog_running) {
+		watchdog_stop = 1;
+		join = 1;
+		pthread_cond_signal(&watchdog_cond);
+	}
+	pthread_mutex_unlock(&watchdog_lock);
+	if (join) {
+		pthread_join(watchdog_thread, NULL);
+		pthread_mutex_lock(&watchdog_lock);
+		watchdog_stop = 0;
+		pthread_mutex_unlock(&watchdog_lock);
+	}
 }
 
-static int
-conn_escapeLiteral(lua_State *L)
+/* Return the cancel handle of the connection at idx, NULL on failure */
+static PGcancel *
+conn_canceler(lua_State *L, int idx)
 {
-	const char *s;
-	char *p;
-	PGconn *d;
-	size_t len;
+	cancelHandle *h;
+	PGconn *conn;
 
-	d = pgsql_conn(L, 1);
-	s = luaL_checklstring(L, 2, &len);
-	p = PQescapeLiteral(d, s, len);
-	lua_pushstring(L, p);
-	PQfreemem(p);
-	return 1;
+	conn = pgsql_conn(L, idx);
+	lua_getuservalue(L, idx);
+	lua_getfield(L, -1, "cancel");
+	h = lua_touserdata(L, -1);
+	if (h == NULL) {
+		lua_pop(L, 1);
+		h = lua_newuserdata(L, sizeof(cancelHandle));
+		h->cancel = NULL;
+		h->pid = 0;
+		luaL_getmetatable(L, CANCEL_METATABLE);
+		lua_setmetatable(L, -2);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -3, "cancel");
+	}
+	lua_pop(L, 2);
+	if (h->cancel == NULL || h->pid != PQbackendPID(conn)) {
+		if (h->cancel != NULL)
+			PQfreeCancel(h->cancel);
+		h->cancel = PQgetCancel(conn);
+		h->pid = PQbackendPID(conn);
+	}
+	return h->cancel;
 }
 
 static int
-conn_escapeIdentifier(lua_State *L)
+cancel_clear(lua_State *L)
 {
-	const char *s;
-	char *p;
-	PGconn *d;
-	size_t len;
+	cancelHandle *h;
 
-	d = pgsql_conn(L, 1);
-	s = luaL_checklstring(L, 2, &len);
-	p = PQescapeIdentifier(d, s, len);
-	lua_pushstring(L, p);
-	PQfreemem(p);
-	return 1;
+	h = luaL_checkudata(L, 1, CANCEL_METATABLE);
+	if (h->cancel != NULL) {
+		PQfreeCancel(h->cancel);
+		h->cancel = NULL;
+	}
+	return 0;
 }
 
-static int
-conn_escapeBytea(lua_State *L)
+/*
+ * The timeout in milliseconds for a query on the connection at idx,
+ * taken from the options table at opts, if not 0, or else from
+ * conn:setTimeout().
+ */
+static lua_Integer
+query_timeout(lua_State *L, int idx, int opts)
 {
-	unsigned char *p;
-	const unsigned char *s;
-	PGconn *d;
-	size_t from_length, to_length;
+	lua_Integer timeout;
 
-	d = pgsql_conn(L, 1);
-	s = (const unsigned char *)luaL_checklstring(L, 2, &from_length);
-	p = PQescapeByteaConn(d, s, from_length, &to_length);
-	lua_pushstring(L, (const char *)p);
-	lua_pushinteger(L, to_length);
-	PQfreemem(p);
-	return 2;
+	if (opts && lua_istable(L, opts)) {
+		lua_getfield(L, opts, "timeout");
+		if (!lua_isnil(L, -1)) {
+			timeout = luaL_checkinteger(L, -1);
+			lua_pop(L, 1);
+			return timeout;
+		}
+		lua_pop(L, 1);
+	}
+	lua_getuservalue(L, idx);
+	lua_getfield(L, -1, "timeout");
+	timeout = lua_tointeger(L, -1);
+	lua_pop(L, 2);
+	return timeout;
 }
 
+/* Arm a deadline of timeout ms from now, returns 1 if it was armed */
 static int
-conn_unescapeBytea(lua_State *L)
+deadline_arm(deadline *d, PGcancel *cancel, lua_Integer timeout)
 {
-	unsigned char *p;
-	size_t len;
+	if (timeout <= 0 || cancel == NULL)
+		return 0;
+	d->cancel = cancel;
+	d->fired = d->firing = 0;
+	clock_gettime(CLOCK_REALTIME, &d->at);
+	d->at.tv_sec += timeout / 1000;
+	d->at.tv_nsec += (timeout % 1000) * 1000000L;
+	if (d->at.tv_nsec >= 1000000000L) {
+		d->at.tv_sec++;
+		d->at.tv_nsec -= 1000000000L;
+	}
 
-	p = PQunescapeBytea((const unsigned char *)luaL_checkstring(L, 2),
-	    &len);
-	if (p == NULL)
-		lua_pushnil(L);
-	else {
-		lua_pushlstring(L, (const char *)p, len);
-		PQfreemem(p);
+	pthread_mutex_lock(&watchdog_lock);
+	if (!watchdog_running) {
+		if (pthread_create(&watchdog_thread, NULL, watchdog, NULL)) {
+			pthread_mutex_unlock(&watchdog_lock);
+			return 0;
+		}
+		watchdog_running = 1;
 	}
+	d->next = watchdog_list;
+	watchdog_list = d;
+	pthread_cond_signal(&watchdog_cond);
+	pthread_mutex_unlock(&watchdog_lock);
 	return 1;
 }
 
+static void
+deadline_disarm(deadline *d)
+{
+	deadline **p;
+
+	pthread_mutex_lock(&watchdog_lock);
+	while (d->firing)
+		pthread_cond_wait(&watchdog_fired, &watchdog_lock);
+	for (p = &watchdog_list; *p != NULL; p = &(*p)->next)
+		if (*p == d) {
+			*p = d->next;
+			break;
+		}
+	pthread_mutex_unlock(&watchdog_lock);
+}
+
 /*
- * Asynchronous Command Execution Functions
+ * Arm a deadline for a query on the connection at idx.  The deadline is
+ * linked into the watchdog's list, so nothing that can raise an error
+ * may happen before it is disarmed.
  */
 static int
-conn_sendQuery(lua_State *L)
+query_deadline(lua_State *L, int idx, int opts, deadline *d)
 {
-	lua_pushinteger(L, PQsendQuery(pgsql_conn(L, 1),
-	    luaL_checkstring(L, 2)));
-	return 1;
+	lua_Integer timeout;
+
+	timeout = query_timeout(L, idx, opts);
+	if (timeout <= 0)
+		return 0;
+	return deadline_arm(d, conn_canceler(L, idx), timeout);
 }
 
+/* Set the default query timeout in milliseconds, 0 or nil disable it */
 static int
-conn_sendQueryParams(lua_State *L)
+conn_setTimeout(lua_State *L)
 {
-	Oid *paramTypes;
-	char **paramValues;
-	int n, nParams, sqlParams, *paramLengths, *paramFormats, count;
+	pgsql_conn(L, 1);
+	lua_getuservalue(L, 1);
+	if (lua_isnoneornil(L, 2) || luaL_checkinteger(L, 2) <= 0)
+		lua_pushnil(L);
+	else
+		lua_pushinteger(L, lua_tointeger(L, 2));
+	lua_setfield(L, -2, "timeout");
+	return 0;
+}
+
+/*
+ * Arbitrary precision numbers
+ *
+ * pgsql.numeric values use the representation of the server: base
+ * NBASE digits, the weight of the first digit, a sign and the display
+ * scale.  Binary numeric fields are decoded into them without going
+ * through text, and they are sent as binary numeric parameters.  The
+ * arithmetic follows the server's numeric.c, results are exact.
+ */
 
-	nParams = lua_gettop(L) - 2;	/* subtract connection and command */
-	if (nParams < 0)
-		nParams = 0;
+#define NBASE		10000
+#define HALF_NBASE	5000
+#define DEC_DIGITS	4
 
-	for (n = 0, sqlParams = 0; n < nParams; n++) {
-		get_sql_params(L, 3 + n, 0, NULL, NULL, NULL, NULL, &count);
-		sqlParams += count;
-	}
-	if (sqlParams) {
-		paramTypes = calloc(sqlParams, sizeof(Oid));
-		paramValues = calloc(sqlParams, sizeof(char *));
-		paramLengths = calloc(sqlParams, sizeof(int));
-		paramFormats = calloc(sqlParams, sizeof(int));
+#define NUMERIC_POS	0x0000
+#define NUMERIC_NEG	0x4000
+#define NUMERIC_NAN	0xC000
+#define NUMERIC_PINF	0xD000
+#define NUMERIC_NINF	0xF000
 
-		if (paramTypes == NULL || paramValues == NULL
-		    || paramLengths == NULL || paramFormats == NULL)
-		    	goto errout;
+#define NUMERIC_MAX_SCALE	1000
 
-		for (n = 0, sqlParams = 0; n < nParams; n++) {
-			if (get_sql_params(L, 3 + n, sqlParams, paramTypes,
-			    paramValues, paramLengths, paramFormats, &count))
-			    	goto errout;
-			sqlParams += count;
-		}
-	} else {
-		paramTypes = NULL;
-		paramValues = NULL;
-		paramLengths = NULL;
-		paramFormats = NULL;
+static numeric *
+numeric_alloc(int ndigits)
+{
+	numeric *n;
+
+	n = malloc(sizeof(numeric) + (ndigits > 0 ? ndigits : 1) *
+	    sizeof(int16_t));
+	if (n == NULL)
+		return NULL;
+	n->ndigits = ndigits;
+	n->weight = 0;
+	n->sign = NUMERIC_POS;
+	n->dscale = 0;
+	return n;
+}
+
+/* Remove leading and trailing zero digits, zero has no digits at all */
+static void
+numeric_strip(numeric *n)
+{
+	int lead = 0;
+
+	while (lead < n->ndigits && n->digits[lead] == 0) {
+		lead++;
+		n->weight--;
 	}
-	lua_pushinteger(L,
-	    PQsendQueryParams(pgsql_conn(L, 1),
-	    luaL_checkstring(L, 2), sqlParams, paramTypes,
-	    (const char * const*)paramValues, paramLengths, paramFormats, 0));
-	if (sqlParams) {
-		for (n = 0; n < sqlParams; n++)
-			free((void *)paramValues[n]);
-		free(paramTypes);
-		free(paramValues);
-		free(paramLengths);
-		free(paramFormats);
+	if (lead > 0) {
+		memmove(n->digits, n->digits + lead, (n->ndigits - lead) *
+		    sizeof(int16_t));
+		n->ndigits -= lead;
 	}
-	return 1;
-errout:
-	if (paramValues) {
-		for (n = 0; n < sqlParams; n++)
-			free((void *)paramValues[n]);
-		free(paramValues);
+	while (n->ndigits > 0 && n->digits[n->ndigits - 1] == 0)
+		n->ndigits--;
+	if (n->ndigits == 0) {
+		n->weight = 0;
+		if (n->sign != NUMERIC_NAN)
+			n->sign = NUMERIC_POS;
 	}
-	free(paramTypes);
-	free(paramLengths);
-	free(paramFormats);
-	return luaL_error(L, "out of memory");
 }
 
-static int
-conn_sendPrepare(lua_State *L)
+/* Push a copy of n as a new numeric userdata and free n */
+static numeric *
+numeric_push(lua_State *L, numeric *n)
 {
-	Oid *paramTypes;
-	int n, nParams, sqlParams, count;
+	numeric *u;
 
-	nParams = lua_gettop(L) - 3;	/* subtract connection, name, command */
-	if (nParams < 0)
-		nParams = 0;
+	if (n == NULL)
+		luaL_error(L, "out of memory");
+	u = lua_newuserdata(L, sizeof(numeric) +
+	    (n->ndigits > 0 ? n->ndigits : 1) * sizeof(int16_t));
+	memcpy(u, n, sizeof(numeric) + (n->ndigits > 0 ? n->ndigits : 1) *
+	    sizeof(int16_t));
+	free(n);
+	luaL_getmetatable(L, NUMERIC_METATABLE);
+	lua_setmetatable(L, -2);
+	return u;
+}
 
-	for (n = 0, sqlParams = 0; n < nParams; n++) {
-		get_sql_params(L, 4 + n, 0, NULL, NULL, NULL, NULL, &count);
-		sqlParams += count;
+/* Parse a numeric from text as accepted by the server, NULL if invalid */
+static numeric *
+numeric_parse(const char *s)
+{
+	numeric *n;
+	unsigned char *dec;
+	const char *cp;
+	char *end;
+	long exponent;
+	int sign, have_dp, dweight, dscale, ddigits, weight, offset;
+	int ndigits, i;
+
+	cp = s;
+	while (*cp == ' ' || *cp == '\t' || *cp == '\n')
+		cp++;
+	if (!strncasecmp(cp, "nan", 3)) {
+		n = numeric_alloc(0);
+		if (n != NULL)
+			n->sign = NUMERIC_NAN;
+		return n;
 	}
-	if (sqlParams) {
-		paramTypes = calloc(sqlParams, sizeof(Oid));
-		if (paramTypes == NULL)
-			return luaL_error(L, "out of memory");
+	sign = NUMERIC_POS;
+	if (*cp == '-' || *cp == '+') {
+		if (*cp == '-')
+			sign = NUMERIC_NEG;
+		cp++;
+	}
+	dec = malloc(strlen(cp) + DEC_DIGITS * 2);
+	if (dec == NULL)
+		return NULL;
+	/* leading padding for digit alignment */
+	memset(dec, 0, DEC_DIGITS);
+	i = DEC_DIGITS;
+	have_dp = 0;
+	dweight = -1;
+	dscale = 0;
+	if (!(*cp >= '0' && *cp <= '9') && !(*cp == '.' &&
+	    cp[1] >= '0' && cp[1] <= '9')) {
+		free(dec);
+		return NULL;
+	}
+	for (; *cp; cp++) {
+		if (*cp >= '0' && *cp <= '9') {
+			dec[i++] = *cp - '0';
+			if (!have_dp)
+				dweight++;
+			else
+				dscale++;
+		} else if (*cp == '.' && !have_dp)
+			have_dp = 1;
+		else
+			break;
+	}
+	ddigits = i - DEC_DIGITS;
+	/* trailing padding for digit alignment */
+	memset(dec + i, 0, DEC_DIGITS - 1);
+	if (*cp == 'e' || *cp == 'E') {
+		exponent = strtol(cp + 1, &end, 10);
+		if (end == cp + 1 || exponent > 1000 || exponent < -1000) {
+			free(dec);
+			return NULL;
+		}
+		cp = end;
+		dweight += (int)exponent;
+		dscale -= (int)exponent;
+		if (dscale < 0)
+			dscale = 0;
+	}
+	while (*cp == ' ' || *cp == '\t' || *cp == '\n')
+		cp++;
+	if (*cp != '\0') {
+		free(dec);
+		return NULL;
+	}
+
+	if (dweight >= 0)
+		weight = (dweight + 1 + DEC_DIGITS - 1) / DEC_DIGITS - 1;
+	else
+		weight = -((-dweight - 1) / DEC_DIGITS + 1);
+	offset = (weight + 1) * DEC_DIGITS - (dweight + 1);
+	ndigits = (ddigits + offset + DEC_DIGITS - 1) / DEC_DIGITS;
+
+	n = numeric_alloc(ndigits);
+	if (n == NULL) {
+		free(dec);
+		return NULL;
+	}
+	n->sign = sign;
+	n->weight = weight;
+	n->dscale = dscale;
+	for (i = DEC_DIGITS - offset, ndigits = 0; ndigits < n->ndigits;
+	    ndigits++, i += DEC_DIGITS)
+		n->digits[ndigits] = ((dec[i] * 10 + dec[i + 1]) * 10 +
+		    dec[i + 2]) * 10 + dec[i + 3];
+	free(dec);
+	numeric_strip(n);
+	return n;
+}
 
-		for (n = 0, sqlParams = 0; n < nParams; n++) {
-			if (get_sql_params(L, 4 + n, sqlParams,
-			    paramTypes, NULL, NULL, NULL, &count)) {
-			    	free(paramTypes);
-			    	return luaL_error(L, "out of memory");
+/* Format n into a malloc'ed string */
+static char *
+numeric_format(const numeric *n)
+{
+	char *str, *cp, *endcp;
+	int d, d1, dig, putit, i;
+
+	if (n->sign == NUMERIC_NAN)
+		return strdup("NaN");
+	i = (n->weight + 1 > 0 ? n->weight + 1 : 1) * DEC_DIGITS +
+	    n->dscale + DEC_DIGITS + 2;
+	str = malloc(i);
+	if (str == NULL)
+		return NULL;
+	cp = str;
+	if (n->sign == NUMERIC_NEG)
+		*cp++ = '-';
+
+	if (n->weight < 0) {
+		d = n->weight + 1;
+		*cp++ = '0';
+	} else {
+		for (d = 0; d <= n->weight; d++) {
+			dig = d < n->ndigits ? n->digits[d] : 0;
+			/* no leading zeroes in the first digit */
+			putit = d > 0;
+			for (d1 = 1000; d1 > 0; d1 /= 10) {
+				if (putit || dig >= d1 || d1 == 1) {
+					*cp++ = '0' + dig / d1;
+					putit = 1;
+				}
+				dig %= d1;
 			}
-			sqlParams += count;
 		}
-	} else
-		paramTypes = NULL;
-	lua_pushinteger(L, PQsendPrepare(pgsql_conn(L, 1),
-	    luaL_checkstring(L, 2), luaL_checkstring(L, 3), sqlParams,
-	    paramTypes));
-	if (sqlParams)
-		free(paramTypes);
-	return 1;
+	}
+	if (n->dscale > 0) {
+		*cp++ = '.';
+		endcp = cp + n->dscale;
+		for (i = 0; i < n->dscale; d++, i += DEC_DIGITS) {
+			dig = d >= 0 && d < n->ndigits ? n->digits[d] : 0;
+			for (d1 = 1000; d1 > 0; d1 /= 10) {
+				*cp++ = '0' + dig / d1;
+				dig %= d1;
+			}
+		}
+		cp = endcp;
+	}
+	*cp = '\0';
+	return str;
 }
 
+/* Compare the absolute values */
 static int
-conn_sendQueryPrepared(lua_State *L)
+numeric_cmp_abs(const numeric *a, const numeric *b)
 {
-	char **paramValues;
-	int n, nParams, sqlParams, *paramLengths, *paramFormats, count;
-
-	nParams = lua_gettop(L) - 2;	/* subtract connection and name */
-	if (nParams < 0)
-		nParams = 0;
+	int i1 = 0, i2 = 0, w1 = a->weight, w2 = b->weight;
 
-	for (n = 0, sqlParams = 0; n < nParams; n++) {
-		get_sql_params(L, 3 + n, 0, NULL, NULL, NULL, NULL, &count);
-		sqlParams += count;
-	}
-	if (sqlParams) {
-		paramValues = calloc(sqlParams, sizeof(char *));
-		paramLengths = calloc(sqlParams, sizeof(int));
-		paramFormats = calloc(sqlParams, sizeof(int));
-
-		if (paramValues == NULL || paramLengths == NULL
-		    || paramFormats == NULL)
-		    	goto errout;
-
-		for (n = 0, sqlParams = 0; n < nParams; n++) {
-			if (get_sql_params(L, 3 + n, sqlParams, NULL,
-			    paramValues, paramLengths, paramFormats, &count))
-			    	goto errout;
-			sqlParams += count;
-		}
-	} else {
-		paramValues = NULL;
-		paramLengths = NULL;
-		paramFormats = NULL;
-	}
-	lua_pushinteger(L,
-	    PQsendQueryPrepared(pgsql_conn(L, 1), luaL_checkstring(L, 2),
-	    nParams, (const char * const*)paramValues, paramLengths,
-	    paramFormats, 0));
-	if (nParams) {
-		for (n = 0; n < nParams; n++)
-			free((void *)paramValues[n]);
-		free(paramValues);
-		free(paramLengths);
-		free(paramFormats);
+	while (w1 > w2 && i1 < a->ndigits) {
+		if (a->digits[i1++] != 0)
+			return 1;
+		w1--;
 	}
-	return 1;
-errout:
-	if (paramValues) {
-		for (n = 0; n < nParams; n++)
-			free(paramValues[n]);
-		free(paramValues);
+	while (w2 > w1 && i2 < b->ndigits) {
+		if (b->digits[i2++] != 0)
+			return -1;
+		w2--;
 	}
-	free(paramLengths);
-	free(paramFormats);
-	return luaL_error(L, "out of memory");
+	if (w1 == w2)
+		while (i1 < a->ndigits && i2 < b->ndigits) {
+			if (a->digits[i1] != b->digits[i2])
+				return a->digits[i1] > b->digits[i2] ? 1 : -1;
+			i1++;
+			i2++;
+		}
+	while (i1 < a->ndigits)
+		if (a->digits[i1++] != 0)
+			return 1;
+	while (i2 < b->ndigits)
+		if (b->digits[i2++] != 0)
+			return -1;
+	return 0;
 }
 
+/* NaN equals NaN and is greater than any other value, as on the server */
 static int
-conn_sendDescribePrepared(lua_State *L)
+numeric_cmp(const numeric *a, const numeric *b)
 {
-	lua_pushinteger(L,
-	    PQsendDescribePrepared(pgsql_conn(L, 1), luaL_checkstring(L, 2)));
-	return 1;
+	if (a->sign == NUMERIC_NAN || b->sign == NUMERIC_NAN)
+		return (a->sign == NUMERIC_NAN) - (b->sign == NUMERIC_NAN);
+	if (a->ndigits == 0 && b->ndigits == 0)
+		return 0;
+	if (a->ndigits == 0)
+		return b->sign == NUMERIC_POS ? -1 : 1;
+	if (b->ndigits == 0)
+		return a->sign == NUMERIC_POS ? 1 : -1;
+	if (a->sign != b->sign)
+		return a->sign == NUMERIC_POS ? 1 : -1;
+	return a->sign == NUMERIC_POS ? numeric_cmp_abs(a, b) :
+	    numeric_cmp_abs(b, a);
 }
 
+/* Digits after the decimal point needed for both operands */
 static int
-conn_sendDescribePortal(lua_State *L)
+numeric_rscale(const numeric *a, const numeric *b)
 {
-	lua_pushinteger(L,
-	    PQsendDescribePortal(pgsql_conn(L, 1), luaL_checkstring(L, 2)));
-	return 1;
+	int r1, r2;
+
+	r1 = a->ndigits - a->weight - 1;
+	r2 = b->ndigits - b->weight - 1;
+	return r1 > r2 ? r1 : r2;
 }
 
-static int
-conn_getResult(lua_State *L)
+static numeric *
+numeric_add_abs(const numeric *a, const numeric *b)
 {
-	PGresult *r, **res;
+	numeric *r;
+	int i, i1, i2, rscale, weight, ndigits, carry = 0;
+
+	weight = (a->weight > b->weight ? a->weight : b->weight) + 1;
+	rscale = numeric_rscale(a, b);
+	ndigits = rscale + weight + 1;
+	if (ndigits <= 0)
+		ndigits = 1;
+	r = numeric_alloc(ndigits);
+	if (r == NULL)
+		return NULL;
+	r->weight = weight;
+	r->dscale = a->dscale > b->dscale ? a->dscale : b->dscale;
+	i1 = rscale + a->weight + 1;
+	i2 = rscale + b->weight + 1;
+	for (i = ndigits - 1; i >= 0; i--) {
+		i1--;
+		i2--;
+		if (i1 >= 0 && i1 < a->ndigits)
+			carry += a->digits[i1];
+		if (i2 >= 0 && i2 < b->ndigits)
+			carry += b->digits[i2];
+		if (carry >= NBASE) {
+			r->digits[i] = carry - NBASE;
+			carry = 1;
+		} else {
+			r->digits[i] = carry;
+			carry = 0;
+		}
+	}
+	numeric_strip(r);
+	return r;
+}
 
-	r = PQgetResult(pgsql_conn(L, 1));
+/* |a| - |b|, |a| must not be smaller than |b| */
+static numeric *
+numeric_sub_abs(const numeric *a, const numeric *b)
+{
+	numeric *r;
+	int i, i1, i2, rscale, ndigits, borrow = 0;
+
+	rscale = numeric_rscale(a, b);
+	ndigits = rscale + a->weight + 1;
+	if (ndigits <= 0)
+		ndigits = 1;
+	r = numeric_alloc(ndigits);
 	if (r == NULL)
-		lua_pushnil(L);
-	else {
-		res = lua_newuserdata(L, sizeof(PGresult *));
-		*res = r;
-		luaL_getmetatable(L, RES_METATABLE);
-		lua_setmetatable(L, -2);
+		return NULL;
+	r->weight = a->weight;
+	r->dscale = a->dscale > b->dscale ? a->dscale : b->dscale;
+	i1 = rscale + a->weight + 1;
+	i2 = rscale + b->weight + 1;
+	for (i = ndigits - 1; i >= 0; i--) {
+		i1--;
+		i2--;
+		if (i1 >= 0 && i1 < a->ndigits)
+			borrow += a->digits[i1];
+		if (i2 >= 0 && i2 < b->ndigits)
+			borrow -= b->digits[i2];
+		if (borrow < 0) {
+			r->digits[i] = borrow + NBASE;
+			borrow = -1;
+		} else {
+			r->digits[i] = borrow;
+			borrow = 0;
+		}
 	}
-	return 1;
+	numeric_strip(r);
+	return r;
 }
 
-static int
-conn_cancel(lua_State *L)
+static numeric *
+numeric_nan(void)
 {
-	PGconn *d;
-	PGcancel *cancel;
-	char errbuf[256];
-	int res = 1;
+	numeric *r;
 
-	d = pgsql_conn(L, 1);
-	cancel = PQgetCancel(d);
-	if (cancel != NULL) {
-		res = PQcancel(cancel, errbuf, sizeof errbuf);
-		if (!res) {
-			lua_pushboolean(L, 0);
-			lua_pushstring(L, errbuf);
-		} else
-			lua_pushboolean(L, 1);
-		PQfreeCancel(cancel);
-	} else
-		lua_pushboolean(L, 0);
-	return res == 1 ? 1 : 2;
+	r = numeric_alloc(0);
+	if (r != NULL)
+		r->sign = NUMERIC_NAN;
+	return r;
 }
 
-#if PG_VERSION_NUM >= 90200
-static int
-conn_setSingleRowMode(lua_State *L)
+/* a + b, or a - b if negate is set */
+static numeric *
+numeric_add(const numeric *a, const numeric *b, int negate)
 {
-	lua_pushinteger(L, PQsetSingleRowMode(pgsql_conn(L, 1)));
-	return 1;
+	numeric *r;
+	int bsign, c;
+
+	if (a->sign == NUMERIC_NAN || b->sign == NUMERIC_NAN)
+		return numeric_nan();
+	bsign = b->sign;
+	if (negate && b->ndigits > 0)
+		bsign = bsign == NUMERIC_POS ? NUMERIC_NEG : NUMERIC_POS;
+	if (a->sign == bsign || a->ndigits == 0 || b->ndigits == 0) {
+		if (a->ndigits == 0 && b->ndigits != 0) {
+			r = numeric_add_abs(b, a);
+			if (r != NULL)
+				r->sign = bsign;
+		} else {
+			r = numeric_add_abs(a, b);
+			if (r != NULL && r->ndigits > 0)
+				r->sign = a->ndigits > 0 ? a->sign : bsign;
+		}
+		return r;
+	}
+	c = numeric_cmp_abs(a, b);
+	if (c >= 0) {
+		r = numeric_sub_abs(a, b);
+		if (r != NULL && r->ndigits > 0)
+			r->sign = a->sign;
+	} else {
+		r = numeric_sub_abs(b, a);
+		if (r != NULL && r->ndigits > 0)
+			r->sign = bsign;
+	}
+	return r;
 }
-#endif
 
-/*
- * Asynchronous Notification Functions
- */
-static int
-conn_notifies(lua_State *L)
+static numeric *
+numeric_mul(const numeric *a, const numeric *b)
 {
-	PGnotify **notify, *n;
-
-	n = PQnotifies(pgsql_conn(L, 1));
-	if (n == NULL)
-		lua_pushnil(L);
-	else {
-		notify = lua_newuserdata(L, sizeof(PGnotify *));
-		*notify = n;
-		luaL_getmetatable(L, NOTIFY_METATABLE);
-		lua_setmetatable(L, -2);
+	numeric *r;
+	int64_t *dig, carry, v;
+	int i, i1, i2, ndigits;
+
+	if (a->sign == NUMERIC_NAN || b->sign == NUMERIC_NAN)
+		return numeric_nan();
+	ndigits = a->ndigits + b->ndigits + 1;
+	dig = calloc(ndigits, sizeof(int64_t));
+	r = numeric_alloc(ndigits);
+	if (dig == NULL || r == NULL) {
+		free(dig);
+		free(r);
+		return NULL;
 	}
-	return 1;
+	for (i1 = a->ndigits - 1; i1 >= 0; i1--)
+		for (i2 = b->ndigits - 1; i2 >= 0; i2--)
+			dig[i1 + i2 + 1] += (int64_t)a->digits[i1] *
+			    b->digits[i2];
+	carry = 0;
+	for (i = ndigits - 1; i >= 0; i--) {
+		v = dig[i] + carry;
+		carry = v / NBASE;
+		r->digits[i] = v % NBASE;
+	}
+	free(dig);
+	r->weight = a->weight + b->weight + 1;
+	r->dscale = a->dscale + b->dscale;
+	r->sign = a->sign == b->sign ? NUMERIC_POS : NUMERIC_NEG;
+	numeric_strip(r);
+	return r;
 }
 
-/*
- * Commands associated with the COPY command
- */
-static int
-conn_putCopyData(lua_State *L)
+/* Round to scale digits after the decimal point, halves away from 0 */
+static numeric *
+numeric_round(const numeric *a, int scale)
 {
-	const char *data;
-	size_t len;
+	static const int round_powers[4] = { 0, 1000, 100, 10 };
+	numeric *r;
+	int16_t *digits;
+	int di, ndigits, carry, extra, pow10;
 
-	data = luaL_checklstring(L, 2, &len);
-	lua_pushinteger(L, PQputCopyData(pgsql_conn(L, 1), data, len));
-	return 1;
+	/* one spare leading digit for a carry out of the first digit */
+	r = numeric_alloc(a->ndigits + 1);
+	if (r == NULL)
+		return NULL;
+	r->sign = a->sign;
+	r->weight = a->weight + 1;
+	r->dscale = scale > 0 ? scale : 0;
+	r->digits[0] = 0;
+	memcpy(r->digits + 1, a->digits, a->ndigits * sizeof(int16_t));
+	if (a->sign == NUMERIC_NAN) {
+		numeric_strip(r);
+		return r;
+	}
+
+	digits = r->digits;
+	di = (r->weight + 1) * DEC_DIGITS + scale;
+	if (di < 0) {
+		r->ndigits = 0;
+		numeric_strip(r);
+		return r;
+	}
+	ndigits = (di + DEC_DIGITS - 1) / DEC_DIGITS;
+	di %= DEC_DIGITS;
+	if (ndigits < r->ndigits || (ndigits == r->ndigits && di > 0)) {
+		r->ndigits = ndigits;
+		if (di == 0)
+			carry = digits[ndigits] >= HALF_NBASE ? 1 : 0;
+		else {
+			/* round within the last digit */
+			pow10 = round_powers[di];
+			extra = digits[--ndigits] % pow10;
+			digits[ndigits] -= extra;
+			carry = 0;
+			if (extra >= pow10 / 2) {
+				pow10 += digits[ndigits];
+				if (pow10 >= NBASE) {
+					pow10 -= NBASE;
+					carry = 1;
+				}
+				digits[ndigits] = pow10;
+			}
+		}
+		while (carry && ndigits > 0) {
+			carry += digits[--ndigits];
+			if (carry >= NBASE) {
+				digits[ndigits] = carry - NBASE;
+				carry = 1;
+			} else {
+				digits[ndigits] = carry;
+				carry = 0;
+			}
+		}
+	}
+	numeric_strip(r);
+	return r;
 }
 
-static int
-conn_putCopyEnd(lua_State *L)
+/* The binary wire format: ndigits, weight, sign, dscale, digits */
+static numeric *
+numeric_from_binary(const char *v, int len)
 {
-	lua_pushinteger(L, PQputCopyEnd(pgsql_conn(L, 1), NULL));
-	return 1;
+	numeric *n;
+	uint16_t h[4], d;
+	int i;
+
+	if (len < 8)
+		return NULL;
+	memcpy(h, v, sizeof h);
+	for (i = 0; i < 4; i++)
+		h[i] = ntohs(h[i]);
+	if (len < 8 + 2 * h[0])
+		return NULL;
+	n = numeric_alloc(h[0]);
+	if (n == NULL)
+		return NULL;
+	n->weight = (int16_t)h[1];
+	n->sign = h[2];
+	n->dscale = h[3];
+	for (i = 0; i < n->ndigits; i++) {
+		memcpy(&d, v + 8 + 2 * i, sizeof d);
+		n->digits[i] = ntohs(d);
+	}
+	return n;
 }
 
-static int
-conn_getCopyData(lua_State *L)
+/* Encode n in the binary wire format into buf of 8 + 2 * ndigits bytes */
+static void
+numeric_to_binary(const numeric *n, char *buf)
 {
-	int res;
-	char *data;
+	uint16_t h[4], d;
+	int i;
+
+	h[0] = htons(n->ndigits);
+	h[1] = htons((uint16_t)n->weight);
+	h[2] = htons(n->sign);
+	h[3] = htons(n->dscale);
+	memcpy(buf, h, sizeof h);
+	for (i = 0; i < n->ndigits; i++) {
+		d = htons(n->digits[i]);
+		memcpy(buf + 8 + 2 * i, &d, sizeof d);
+	}
+}
 
-	res = PQgetCopyData(pgsql_conn(L, 1), &data, 0);
-	if (res > 0)
-		lua_pushstring(L, data);
-	else
-		lua_pushnil(L);
-	if (data)
-		PQfreemem(data);
-	return 1;
+/* Return the numeric at idx or NULL if it is something else */
+static numeric *
+numeric_test(lua_State *L, int idx)
+{
+	void *p;
+	int same;
+
+	p = lua_touserdata(L, idx);
+	if (p == NULL || !lua_getmetatable(L, idx))
+		return NULL;
+	luaL_getmetatable(L, NUMERIC_METATABLE);
+	same = lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+	return same ? p : NULL;
 }
 
 /*
- * Control functions
+ * Return the value at idx as a numeric, converting numbers and strings
+ * in place.
  */
+static numeric *
+numeric_check(lua_State *L, int idx)
+{
+	numeric *n;
+	const char *s;
+	char buf[32];
+	lua_Number d;
+
+	if (idx < 0)
+		idx = lua_gettop(L) + idx + 1;
+	if ((n = numeric_test(L, idx)) != NULL)
+		return n;
+	switch (lua_type(L, idx)) {
+	case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+		if (lua_isinteger(L, idx)) {
+			snprintf(buf, sizeof buf, "%lld",
+			    (long long)lua_tointeger(L, idx));
+			s = buf;
+			break;
+		}
+#endif
+		d = lua_tonumber(L, idx);
+		snprintf(buf, sizeof buf, "%.15g", d);
+		if (strtod(buf, NULL) != d)
+			snprintf(buf, sizeof buf, "%.17g", d);
+		s = buf;
+		break;
+	case LUA_TSTRING:
+		s = lua_tostring(L, idx);
+		break;
+	default:
+		luaL_argerror(L, idx, "numeric expected");
+		return NULL;
+	}
+	n = numeric_parse(s);
+	if (n == NULL)
+		luaL_argerror(L, idx, "invalid numeric value");
+	n = numeric_push(L, n);
+	lua_replace(L, idx);
+	return n;
+}
+
+/* Push a binary numeric field, infinities become Lua numbers */
+static void
+decode_numeric(lua_State *L, const char *v, int len)
+{
+	numeric *n;
+
+	n = numeric_from_binary(v, len);
+	if (n == NULL)
+		luaL_error(L, "invalid binary numeric value");
+	if (n->sign == NUMERIC_PINF || n->sign == NUMERIC_NINF) {
+		lua_pushnumber(L, n->sign == NUMERIC_PINF ? HUGE_VAL :
+		    -HUGE_VAL);
+		free(n);
+		return;
+	}
+	numeric_push(L, n);
+}
+
 static int
-conn_clientEncoding(lua_State *L)
+pgsql_numeric(lua_State *L)
 {
-	lua_pushstring(L,
-	    pg_encoding_to_char(PQclientEncoding(pgsql_conn(L, 1))));
+	luaL_checkany(L, 1);
+	lua_settop(L, 1);
+	numeric_check(L, 1);
 	return 1;
 }
 
 static int
-conn_setClientEncoding(lua_State *L)
+numeric_add_(lua_State *L)
 {
-	if (PQsetClientEncoding(pgsql_conn(L, 1), luaL_checkstring(L, 2)))
-		lua_pushboolean(L, 0);
-	else
-		lua_pushboolean(L, 1);
+	numeric_push(L, numeric_add(numeric_check(L, 1), numeric_check(L, 2),
+	    0));
 	return 1;
 }
 
 static int
-conn_setErrorVerbosity(lua_State *L)
+numeric_sub(lua_State *L)
 {
-	lua_pushinteger(L,
-	    PQsetErrorVerbosity(pgsql_conn(L, 1), luaL_checkinteger(L, 2)));
+	numeric_push(L, numeric_add(numeric_check(L, 1), numeric_check(L, 2),
+	    1));
 	return 1;
 }
 
 static int
-closef_untrace(lua_State *L)
+numeric_mul_(lua_State *L)
 {
-	PGconn *conn;
-	lua_CFunction cf;
-
-	luaL_checkudata(L, 1, LUA_FILEHANDLE);
-
-	/* untrace so libpq doesn't segfault */
-	lua_getuservalue(L, 1);
-	lua_getfield(L, -1, "PGconn");
-	conn = pgsql_conn(L, -1);
-	lua_getfield(L, -2, "old_uservalue");
-#if LUA_VERSION_NUM >= 502
-	lua_getfield(L, -3, "old_closef");
-#else
-	lua_getfield(L, -1, "__close");
-#endif
-	cf = lua_tocfunction(L, -1);
-	lua_pop(L, 1);
-	lua_setuservalue(L, 1);
-
-	PQuntrace(conn);
-
-	/* let go of PGconn's reference to file handle */
-	lua_getuservalue(L, -1);
-	lua_pushnil(L);
-	lua_setfield(L, -2, "trace_file");
-
-	/* pop stream uservalue, PGconn, PGconn uservalue */
-	lua_pop(L, 3);
-
-	/* call original close function */
-	return (*cf)(L);
+	numeric_push(L, numeric_mul(numeric_check(L, 1), numeric_check(L, 2)));
+	return 1;
 }
 
 static int
-conn_trace(lua_State *L)
+numeric_unm(lua_State *L)
 {
-	PGconn *conn;
-#if LUA_VERSION_NUM >= 502
-	luaL_Stream *stream;
-
-	conn = pgsql_conn(L, 1);
-	stream = luaL_checkudata(L, 2, LUA_FILEHANDLE);
-	luaL_argcheck(L, stream->f != NULL, 2, "invalid file handle");
-
-	/*
-	 * Keep a reference to the file object in uservalue of connection
-	 * so it doesn't get garbage collected.
-	 */
-	lua_getuservalue(L, 1);
-	lua_pushvalue(L, 2);
-	lua_setfield(L, -2, "trace_file");
-
-	/*
-	 * Swap out closef luaL_Stream member for our wrapper that will
-	 * untrace.
-	 */
-	lua_createtable(L, 0, 3);
-	lua_getuservalue(L, 2);
-	lua_setfield(L, -2, "old_uservalue");
-	lua_pushcfunction(L, stream->closef);
-	lua_setfield(L, -2, "old_closef");
-	lua_pushvalue(L, 1);
-	lua_setfield(L, -2, "PGconn");
-	lua_setuservalue(L, 2);
-	stream->closef = closef_untrace;
-
-	PQtrace(conn, stream->f);
-#else
-	FILE **fp;
-
-	conn = pgsql_conn(L, 1);
-	fp = luaL_checkudata(L, 2, LUA_FILEHANDLE);
-	luaL_argcheck(L, *fp != NULL, 2, "invalid file handle");
-
-	/*
-	 * Keep a reference to the file object in uservalue of connection
-	 * so it doesn't get garbage collected.
-	 */
-	lua_getuservalue(L, 1);
-	lua_pushvalue(L, 2);
-	lua_setfield(L, -2, "trace_file");
-
-	/*
-	 * Swap __close field in file environment for our wrapper that will
-	 * untrace keep the old closef under the key of the PGconn.
-	 */
-	lua_createtable(L, 0, 3);
-	lua_pushcfunction(L, closef_untrace);
-	lua_setfield(L, -2, "__close");
-	lua_getuservalue(L, 2);
-	lua_setfield(L, -2, "old_uservalue");
-	lua_pushvalue(L, 1);
-	lua_setfield(L, -2, "PGconn");
-	lua_setuservalue(L, 2);
+	numeric *n;
 
-	PQtrace(conn, *fp);
-#endif
-	return 0;
+	n = numeric_check(L, 1);
+	n = numeric_round(n, n->dscale);
+	if (n != NULL && n->ndigits > 0 && n->sign != NUMERIC_NAN)
+		n->sign = n->sign == NUMERIC_POS ? NUMERIC_NEG : NUMERIC_POS;
+	numeric_push(L, n);
+	return 1;
 }
 
 static int
-conn_untrace(lua_State *L)
+numeric_round_(lua_State *L)
 {
-	PQuntrace(pgsql_conn(L, 1));
-
-	/* Let go of PGconn's reference to file handle. */
-	lua_getuservalue(L, 1);
-	lua_pushnil(L);
-	lua_setfield(L, -2, "trace_file");
+	lua_Integer scale;
 
-	return 0;
+	scale = luaL_optinteger(L, 2, 0);
+	luaL_argcheck(L, scale >= -NUMERIC_MAX_SCALE &&
+	    scale <= NUMERIC_MAX_SCALE, 2, "scale out of range");
+	numeric_push(L, numeric_round(numeric_check(L, 1), (int)scale));
+	return 1;
 }
 
-/*
- * Miscellaneous Functions
- */
 static int
-conn_consumeInput(lua_State *L)
+numeric_compare(lua_State *L)
 {
-	lua_pushboolean(L, PQconsumeInput(pgsql_conn(L, 1)));
+	lua_pushinteger(L, numeric_cmp(numeric_check(L, 1),
+	    numeric_check(L, 2)));
 	return 1;
 }
 
 static int
-conn_isBusy(lua_State *L)
+numeric_eq(lua_State *L)
 {
-	lua_pushboolean(L, PQisBusy(pgsql_conn(L, 1)));
+	lua_pushboolean(L, numeric_cmp(numeric_check(L, 1),
+	    numeric_check(L, 2)) == 0);
 	return 1;
 }
 
 static int
-conn_setnonblocking(lua_State *L)
+numeric_lt(lua_State *L)
 {
-	lua_pushinteger(L,
-	    PQsetnonblocking(pgsql_conn(L, 1), lua_toboolean(L, 2)));
+	lua_pushboolean(L, numeric_cmp(numeric_check(L, 1),
+	    numeric_check(L, 2)) < 0);
 	return 1;
 }
 
 static int
-conn_isnonblocking(lua_State *L)
+numeric_le(lua_State *L)
 {
-	lua_pushboolean(L, PQisnonblocking(pgsql_conn(L, 1)));
+	lua_pushboolean(L, numeric_cmp(numeric_check(L, 1),
+	    numeric_check(L, 2)) <= 0);
 	return 1;
 }
 
 static int
-conn_flush(lua_State *L)
+numeric_tostring(lua_State *L)
 {
-	lua_pushinteger(L, PQflush(pgsql_conn(L, 1)));
+	char *s;
+
+	s = numeric_format(numeric_check(L, 1));
+	if (s == NULL)
+		return luaL_error(L, "out of memory");
+	lua_pushstring(L, s);
+	free(s);
 	return 1;
 }
 
-/* Notice processing */
-static void
-noticeReceiver(void *arg, const PGresult *r)
+/* Convert to a Lua number, which may lose precision */
+static int
+numeric_tonumber(lua_State *L)
 {
-	lua_State *L = (lua_State *)arg;
-	PGresult **res;
+	char *s;
 
-	lua_pushstring(L, "__pgsqlNoticeReceiver");
-	lua_rawget(L, LUA_REGISTRYINDEX);
-	res = lua_newuserdata(L, sizeof(PGresult *));
-	*res = (PGresult *)r;
-	luaL_getmetatable(L, RES_METATABLE);
-	lua_setmetatable(L, -2);
+	s = numeric_format(numeric_check(L, 1));
+	if (s == NULL)
+		return luaL_error(L, "out of memory");
+	lua_pushnumber(L, strtod(s, NULL));
+	free(s);
+	return 1;
+}
 
-	if (lua_pcall(L, 1, 0, 0))
-		luaL_error(L, "%s", lua_tostring(L, -1));
-	*res = NULL;	/* avoid double free */
+static int
+numeric_scale(lua_State *L)
+{
+	lua_pushinteger(L, numeric_check(L, 1)->dscale);
+	return 1;
 }
 
-static void
-noticeProcessor(void *arg, const char *message)
+/*
+ * Type codecs
+ *
+ * pgsql.registerCodec() installs decode and encode functions for a
+ * type given by OID or by name.  Codecs live in a registry table that
+ * maps OIDs, type names and value metatables to codec tables.  Names
+ * are resolved to OIDs on each connection with a single query the next
+ * time it executes a statement while idle.  The OIDs of a type differ
+ * between databases, so the resolved OIDs are kept in the type table
+ * of the connection, mapping them to the names.  Results, row proxies
+ * and statements refer to the type table of their connection, which
+ * the decoders are given as a stack index, 0 if there is none.  The
+ * counters that let decoding skip the lookup are kept next to the
+ * table in the registry, so each Lua state has its own.
+ */
+static stateCounters *
+state_counters(lua_State *L)
 {
-	lua_State *L = (lua_State *)arg;
+	stateCounters *t;
 
-	lua_pushstring(L, "__pgsqlNoticeProcessor");
-	lua_rawget(L, LUA_REGISTRYINDEX);
-	lua_pushstring(L, message);
-	if (lua_pcall(L, 1, 0, 0))
-		luaL_error(L, "%s", lua_tostring(L, -1));
+	/* anchored in the registry, the pointer stays valid */
+	lua_getfield(L, LUA_REGISTRYINDEX, COUNTERS_REGISTRY);
+	t = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	return t;
 }
 
-static int
-conn_setNoticeReceiver(lua_State *L)
+/* The key of the type table in itself and in the tables that share it */
+static char result_types;
+
+/* Push the type table of the connection at idx, created on first use */
+static void
+conn_types(lua_State *L, int idx)
 {
-	lua_pushstring(L, "__pgsqlNoticeReceiver");
-	lua_pushvalue(L, -2);
-	lua_rawset(L, LUA_REGISTRYINDEX);
-	PQsetNoticeReceiver(pgsql_conn(L, 1), noticeReceiver, L);
-	return 0;
+	lua_getuservalue(L, idx);
+	lua_getfield(L, -1, "types");
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		/* a result can use the table itself as uservalue */
+		lua_pushlightuserdata(L, &result_types);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -3);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -3, "types");
+	}
+	lua_remove(L, -2);
 }
 
+/*
+ * Push the type table referred to by the uservalue of the userdata at
+ * idx and return its index, or push nil and return 0.
+ */
 static int
-conn_setNoticeProcessor(lua_State *L)
+pgsql_types(lua_State *L, int idx)
 {
-	lua_pushstring(L, "__pgsqlNoticeProcessor");
-	lua_pushvalue(L, -2);
-	lua_rawset(L, LUA_REGISTRYINDEX);
-	PQsetNoticeProcessor(pgsql_conn(L, 1), noticeProcessor, L);
+	lua_getuservalue(L, idx);
+	if (lua_istable(L, -1)) {
+		lua_pushlightuserdata(L, &result_types);
+		lua_rawget(L, -2);
+		lua_remove(L, -2);
+	}
+	if (lua_istable(L, -1))
+		return lua_gettop(L);
+	lua_pop(L, 1);
+	lua_pushnil(L);
 	return 0;
 }
 
-/* Large objects */
+/*
+ * Push the codec for type or return 0, looking the type up by name in
+ * the type table at index types first.
+ */
 static int
-conn_lo_create(lua_State *L)
+codec_push(lua_State *L, int types, Oid type)
 {
-	Oid oid;
-
-	if (lua_gettop(L) == 2)
-		oid = luaL_checkinteger(L, 2);
+	if (state_counters(L)->codecs == 0)
+		return 0;
+	lua_getfield(L, LUA_REGISTRYINDEX, CODECS_REGISTRY);
+	if (types)
+		lua_rawgeti(L, types, type);
 	else
-		oid = 0;
-	lua_pushinteger(L, lo_create(pgsql_conn(L, 1), oid));
-	return 1;
+		lua_pushnil(L);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_rawgeti(L, -1, type);
+	} else
+		lua_rawget(L, -2);
+	lua_remove(L, -2);
+	if (lua_istable(L, -1))
+		return 1;
+	lua_pop(L, 1);
+	return 0;
 }
 
+/* The format a codec works with, -1 if the type has no codec */
 static int
-conn_lo_import(lua_State *L)
+codec_format(lua_State *L, int types, Oid type)
 {
-	lua_pushinteger(L, lo_import(pgsql_conn(L, 1), luaL_checkstring(L, 2)));
-	return 1;
+	int format;
+
+	if (!codec_push(L, types, type))
+		return -1;
+	lua_getfield(L, -1, "format");
+	format = lua_tointeger(L, -1);
+	lua_pop(L, 2);
+	return format;
 }
 
+/*
+ * Push the value decoded by the codec of type and return 1, or return
+ * 0 if there is no decoder for the type in this format.
+ */
 static int
-conn_lo_import_with_oid(lua_State *L)
+codec_decode(lua_State *L, int types, Oid type, int format, const char *v,
+    int len)
 {
-	lua_pushinteger(L,
-	    lo_import_with_oid(pgsql_conn(L, 1), luaL_checkstring(L, 2),
-	    luaL_checkinteger(L, 3)));
+	if (!codec_push(L, types, type))
+		return 0;
+	lua_getfield(L, -1, "format");
+	if (lua_tointeger(L, -1) != format) {
+		lua_pop(L, 2);
+		return 0;
+	}
+	lua_getfield(L, -2, "decode");
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 3);
+		return 0;
+	}
+	lua_pushlstring(L, v, len);
+	lua_call(L, 1, 1);
+	lua_replace(L, -3);
+	lua_pop(L, 1);
 	return 1;
 }
 
+/*
+ * Replace the value at the absolute index idx by its encoding with the
+ * codec on top of the stack, which is popped, and return the codec's
+ * format or -1 if it has no encoder.
+ */
 static int
-conn_lo_export(lua_State *L)
+codec_encode(lua_State *L, int idx)
 {
-	lua_pushinteger(L,
-	    lo_export(pgsql_conn(L, 1), luaL_checkinteger(L, 2),
-	    luaL_checkstring(L, 3)));
-	return 1;
+	int format;
+
+	lua_getfield(L, -1, "format");
+	format = lua_tointeger(L, -1);
+	lua_getfield(L, -2, "encode");
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 3);
+		return -1;
+	}
+	lua_pushvalue(L, idx);
+	lua_call(L, 1, 1);
+	if (lua_type(L, -1) != LUA_TSTRING)
+		luaL_error(L, "codec encode function must return a string");
+	lua_replace(L, idx);
+	lua_pop(L, 2);
+	return format;
 }
 
+/* Push the codec for the metatable of the value at idx or return 0 */
 static int
-conn_lo_open(lua_State *L)
+codec_match(lua_State *L, int idx)
 {
-	largeObject **o;
-
-	o = lua_newuserdata(L, sizeof(largeObject *));
-	(*o)->conn = pgsql_conn(L, 1);
-	(*o)->fd = lo_open((*o)->conn, luaL_checkinteger(L, 2),
-	    luaL_checkinteger(L, 3));
-	luaL_getmetatable(L, LO_METATABLE);
-	lua_setmetatable(L, -2);
-	return 1;
+	stateCounters *t;
+
+	t = state_counters(L);
+	if (t->codecs == 0)
+		return 0;
+	if (!lua_getmetatable(L, idx))
+		return 0;
+	lua_getfield(L, LUA_REGISTRYINDEX, CODECS_REGISTRY);
+	lua_pushvalue(L, -2);
+	lua_rawget(L, -2);
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+	if (lua_istable(L, -1))
+		return 1;
+	lua_pop(L, 1);
+	return 0;
+}
+
+static void
+codec_recount(lua_State *L)
+{
+	stateCounters *t;
+
+	t = state_counters(L);
+	t->codecs = 0;
+	lua_getfield(L, LUA_REGISTRYINDEX, CODECS_REGISTRY);
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		if (lua_type(L, -2) == LUA_TNUMBER ||
+		    lua_type(L, -2) == LUA_TSTRING)
+			t->codecs++;
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+}
+
+/*
+ * Push the array of the type names with codecs that the connection at
+ * idx has not resolved yet, the array of their values for the query
+ * resolving them and that query, and return the number of names.  If
+ * there are none, nothing is pushed.
+ */
+static int
+codec_query(lua_State *L, int idx, const char ***values)
+{
+	luaL_Buffer b;
+	char num[16];
+	int n, nnames, top, generation;
+
+	generation = state_counters(L)->generation;
+	top = lua_gettop(L);
+	lua_getuservalue(L, idx);
+	lua_getfield(L, -1, "codec_generation");
+	if (lua_tointeger(L, -1) == generation) {
+		lua_settop(L, top);
+		return 0;
+	}
+	lua_pushinteger(L, generation);
+	lua_setfield(L, top + 1, "codec_generation");
+	lua_settop(L, top);
+
+	lua_newtable(L);
+	lua_getfield(L, LUA_REGISTRYINDEX, CODECS_REGISTRY);
+	nnames = 0;
+	lua_pushnil(L);
+	while (lua_next(L, top + 2)) {
+		lua_pop(L, 1);
+		if (lua_type(L, -1) == LUA_TSTRING) {
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, top + 1, ++nnames);
+		}
+	}
+	lua_pop(L, 1);
+	if (nnames == 0) {
+		lua_settop(L, top);
+		return 0;
+	}
+
+	*values = lua_newuserdata(L, nnames * sizeof(char *));
+	for (n = 0; n < nnames; n++) {
+		lua_rawgeti(L, top + 1, n + 1);
+		(*values)[n] = lua_tostring(L, -1);
+		lua_pop(L, 1);	/* still referenced by the names array */
+	}
+	luaL_buffinit(L, &b);
+	luaL_addstring(&b, "SELECT ");
+	for (n = 0; n < nnames; n++) {
+		if (n > 0)
+			luaL_addstring(&b, ", ");
+		snprintf(num, sizeof num, "$%d", n + 1);
+		luaL_addstring(&b, "pg_catalog.to_regtype(");
+		luaL_addstring(&b, num);
+		luaL_addstring(&b, ")::oid");
+	}
+	luaL_pushresult(&b);
+	return nnames;
+}
+
+/*
+ * Add the OIDs found by the query for the names at index names to the
+ * type table of the connection at idx.
+ */
+static void
+codec_apply(lua_State *L, int idx, int names, const PGresult *r)
+{
+	int n, nnames;
+
+	if (PQresultStatus(r) != PGRES_TUPLES_OK || PQntuples(r) != 1)
+		return;
+	conn_types(L, idx);
+	nnames = PQnfields(r);
+	for (n = 0; n < nnames; n++) {
+		if (PQgetisnull(r, 0, n))
+			continue;
+		lua_rawgeti(L, names, n + 1);
+		lua_rawseti(L, -2, (Oid)strtoul(PQgetvalue(r, 0, n), NULL, 10));
+	}
+	lua_pop(L, 1);
+}
+
+/*
+ * Resolve the type names that have codecs on the connection at idx.
+ * Only an idle connection is asked, so that a failing lookup can not
+ * abort a transaction of the caller.
+ */
+static void
+codec_resolve(lua_State *L, int idx)
+{
+	PGconn *conn;
+	PGresult *r;
+	const char **values;
+	int nnames, top;
+
+	if (state_counters(L)->generation == 0)
+		return;
+	conn = *(PGconn **)lua_touserdata(L, idx);
+	if (conn == NULL || PQstatus(conn) != CONNECTION_OK ||
+	    PQtransactionStatus(conn) != PQTRANS_IDLE)
+		return;
+#ifdef LIBPQ_HAS_PIPELINING
+	if (PQpipelineStatus(conn) != PQ_PIPELINE_OFF)
+		return;
+#endif
+	top = lua_gettop(L);
+	nnames = codec_query(L, idx, &values);
+	if (nnames > 0) {
+		r = PQexecParams(conn, lua_tostring(L, -1), nnames, NULL,
+		    values, NULL, NULL, 0);
+		codec_apply(L, idx, top + 1, r);
+		PQclear(r);
+	}
+	lua_settop(L, top);
+}
+
+/*
+ * pgsql.registerCodec(type, codec) with type an OID or a type name and
+ * codec a table with decode and encode functions, the format they use
+ * ("text" or "binary") and optionally a metatable; parameters that are
+ * tables or userdata with this metatable are encoded with the codec.
+ * A nil codec removes the codec for the type.
+ */
+static int
+pgsql_registerCodec(lua_State *L)
+{
+	static const char *formats[] = { "text", "binary", NULL };
+	int t;
+
+	t = lua_type(L, 1);
+	luaL_argcheck(L, t == LUA_TNUMBER || t == LUA_TSTRING, 1,
+	    "type OID or name expected");
+	lua_settop(L, 2);
+	lua_getfield(L, LUA_REGISTRYINDEX, CODECS_REGISTRY);
+
+	/* remove every reference to the codec being replaced */
+	lua_pushvalue(L, 1);
+	lua_rawget(L, 3);
+	if (!lua_isnil(L, -1)) {
+		lua_pushnil(L);
+		while (lua_next(L, 3)) {
+			if (lua_rawequal(L, -1, 4)) {
+				lua_pushvalue(L, -2);
+				lua_pushnil(L);
+				lua_rawset(L, 3);
+			}
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+
+	if (!lua_isnil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_createtable(L, 0, 4);
+		lua_getfield(L, 2, "decode");
+		luaL_argcheck(L, lua_isnil(L, -1) || lua_isfunction(L, -1), 2,
+		    "decode must be a function");
+		lua_setfield(L, -2, "decode");
+		lua_getfield(L, 2, "encode");
+		luaL_argcheck(L, lua_isnil(L, -1) || lua_isfunction(L, -1), 2,
+		    "encode must be a function");
+		lua_setfield(L, -2, "encode");
+		lua_getfield(L, 2, "format");
+		lua_pushinteger(L, luaL_checkoption(L, -1, "text", formats));
+		lua_setfield(L, -3, "format");
+		lua_pop(L, 1);
+		if (t == LUA_TNUMBER) {
+			lua_pushvalue(L, 1);
+			lua_setfield(L, -2, "oid");
+		}
+		lua_getfield(L, 2, "metatable");
+		if (!lua_isnil(L, -1)) {
+			luaL_argcheck(L, lua_istable(L, -1), 2,
+			    "metatable must be a table");
+			lua_pushvalue(L, -2);
+			lua_rawset(L, 3);
+		} else
+			lua_pop(L, 1);
+		lua_pushvalue(L, 1);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, 3);
+	}
+	if (t == LUA_TSTRING)
+		state_counters(L)->generation++;
+	codec_recount(L);
+	return 0;
+}
+
+/*
+ * Composite types and arrays
+ *
+ * With conn:setCompositeDecoding(true), composite, record and array
+ * columns in results of the connection decode to Lua tables, composites
+ * keyed by attribute name, records by position.  Attribute names and
+ * types are looked up in pg_type and pg_attribute once per type, for
+ * the types of nested attributes and array elements as well, and kept
+ * by OID in the type table of the connection, as the same OID can be
+ * another type in another database.  Inside a transaction the lookup
+ * runs in a savepoint.
+ */
+#define COMPOSITE_MAX_DEPTH	8
+#define ARRAY_MAX_DIMS		6
+#define COMPOSITE_SAVEPOINT	"luapgsql_composites"
+
+static pgsql_decoder pgsql_decoder_for(Oid, int);
+static void decode_string(lua_State *, const char *, int);
+static void pgsql_decode_typed(lua_State *, int, Oid, int, const char *,
+    int);
+
+/*
+ * Push the composite and array descriptions of the type table at index
+ * types, created on first use.
+ */
+static void
+composite_table(lua_State *L, int types)
+{
+	lua_getfield(L, types, "composites");
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, types, "composites");
+	}
+}
+
+/*
+ * Push the composite or array description of type in the type table at
+ * index types, or return 0.
+ */
+static int
+composite_info(lua_State *L, int types, Oid type)
+{
+	if (types == 0 || state_counters(L)->composites == 0)
+		return 0;
+	lua_getfield(L, types, "composites");
+	if (lua_istable(L, -1)) {
+		lua_rawgeti(L, -1, type);
+		lua_remove(L, -2);
+	}
+	if (lua_istable(L, -1))
+		return 1;
+	lua_pop(L, 1);
+	return 0;
+}
+
+/* Whether type decodes as composite or array */
+static int
+composite_has(lua_State *L, int types, Oid type)
+{
+	if (!composite_info(L, types, type))
+		return 0;
+	lua_pop(L, 1);
+	return 1;
+}
+
+/* Decode the text at the top of the stack as type, replacing it */
+static void
+composite_field(lua_State *L, int types, Oid type)
+{
+	const char *s;
+	size_t len;
+
+	s = lua_tolstring(L, -1, &len);
+	pgsql_decode_typed(L, types, type, 0, s, len);
+	lua_remove(L, -2);
+}
+
+/*
+ * Collect a quoted or unquoted element of a composite or array text
+ * into a buffer.  Return a pointer after the element, *quoted tells
+ * whether any of it was quoted or escaped.
+ */
+static const char *
+composite_token(luaL_Buffer *b, const char *p, char delim, char end,
+    int *quoted)
+{
+	int inquote = 0;
+
+	*quoted = 0;
+	for (; *p != '\0'; p++) {
+		if (inquote) {
+			if (*p == '\\' && p[1] != '\0')
+				luaL_addchar(b, *++p);
+			else if (*p == '"' && p[1] == '"' && end == ')')
+				luaL_addchar(b, *++p);
+			else if (*p == '"')
+				inquote = 0;
+			else
+				luaL_addchar(b, *p);
+		} else if (*p == '"')
+			inquote = *quoted = 1;
+		else if (*p == '\\' && p[1] != '\0') {
+			luaL_addchar(b, *++p);
+			*quoted = 1;
+		} else if (*p == delim || *p == end)
+			break;
+		else
+			luaL_addchar(b, *p);
+	}
+	return p;
+}
+
+/* Push a table for the record text at p, info at index info or 0 */
+static void
+composite_text(lua_State *L, int types, int info, const char *p)
+{
+	luaL_Buffer b;
+	Oid type;
+	int n, quoted;
+
+	lua_newtable(L);
+	if (*p++ != '(')
+		luaL_error(L, "malformed record literal");
+	for (n = 1; *p != '\0'; n++) {
+		if (*p != ',' && *p != ')') {
+			luaL_buffinit(L, &b);
+			p = composite_token(&b, p, ',', ')', &quoted);
+			luaL_pushresult(&b);
+			type = 0;
+			if (info) {
+				lua_getfield(L, info, "types");
+				lua_rawgeti(L, -1, n);
+				type = lua_tointeger(L, -1);
+				lua_pop(L, 2);
+			}
+			if (type != 0)
+				composite_field(L, types, type);
+			if (info) {
+				lua_getfield(L, info, "names");
+				lua_rawgeti(L, -1, n);
+				lua_remove(L, -2);
+			} else
+				lua_pushinteger(L, n);
+			if (lua_isnil(L, -1))
+				lua_pop(L, 2);
+			else {
+				lua_insert(L, -2);
+				lua_rawset(L, -3);
+			}
+		}
+		if (*p == ')')
+			return;
+		if (*p++ != ',')
+			break;
+	}
+	luaL_error(L, "malformed record literal");
+}
+
+/* Parse the array text at p into a table, return a pointer after it */
+static const char *
+array_text(lua_State *L, int types, const char *p, Oid elem, char delim,
+    int depth)
+{
+	luaL_Buffer b;
+	const char *s;
+	size_t len;
+	int n, quoted;
+
+	if (depth > ARRAY_MAX_DIMS)
+		luaL_error(L, "malformed array literal");
+	lua_newtable(L);
+	p++;
+	for (n = 1;; n++) {
+		while (*p == ' ')
+			p++;
+		if (*p == '}' && n == 1)
+			return p + 1;
+		if (*p == '{')
+			p = array_text(L, types, p, elem, delim, depth + 1);
+		else {
+			luaL_buffinit(L, &b);
+			p = composite_token(&b, p, delim, '}', &quoted);
+			luaL_pushresult(&b);
+			s = lua_tolstring(L, -1, &len);
+			while (len > 0 && s[len - 1] == ' ' && !quoted)
+				len--;
+			if (!quoted && len == 4 && !strncasecmp(s, "NULL", 4))
+				lua_pop(L, 1);
+			else {
+				if (len != lua_rawlen(L, -1)) {
+					lua_pushlstring(L, s, len);
+					lua_remove(L, -2);
+				}
+				composite_field(L, types, elem);
+				lua_rawseti(L, -2, n);
+			}
+			goto next;
+		}
+		lua_rawseti(L, -2, n);
+	next:
+		while (*p == ' ')
+			p++;
+		if (*p == '}')
+			return p + 1;
+		if (*p++ != delim)
+			luaL_error(L, "malformed array literal");
+	}
+}
+
+static uint32_t
+composite_uint32(lua_State *L, const char **p, const char *end)
+{
+	uint32_t v;
+
+	if (end - *p < 4)
+		luaL_error(L, "malformed binary composite or array");
+	memcpy(&v, *p, sizeof v);
+	*p += 4;
+	return ntohl(v);
+}
+
+/* Push the binary record at v, attribute names from info or 0 */
+static void
+composite_binary(lua_State *L, int types, int info, const char *v, int len)
+{
+	const char *p, *end;
+	uint32_t type;
+	int32_t flen;
+	int n, nfields;
+
+	p = v;
+	end = v + len;
+	nfields = (int32_t)composite_uint32(L, &p, end);
+	lua_createtable(L, info ? 0 : nfields, info ? nfields : 0);
+	for (n = 1; n <= nfields; n++) {
+		type = composite_uint32(L, &p, end);
+		flen = (int32_t)composite_uint32(L, &p, end);
+		if (flen < 0)
+			continue;
+		if (flen > end - p)
+			luaL_error(L, "malformed binary composite");
+		if (info) {
+			lua_getfield(L, info, "names");
+			lua_rawgeti(L, -1, n);
+			lua_remove(L, -2);
+		} else
+			lua_pushinteger(L, n);
+		pgsql_decode_typed(L, types, type, 1, p, flen);
+		p += flen;
+		if (lua_isnil(L, -2))
+			lua_pop(L, 2);
+		else
+			lua_rawset(L, -3);
+	}
+}
+
+static void
+array_binary_dim(lua_State *L, int types, const char **p, const char *end,
+    Oid elem, int32_t *dims, int ndims)
+{
+	int32_t flen;
+	int n;
+
+	lua_createtable(L, dims[0], 0);
+	for (n = 1; n <= dims[0]; n++) {
+		if (ndims > 1)
+			array_binary_dim(L, types, p, end, elem, dims + 1,
+			    ndims - 1);
+		else {
+			flen = (int32_t)composite_uint32(L, p, end);
+			if (flen < 0)
+				continue;
+			if (flen > end - *p)
+				luaL_error(L, "malformed binary array");
+			pgsql_decode_typed(L, types, elem, 1, *p, flen);
+			*p += flen;
+		}
+		lua_rawseti(L, -2, n);
+	}
+}
+
+static void
+array_binary(lua_State *L, int types, const char *v, int len)
+{
+	const char *p, *end;
+	int32_t dims[ARRAY_MAX_DIMS];
+	uint32_t elem;
+	int n, ndims;
+
+	p = v;
+	end = v + len;
+	ndims = (int32_t)composite_uint32(L, &p, end);
+	if (ndims < 0 || ndims > ARRAY_MAX_DIMS)
+		luaL_error(L, "malformed binary array");
+	composite_uint32(L, &p, end);	/* has nulls */
+	elem = composite_uint32(L, &p, end);
+	for (n = 0; n < ndims; n++) {
+		dims[n] = (int32_t)composite_uint32(L, &p, end);
+		composite_uint32(L, &p, end);	/* lower bound */
+		if (dims[n] < 0)
+			luaL_error(L, "malformed binary array");
+	}
+	if (ndims == 0)
+		lua_newtable(L);
+	else
+		array_binary_dim(L, types, &p, end, elem, dims, ndims);
+}
+
+/* Push a composite or array value and return 1, 0 if type is neither */
+static int
+composite_decode(lua_State *L, int types, Oid type, int format,
+    const char *v, int len)
+{
+	const char *delim;
+	int info;
+
+	if (!composite_info(L, types, type))
+		return 0;
+	info = lua_gettop(L);
+	lua_getfield(L, info, "elem");
+	if (!lua_isnil(L, -1)) {
+		type = lua_tointeger(L, -1);
+		lua_getfield(L, info, "delim");
+		delim = lua_tostring(L, -1);
+		if (format)
+			array_binary(L, types, v, len);
+		else {
+			while (*v != '{' && *v != '\0')
+				v++;	/* skip dimension decoration */
+			if (*v != '{')
+				luaL_error(L, "malformed array literal");
+			array_text(L, types, v, type,
+			    delim != NULL ? *delim : ',', 1);
+		}
+		lua_replace(L, info);
+		lua_settop(L, info);
+		return 1;
+	}
+	lua_pop(L, 1);
+	lua_getfield(L, info, "names");
+	if (lua_rawlen(L, -1) == 0)
+		info = 0;	/* a record, fields are numbered */
+	lua_pop(L, 1);
+	if (format)
+		composite_binary(L, types, info, v, len);
+	else
+		composite_text(L, types, info, v);
+	if (info)
+		lua_remove(L, info);
+	else
+		lua_remove(L, -2);
+	return 1;
+}
+
+/*
+ * Decode a value of any type in either format: codecs first, then
+ * composites and arrays, then the built in decoders, then as string.
+ * The types of the connection are at index types, or types is 0.
+ */
+static void
+pgsql_decode_typed(lua_State *L, int types, Oid type, int format,
+    const char *v, int len)
+{
+	pgsql_decoder decode;
+
+	if (codec_decode(L, types, type, format, v, len))
+		return;
+	if (composite_decode(L, types, type, format, v, len))
+		return;
+	decode = pgsql_decoder_for(type, format);
+	if (decode == NULL)
+		decode = decode_string;
+	decode(L, v, len);
+}
+
+/* A type that needs no lookup: built in scalar, codec or known */
+static int
+composite_known(lua_State *L, int types, int reg, Oid type)
+{
+	int known;
+
+	if (type == 0 || pgsql_decoder_for(type, 1) != NULL ||
+	    codec_format(L, types, type) != -1)
+		return 1;
+	lua_rawgeti(L, reg, type);
+	known = !lua_isnil(L, -1);
+	lua_pop(L, 1);
+	return known;
+}
+
+/* Queue type for lookup unless it is known or already queued */
+static void
+composite_todo(lua_State *L, int types, int reg, int todo, Oid type)
+{
+	if (composite_known(L, types, reg, type))
+		return;
+	/* the placeholder keeps it from being queued twice */
+	lua_pushboolean(L, 0);
+	lua_rawseti(L, reg, type);
+	lua_pushinteger(L, type);
+	lua_rawseti(L, todo, lua_rawlen(L, todo) + 1);
+}
+
+/*
+ * Describe the composite and array types in r, a result of the pg_type
+ * query of composite_lookup(), in the table at reg, queueing the types
+ * they are made of in the array at index todo.
+ */
+static void
+composite_describe(lua_State *L, const PGresult *r, int types, int reg,
+    int todo)
+{
+	Oid type, prev;
+	int row, ntuples, info;
+
+	ntuples = PQntuples(r);
+	prev = 0;
+	info = 0;
+	for (row = 0; row < ntuples; row++) {
+		type = strtoul(PQgetvalue(r, row, 0), NULL, 10);
+		if (type != prev) {
+			if (info)
+				lua_pop(L, 1);
+			info = 0;
+			prev = type;
+			if (*PQgetvalue(r, row, 1) == 'c' ||
+			    type == RECORDOID) {
+				lua_createtable(L, 0, 2);
+				lua_newtable(L);
+				lua_setfield(L, -2, "names");
+				lua_newtable(L);
+				lua_setfield(L, -2, "types");
+			} else if (strcmp(PQgetvalue(r, row, 2), "0") &&
+			    !strcmp(PQgetvalue(r, row, 3), "-1")) {
+				/* arrays have no attributes to collect */
+				lua_createtable(L, 0, 2);
+				type = strtoul(PQgetvalue(r, row, 2), NULL, 10);
+				lua_pushinteger(L, type);
+				lua_setfield(L, -2, "elem");
+				lua_pushstring(L, PQgetvalue(r, row, 4));
+				lua_setfield(L, -2, "delim");
+				lua_rawseti(L, reg, prev);
+				state_counters(L)->composites++;
+				composite_todo(L, types, reg, todo, type);
+				continue;
+			} else
+				continue;
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, reg, prev);
+			state_counters(L)->composites++;
+			info = lua_gettop(L);
+		}
+		if (!info || PQgetisnull(r, row, 5))
+			continue;
+		lua_getfield(L, info, "names");
+		lua_pushstring(L, PQgetvalue(r, row, 5));
+		lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+		lua_getfield(L, info, "types");
+		type = strtoul(PQgetvalue(r, row, 6), NULL, 10);
+		lua_pushinteger(L, type);
+		lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+		lua_pop(L, 2);
+		composite_todo(L, types, reg, todo, type);
+	}
+	if (info)
+		lua_pop(L, 1);
+}
+
+/*
+ * Look up the types in the array at index todo, and the types they
+ * are made of, and describe them in the table at reg.
+ */
+static void
+composite_lookup(lua_State *L, PGconn *conn, int types, int reg, int todo)
+{
+	PGresult *r;
+	luaL_Buffer b;
+	const char *values[1];
+	int n, depth;
+
+	for (depth = 0; depth < COMPOSITE_MAX_DEPTH &&
+	    lua_rawlen(L, todo) > 0; depth++) {
+		luaL_buffinit(L, &b);
+		luaL_addchar(&b, '{');
+		for (n = 1; n <= (int)lua_rawlen(L, todo); n++) {
+			if (n > 1)
+				luaL_addchar(&b, ',');
+			lua_rawgeti(L, todo, n);
+			luaL_addvalue(&b);
+		}
+		luaL_addchar(&b, '}');
+		luaL_pushresult(&b);
+		values[0] = lua_tostring(L, -1);
+		r = PQexecParams(conn,
+		    "SELECT t.oid, t.typtype, t.typelem, t.typlen, t.typdelim, "
+		    "a.attname, a.atttypid FROM pg_catalog.pg_type t "
+		    "LEFT JOIN pg_catalog.pg_attribute a ON a.attrelid = "
+		    "t.typrelid AND a.attnum > 0 AND NOT a.attisdropped "
+		    "WHERE t.oid = ANY ($1::pg_catalog.oid[]) "
+		    "ORDER BY t.oid, a.attnum", 1, NULL, values, NULL, NULL, 0);
+		lua_pop(L, 1);
+
+		/* anything not found or not composite is plain */
+		for (n = 1; n <= (int)lua_rawlen(L, todo); n++) {
+			lua_rawgeti(L, todo, n);
+			lua_pushboolean(L, 0);
+			lua_rawset(L, reg);
+		}
+		lua_newtable(L);
+		lua_replace(L, todo);
+		if (PQresultStatus(r) != PGRES_TUPLES_OK) {
+			PQclear(r);
+			return;
+		}
+		composite_describe(L, r, types, reg, todo);
+		PQclear(r);
+	}
+}
+
+/*
+ * Describe the composite and array column types of r that are not yet
+ * known, if the connection at idx decodes composites.
+ */
+static void
+composite_resolve(lua_State *L, int idx, const PGresult *r)
+{
+	PGconn *conn;
+	PGTransactionStatusType status;
+	int n, nfields, top, enabled;
+
+	if (r == NULL || (PQresultStatus(r) != PGRES_TUPLES_OK &&
+	    PQresultStatus(r) != PGRES_COMMAND_OK))
+		return;
+	top = lua_gettop(L);
+	lua_getuservalue(L, idx);
+	lua_getfield(L, -1, "composites");
+	enabled = lua_toboolean(L, -1);
+	lua_settop(L, top);
+	if (!enabled)
+		return;
+	conn = *(PGconn **)lua_touserdata(L, idx);
+	status = PQtransactionStatus(conn);
+	if (status != PQTRANS_IDLE && status != PQTRANS_INTRANS)
+		return;
+#ifdef LIBPQ_HAS_PIPELINING
+	if (PQpipelineStatus(conn) != PQ_PIPELINE_OFF)
+		return;
+#endif
+
+	conn_types(L, idx);
+	composite_table(L, top + 1);
+	lua_newtable(L);
+	nfields = PQnfields(r);
+	for (n = 0; n < nfields; n++)
+		composite_todo(L, top + 1, top + 2, top + 3, PQftype(r, n));
+	if (lua_rawlen(L, top + 3) == 0) {
+		lua_settop(L, top);
+		return;
+	}
+
+	/* a failing lookup must not abort the caller's transaction */
+	if (status == PQTRANS_INTRANS)
+		PQclear(PQexec(conn, "SAVEPOINT " COMPOSITE_SAVEPOINT));
+	composite_lookup(L, conn, top + 1, top + 2, top + 3);
+	if (status == PQTRANS_INTRANS) {
+		if (PQtransactionStatus(conn) == PQTRANS_INERROR)
+			PQclear(PQexec(conn, "ROLLBACK TO SAVEPOINT "
+			    COMPOSITE_SAVEPOINT));
+		PQclear(PQexec(conn, "RELEASE SAVEPOINT "
+		    COMPOSITE_SAVEPOINT));
+	}
+	lua_settop(L, top);
+}
+
+static int
+conn_setCompositeDecoding(lua_State *L)
+{
+	pgsql_conn(L, 1);
+	luaL_checkany(L, 2);
+	lua_getuservalue(L, 1);
+	lua_pushboolean(L, lua_toboolean(L, 2));
+	lua_setfield(L, -2, "composites");
+	return 0;
+}
+
+/*
+ * Connection warm-up
+ *
+ * conn:warmup() sends the settings and prepared statements a fresh
+ * connection needs, and optionally the catalog queries for type codecs,
+ * composites and arrays, as one pipeline.  Each item has its own sync,
+ * so that one failure does not abort the others; without pipelining
+ * the items are sent one after the other.
+ */
+#define WARMUP_SETTING	0
+#define WARMUP_PREPARE	1
+#define WARMUP_CODECS	2
+#define WARMUP_TYPES	3
+
+/* The stack of conn_warmup() */
+#define WARMUP_ERRORS	5
+#define WARMUP_REG	7
+#define WARMUP_TODO	8
+#define WARMUP_SEEN	9
+#define WARMUP_NAMES	10
+
+typedef struct warmupItem {
+	int		  kind;
+	const char	 *name;		/* of the setting or statement */
+	const char	 *command;
+	int		  nparams;
+	const Oid	 *types;
+	const char	**values;
+} warmupItem;
+
+/* Composite types outside the system schemas and all scalar arrays */
+static const char warmup_types[] =
+    "SELECT t.oid, t.typtype, t.typelem, t.typlen, t.typdelim, "
+    "a.attname, a.atttypid FROM pg_catalog.pg_type t "
+    "LEFT JOIN pg_catalog.pg_attribute a ON a.attrelid = t.typrelid "
+    "AND a.attnum > 0 AND NOT a.attisdropped "
+    "WHERE t.typnamespace NOT IN (SELECT oid FROM pg_catalog.pg_namespace "
+    "WHERE nspname IN ('pg_catalog', 'information_schema', 'pg_toast')) "
+    "OR (t.typelem <> 0 AND t.typlen = -1 AND t.typelem NOT IN "
+    "(SELECT oid FROM pg_catalog.pg_type WHERE typtype = 'c')) "
+    "ORDER BY t.oid, a.attnum";
+
+static void
+warmup_result(lua_State *L, PGconn *conn, const warmupItem *item,
+    PGresult *r)
+{
+	int row, ntuples;
+
+	if (PQresultStatus(r) != PGRES_COMMAND_OK &&
+	    PQresultStatus(r) != PGRES_TUPLES_OK) {
+		lua_pushstring(L, r != NULL ? PQresultErrorMessage(r) :
+		    PQerrorMessage(conn));
+		lua_setfield(L, WARMUP_ERRORS, item->kind == WARMUP_CODECS ?
+		    "codecs" : item->kind == WARMUP_TYPES ? "types" :
+		    item->name);
+		PQclear(r);
+		return;
+	}
+	switch (item->kind) {
+	case WARMUP_SETTING:
+		if (conn_resilience(L, 1)) {
+			lua_getfield(L, -1, "settings");
+			lua_pushstring(L, item->values[1]);
+			lua_setfield(L, -2, item->name);
+			lua_pop(L, 2);
+		}
+		break;
+	case WARMUP_PREPARE:
+		pgsql_track_prepare(L, 1, item->name, item->command,
+		    item->nparams, item->types);
+		break;
+	case WARMUP_CODECS:
+		codec_apply(L, 1, WARMUP_NAMES, r);
+		break;
+	case WARMUP_TYPES:
+		conn_types(L, 1);
+		composite_describe(L, r, lua_gettop(L), WARMUP_REG,
+		    WARMUP_TODO);
+		lua_pop(L, 1);
+		ntuples = PQntuples(r);
+		for (row = 0; row < ntuples; row++) {
+			lua_pushboolean(L, 1);
+			lua_rawseti(L, WARMUP_SEEN,
+			    strtoul(PQgetvalue(r, row, 0), NULL, 10));
+		}
+		break;
+	}
+	PQclear(r);
+}
+
+/*
+ * conn:warmup(opts) with opts.settings a table of setting names and
+ * values, opts.statements a table of statement names and commands, or
+ * arrays of the command and the parameter type OIDs, and
+ * opts.preloadTypes to resolve the type codecs and to describe the
+ * composite and array types of the database.  Returns true, or false
+ * and a table of error messages by setting or statement name ("codecs"
+ * and "types" for the catalog queries).
+ */
+static int
+conn_warmup(lua_State *L)
+{
+	PGconn *conn;
+	warmupItem *items, *it;
+	const char **values;
+	Oid *types;
+	int n, k, nitems, nnames, preload, nanchors;
+#ifdef LIBPQ_HAS_PIPELINING
+	PGresult *r;
+	int nsent, answered;
+#endif
+
+	conn = pgsql_conn_query(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+	lua_getfield(L, 2, "statements");
+	lua_getfield(L, 2, "settings");
+	lua_getfield(L, 2, "preloadTypes");
+	preload = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	lua_newtable(L);			/* WARMUP_ERRORS */
+	lua_newtable(L);			/* 6: anchors of values and types */
+	conn_types(L, 1);			/* WARMUP_REG */
+	composite_table(L, lua_gettop(L));
+	lua_remove(L, -2);
+	lua_newtable(L);			/* WARMUP_TODO */
+	lua_newtable(L);			/* WARMUP_SEEN */
+
+	nitems = 2;
+	for (n = 3; n <= 4; n++) {
+		if (lua_isnil(L, n))
+			continue;
+		luaL_argcheck(L, lua_istable(L, n), 2,
+		    n == 3 ? "statements must be a table" :
+		    "settings must be a table");
+		lua_pushnil(L);
+		while (lua_next(L, n)) {
+			luaL_argcheck(L, lua_type(L, -2) == LUA_TSTRING, 2,
+			    "names must be strings");
+			lua_pop(L, 1);
+			nitems++;
+		}
+	}
+	/* the names, their values and the query at WARMUP_NAMES */
+	nnames = preload ? codec_query(L, 1, &values) : 0;
+	if (nnames == 0)
+		lua_settop(L, WARMUP_NAMES + 2);
+	items = lua_newuserdata(L, nitems * sizeof(warmupItem));
+	nanchors = 0;
+
+	n = 0;
+	if (!lua_isnil(L, 4)) {
+		lua_pushnil(L);
+		while (lua_next(L, 4)) {
+			it = &items[n++];
+			memset(it, 0, sizeof(warmupItem));
+			it->kind = WARMUP_SETTING;
+			it->name = lua_tostring(L, -2);
+			it->command = "SELECT pg_catalog.set_config($1, $2, "
+			    "false)";
+			it->nparams = 2;
+			it->values = lua_newuserdata(L, 2 * sizeof(char *));
+			it->values[0] = it->name;
+			it->values[1] = luaL_checkstring(L, -2);
+			lua_rawseti(L, 6, ++nanchors);
+			lua_rawseti(L, 6, ++nanchors);
+		}
+	}
+	if (!lua_isnil(L, 3)) {
+		lua_pushnil(L);
+		while (lua_next(L, 3)) {
+			it = &items[n++];
+			memset(it, 0, sizeof(warmupItem));
+			it->kind = WARMUP_PREPARE;
+			it->name = lua_tostring(L, -2);
+			if (lua_istable(L, -1)) {
+				lua_rawgeti(L, -1, 1);
+				it->command = luaL_checkstring(L, -1);
+				lua_pop(L, 1);
+				it->nparams = lua_rawlen(L, -1) - 1;
+				types = lua_newuserdata(L, (it->nparams + 1) *
+				    sizeof(Oid));
+				for (k = 0; k < it->nparams; k++) {
+					lua_rawgeti(L, -2, k + 2);
+					types[k] = luaL_checkinteger(L, -1);
+					lua_pop(L, 1);
+				}
+				it->types = types;
+				lua_rawseti(L, 6, ++nanchors);
+			} else
+				it->command = luaL_checkstring(L, -1);
+			lua_pop(L, 1);
+		}
+	}
+	if (nnames > 0) {
+		it = &items[n++];
+		memset(it, 0, sizeof(warmupItem));
+		it->kind = WARMUP_CODECS;
+		it->command = lua_tostring(L, WARMUP_NAMES + 2);
+		it->nparams = nnames;
+		it->values = values;
+	}
+	if (preload) {
+		it = &items[n++];
+		memset(it, 0, sizeof(warmupItem));
+		it->kind = WARMUP_TYPES;
+		it->command = warmup_types;
+	}
+	nitems = n;
+
+#ifdef LIBPQ_HAS_PIPELINING
+	if (PQenterPipelineMode(conn)) {
+		for (nsent = 0; nsent < nitems; nsent++) {
+			it = &items[nsent];
+			if (!(it->kind == WARMUP_PREPARE ?
+			    PQsendPrepare(conn, it->name, it->command,
+			    it->nparams, it->types) :
+			    PQsendQueryParams(conn, it->command, it->nparams,
+			    NULL, it->values, NULL, NULL, 0)) ||
+			    !PQpipelineSync(conn))
+				break;
+		}
+		answered = 0;
+		for (n = 0; n < nsent;) {
+			r = PQgetResult(conn);
+			if (r == NULL) {
+				if (PQstatus(conn) == CONNECTION_BAD)
+					break;
+				continue;
+			}
+			if (PQresultStatus(r) == PGRES_PIPELINE_SYNC) {
+				PQclear(r);
+				if (!answered)
+					warmup_result(L, conn, &items[n], NULL);
+				answered = 0;
+				n++;
+			} else if (answered)
+				PQclear(r);
+			else {
+				warmup_result(L, conn, &items[n], r);
+				answered = 1;
+			}
+		}
+		for (n += answered; n < nitems; n++)
+			warmup_result(L, conn, &items[n], NULL);
+		PQexitPipelineMode(conn);
+	} else
+#endif
+	for (n = 0; n < nitems; n++) {
+		it = &items[n];
+		warmup_result(L, conn, it, it->kind == WARMUP_PREPARE ?
+		    PQprepare(conn, it->name, it->command, it->nparams,
+		    it->types) :
+		    PQexecParams(conn, it->command, it->nparams, NULL,
+		    it->values, NULL, NULL, 0));
+	}
+
+	/* types made of system composites take one more round trip */
+	if (preload) {
+		lua_newtable(L);
+		for (n = 1; n <= (int)lua_rawlen(L, WARMUP_TODO); n++) {
+			lua_rawgeti(L, WARMUP_TODO, n);
+			lua_rawget(L, WARMUP_SEEN);
+			if (lua_isnil(L, -1)) {
+				lua_rawgeti(L, WARMUP_TODO, n);
+				lua_rawseti(L, -3, lua_rawlen(L, -3) + 1);
+			}
+			lua_pop(L, 1);
+		}
+		conn_types(L, 1);
+		composite_lookup(L, conn, lua_gettop(L), WARMUP_REG,
+		    lua_gettop(L) - 1);
+	}
+
+	lua_pushnil(L);
+	if (!lua_next(L, WARMUP_ERRORS)) {
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+	lua_pushboolean(L, 0);
+	lua_pushvalue(L, WARMUP_ERRORS);
+	return 2;
+}
+
+/*
+ * Transactions
+ *
+ * conn:transaction() runs a function in a transaction whose BEGIN is
+ * deferred until the function executes its first statement, and then
+ * travels in the same round trip: prepended to the command of
+ * conn:exec(), or pipelined with the statement otherwise.  A function
+ * that executes nothing costs no round trip at all.  The function gets
+ * a commit function that sends its final statement together with the
+ * COMMIT.  Transactions that fail with a serialization failure or a
+ * deadlock are run again.  The state lives in the field tx of the
+ * connection's uservalue while the function runs.
+ */
+#define TX_BEGIN_SIZE	96
+#define TX_RETRIES	3
+
+static void sql_params_get(lua_State *, int, int, sqlParams *, int);
+static void sql_params_free(sqlParams *);
+
+/* Push the transaction state of the connection at idx or return 0 */
+static int
+tx_push(lua_State *L, int idx)
+{
+	lua_getuservalue(L, idx);
+	lua_getfield(L, -1, "tx");
+	lua_remove(L, -2);
+	if (lua_istable(L, -1))
+		return 1;
+	lua_pop(L, 1);
+	return 0;
+}
+
+/*
+ * If the connection at idx has a deferred BEGIN, copy it to buf, mark
+ * it as sent and return 1.
+ */
+static int
+tx_take(lua_State *L, int idx, char *buf, size_t size)
+{
+	int pending = 0;
+
+	if (!tx_push(L, idx))
+		return 0;
+	lua_getfield(L, -1, "begin");
+	if (lua_isstring(L, -1)) {
+		snprintf(buf, size, "%s", lua_tostring(L, -1));
+		lua_pushnil(L);
+		lua_setfield(L, -3, "begin");
+		pending = 1;
+	}
+	lua_pop(L, 2);
+	return pending;
+}
+
+/* Remember the SQLSTATE and message of a failed statement */
+static void
+tx_track(lua_State *L, int idx, const PGresult *r)
+{
+	if (r == NULL || PQresultStatus(r) != PGRES_FATAL_ERROR ||
+	    !tx_push(L, idx))
+		return;
+	lua_pushstring(L, PQresultErrorField(r, PG_DIAG_SQLSTATE));
+	lua_setfield(L, -2, "sqlstate");
+	lua_pushstring(L, PQresultErrorMessage(r));
+	lua_setfield(L, -2, "message");
+	lua_pop(L, 1);
+}
+
+/* Send a deferred BEGIN on its own, before calls that can't carry it */
+static void
+tx_flush(lua_State *L, int idx)
+{
+	PGconn *conn;
+	PGresult *r;
+	char begin[TX_BEGIN_SIZE];
+
+	conn = pgsql_conn(L, idx);
+	if (!tx_take(L, idx, begin, sizeof begin))
+		return;
+	r = PQexec(conn, begin);
+	tx_track(L, idx, r);
+	PQclear(r);
+}
+
+/*
+ * Execute a statement, the prepared statement name if it is not NULL,
+ * between the optional commands before and after, in one round trip if
+ * pipelining is available.  Returns the result of the statement, or
+ * that of before if it failed; *last gets the result of after.
+ */
+static PGresult *
+tx_run(PGconn *conn, const char *before, const char *name,
+    const char *command, int n, const Oid *types, const char * const *values,
+    const int *lengths, const int *formats, int format, const char *after,
+    PGresult **last)
+{
+	PGresult *rs[3] = { NULL, NULL, NULL };
+#ifdef LIBPQ_HAS_PIPELINING
+	PGresult *r;
+	int slot[3], nslots, k, ok;
+
+	if (PQpipelineStatus(conn) == PQ_PIPELINE_OFF &&
+	    PQenterPipelineMode(conn)) {
+		nslots = 0;
+		ok = 1;
+		if (before != NULL && (ok = PQsendQueryParams(conn, before, 0,
+		    NULL, NULL, NULL, NULL, 0)))
+			slot[nslots++] = 0;
+		if (ok && (ok = name != NULL ?
+		    PQsendQueryPrepared(conn, name, n, values, lengths, formats,
+		    format) :
+		    PQsendQueryParams(conn, command, n, types, values, lengths,
+		    formats, format)))
+			slot[nslots++] = 1;
+		if (ok && after != NULL && (ok = PQsendQueryParams(conn, after, 0,
+		    NULL, NULL, NULL, NULL, 0)))
+			slot[nslots++] = 2;
+		if (PQpipelineSync(conn))
+			for (k = 0;;) {
+				r = PQgetResult(conn);
+				if (r == NULL) {
+					if (PQstatus(conn) == CONNECTION_BAD)
+						break;
+					k++;
+					continue;
+				}
+				if (PQresultStatus(r) == PGRES_PIPELINE_SYNC) {
+					PQclear(r);
+					break;
+				}
+				if (k < nslots && rs[slot[k]] == NULL)
+					rs[slot[k]] = r;
+				else
+					PQclear(r);
+			}
+		PQexitPipelineMode(conn);
+	} else
+#endif
+	{
+		if (before != NULL)
+			rs[0] = PQexec(conn, before);
+		if (before == NULL || PQresultStatus(rs[0]) == PGRES_COMMAND_OK)
+			rs[1] = name != NULL ?
+			    PQexecPrepared(conn, name, n, values, lengths,
+			    formats, format) :
+			    PQexecParams(conn, command, n, types, values,
+			    lengths, formats, format);
+		if (after != NULL && (PQresultStatus(rs[1]) ==
+		    PGRES_COMMAND_OK || PQresultStatus(rs[1]) ==
+		    PGRES_TUPLES_OK))
+			rs[2] = PQexec(conn, after);
+	}
+	if (rs[0] != NULL && PQresultStatus(rs[0]) != PGRES_COMMAND_OK) {
+		PQclear(rs[1]);
+		PQclear(rs[2]);
+		rs[1] = rs[0];
+		rs[2] = NULL;
+	} else
+		PQclear(rs[0]);
+	if (last != NULL)
+		*last = rs[2];
+	else
+		PQclear(rs[2]);
+	return rs[1];
+}
+
+/* Serialization failures and deadlocks are worth another attempt */
+static int
+tx_retryable(lua_State *L, int tx)
+{
+	const char *state;
+	int retry;
+
+	lua_getfield(L, tx, "sqlstate");
+	state = lua_tostring(L, -1);
+	retry = state != NULL && (!strcmp(state, "40001") ||
+	    !strcmp(state, "40P01"));
+	lua_pop(L, 1);
+	return retry;
+}
+
+/*
+ * commit(command, ...) as passed to the function of conn:transaction()
+ * executes command with the parameters and the COMMIT in one round trip.
+ * Returns the result of command, or nil and an error message if the
+ * COMMIT failed.
+ */
+static int
+tx_commit(lua_State *L)
+{
+	PGresult **res, *r;
+	PGconn *conn;
+	const char *command;
+	char begin[TX_BEGIN_SIZE];
+	sqlParams p;
+	int pending;
+
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_insert(L, 1);
+	conn = pgsql_conn(L, 1);
+	command = luaL_checkstring(L, 2);
+	sql_params_get(L, 3, lua_gettop(L), &p, 1);
+	if (!tx_push(L, 1)) {
+		sql_params_free(&p);
+		return luaL_error(L, "no transaction in progress");
+	}
+	lua_pop(L, 1);
+	pending = tx_take(L, 1, begin, sizeof begin);
+	res = pgsql_res_new(L, 1);
+	*res = tx_run(conn, pending ? begin : NULL, NULL, command, p.n,
+	    p.types, (const char * const *)p.values, p.lengths, p.formats, 0,
+	    "COMMIT", &r);
+	sql_params_free(&p);
+	tx_track(L, 1, *res);
+	pgsql_res_account(L, *res);
+	if ((PQresultStatus(*res) == PGRES_COMMAND_OK ||
+	    PQresultStatus(*res) == PGRES_TUPLES_OK) &&
+	    PQresultStatus(r) != PGRES_COMMAND_OK) {
+		tx_track(L, 1, r);
+		tx_push(L, 1);
+		lua_pushboolean(L, 1);
+		lua_setfield(L, -2, "failed");
+		lua_pushnil(L);
+		lua_pushstring(L, r != NULL ? PQresultErrorMessage(r) :
+		    PQerrorMessage(conn));
+		PQclear(r);
+		return 2;
+	}
+	PQclear(r);
+	return 1;
+}
+
+/* Send COMMIT or ROLLBACK on the connection at idx, 1 if it succeeded */
+static int
+tx_end(lua_State *L, int idx, const char *command)
+{
+	PGconn *conn;
+	PGresult *r;
+	int ok;
+
+	conn = *(PGconn **)lua_touserdata(L, idx);
+	cursor_drain(L, conn);
+	r = PQexec(conn, command);
+	ok = PQresultStatus(r) == PGRES_COMMAND_OK;
+	if (!ok && r == NULL && tx_push(L, idx)) {
+		lua_pushstring(L, PQerrorMessage(conn));
+		lua_setfield(L, -2, "message");
+		lua_pop(L, 1);
+	}
+	tx_track(L, idx, r);
+	PQclear(r);
+	return ok;
+}
+
+/*
+ * conn:transaction(f [, opts]) calls f(conn, commit) in a transaction
+ * and commits it unless f committed it with commit().  opts may set the
+ * isolation level ("serializable", "repeatable read", "read committed"
+ * or "read uncommitted"), readOnly, deferrable and the number of
+ * retries after serialization failures and deadlocks (3 by default).
+ * Returns the values returned by f, or nil and an error message if the
+ * transaction failed.  Errors raised by f roll the transaction back and
+ * are raised again.
+ */
+static int
+conn_transaction(lua_State *L)
+{
+	static const char *levels[] = { "serializable", "repeatable read",
+	    "read committed", "read uncommitted", NULL };
+	static const char *clauses[] = { " ISOLATION LEVEL SERIALIZABLE",
+	    " ISOLATION LEVEL REPEATABLE READ",
+	    " ISOLATION LEVEL READ COMMITTED",
+	    " ISOLATION LEVEL READ UNCOMMITTED" };
+	PGconn *conn;
+	char begin[TX_BEGIN_SIZE];
+	int attempt, retries, status, retry;
+
+	conn = pgsql_conn_query(L, 1);
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	lua_settop(L, 3);
+	snprintf(begin, sizeof begin, "BEGIN");
+	retries = TX_RETRIES;
+	if (!lua_isnil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		lua_getfield(L, 3, "isolation");
+		if (!lua_isnil(L, -1))
+			strcat(begin, clauses[luaL_checkoption(L, -1, NULL,
+			    levels)]);
+		lua_getfield(L, 3, "readOnly");
+		if (!lua_isnil(L, -1))
+			strcat(begin, lua_toboolean(L, -1) ? " READ ONLY" :
+			    " READ WRITE");
+		lua_getfield(L, 3, "deferrable");
+		if (!lua_isnil(L, -1))
+			strcat(begin, lua_toboolean(L, -1) ? " DEFERRABLE" :
+			    " NOT DEFERRABLE");
+		lua_getfield(L, 3, "retries");
+		retries = luaL_optinteger(L, -1, retries);
+		lua_pop(L, 4);
+	}
+	if (PQtransactionStatus(conn) == PQTRANS_UNKNOWN) {
+		lua_pushnil(L);
+		lua_pushstring(L, PQerrorMessage(conn));
+		return 2;
+	}
+	if (PQtransactionStatus(conn) != PQTRANS_IDLE || tx_push(L, 1))
+		return luaL_error(L, "transaction already in progress");
+
+	lua_newtable(L);			/* 4: the state */
+	lua_pushvalue(L, 1);
+	lua_pushcclosure(L, tx_commit, 1);	/* 5: commit() */
+	lua_getuservalue(L, 1);
+	lua_pushvalue(L, 4);
+	lua_setfield(L, -2, "tx");
+	lua_pop(L, 1);
+
+	for (attempt = 0;; attempt++) {
+		lua_settop(L, 5);
+		lua_pushstring(L, begin);
+		lua_setfield(L, 4, "begin");
+		lua_pushnil(L);
+		lua_setfield(L, 4, "sqlstate");
+		lua_pushnil(L);
+		lua_setfield(L, 4, "message");
+		lua_pushnil(L);
+		lua_setfield(L, 4, "failed");
+
+		lua_pushvalue(L, 2);
+		lua_pushvalue(L, 1);
+		lua_pushvalue(L, 5);
+		status = lua_pcall(L, 2, LUA_MULTRET, 0);
+
+		switch (PQtransactionStatus(conn)) {
+		case PQTRANS_IDLE:
+			/* nothing executed, committed by f, or COMMIT failed */
+			lua_getfield(L, 4, "failed");
+			retry = lua_toboolean(L, -1);
+			lua_pop(L, 1);
+			break;
+		case PQTRANS_INTRANS:
+			retry = !tx_end(L, 1, status == 0 ? "COMMIT" :
+			    "ROLLBACK");
+			break;
+		case PQTRANS_INERROR:
+			tx_end(L, 1, "ROLLBACK");
+			retry = 1;
+			break;
+		default:
+			lua_pushstring(L, PQerrorMessage(conn));
+			lua_setfield(L, 4, "message");
+			retry = 1;
+		}
+		if (!retry && status == 0)
+			break;
+		if (attempt < retries && tx_retryable(L, 4))
+			continue;
+		if (status != 0)
+			break;
+		lua_settop(L, 5);
+		lua_pushnil(L);
+		lua_getfield(L, 4, "message");
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			lua_pushliteral(L, "transaction aborted");
+		}
+		break;
+	}
+
+	lua_getuservalue(L, 1);
+	lua_pushnil(L);
+	lua_setfield(L, -2, "tx");
+	lua_pop(L, 1);
+	if (status != 0)
+		return lua_error(L);
+	return lua_gettop(L) - 5;
+}
+
+/*
+ * Plans of slow statements
+ *
+ * After conn:setExplain(), a statement that runs longer than the
+ * threshold is explained with the same parameters, or a sample of such
+ * statements.  With opts.analyze, read-only statements are explained
+ * with ANALYZE and BUFFERS in a transaction, or within a transaction in
+ * a savepoint, that is rolled back.  Prepared statements are explained
+ * through EXPLAIN EXECUTE.  The plans are passed to opts.hook or kept in
+ * a ring buffer that conn:explains() returns.
+ */
+#define EXPLAIN_BUFFER		16
+#define EXPLAIN_SAVEPOINT	"luapgsql_explain"
+
+/* Turn explaining off on the connection at idx */
+static void
+explain_off(lua_State *L, int idx)
+{
+	lua_getuservalue(L, idx);
+	lua_getfield(L, -1, "explain");
+	if (lua_istable(L, -1)) {
+		lua_pushnil(L);
+		lua_setfield(L, -3, "explain");
+		state_counters(L)->explains--;
+	}
+	lua_pop(L, 2);
+}
+
+/*
+ * A uniform number in [0, 1) from the xorshift64* generator with the
+ * state s, which must not be 0.
+ */
+static double
+explain_random(uint64_t *s)
+{
+	*s ^= *s >> 12;
+	*s ^= *s << 25;
+	*s ^= *s >> 27;
+	return (*s * 0x2545f4914f6cdd1dULL >> 11) / 9007199254740992.0;
+}
+
+/* Start the clock for a statement on the connection at idx, if needed */
+static int
+explain_start(lua_State *L, int idx, struct timespec *start)
+{
+	int enabled;
+
+	if (state_counters(L)->explains == 0)
+		return 0;
+	lua_getuservalue(L, idx);
+	lua_getfield(L, -1, "explain");
+	enabled = lua_istable(L, -1);
+	lua_pop(L, 2);
+	if (enabled)
+		clock_gettime(CLOCK_MONOTONIC, start);
+	return enabled;
+}
+
+/* Push the plan in r as one string, or return 0 */
+static int
+explain_plan(lua_State *L, const PGresult *r)
+{
+	luaL_Buffer b;
+	int row, ntuples;
+
+	if (PQresultStatus(r) != PGRES_TUPLES_OK)
+		return 0;
+	luaL_buffinit(L, &b);
+	ntuples = PQntuples(r);
+	for (row = 0; row < ntuples; row++) {
+		if (row > 0)
+			luaL_addchar(&b, '\n');
+		luaL_addstring(&b, PQgetvalue(r, row, 0));
+	}
+	luaL_pushresult(&b);
+	return 1;
+}
+
+/*
+ * Explain command, or the prepared statement name, with the parameters
+ * if it ran longer than the threshold of the connection at idx.  Push
+ * the report for explain_report() and return 1, or return 0.
+ */
+static int
+explain_slow(lua_State *L, int idx, const struct timespec *start,
+    const char *command, const char *name, int n, const Oid *types,
+    const char * const *values, const int *lengths, const int *formats)
+{
+	PGconn *conn;
+	PGresult *r, *last;
+	PGTransactionStatusType status;
+	luaL_Buffer b;
+	const char *explain;
+	char *ident, num[16];
+	double sample;
+	long duration;
+	uint64_t *seed;
+	int top, cfg, analyze, k;
+
+	duration = elapsed_ms(start);
+	conn = *(PGconn **)lua_touserdata(L, idx);
+	if (conn == NULL)
+		return 0;
+	status = PQtransactionStatus(conn);
+	if (status != PQTRANS_IDLE && status != PQTRANS_INTRANS)
+		return 0;
+#ifdef LIBPQ_HAS_PIPELINING
+	if (PQpipelineStatus(conn) != PQ_PIPELINE_OFF)
+		return 0;
+#endif
+	top = lua_gettop(L);
+	lua_getuservalue(L, idx);
+	lua_getfield(L, -1, "explain");
+	cfg = lua_gettop(L);
+	if (!lua_istable(L, cfg)) {
+		lua_settop(L, top);
+		return 0;
+	}
+	lua_getfield(L, cfg, "threshold");
+	lua_getfield(L, cfg, "sample");
+	sample = luaL_optnumber(L, -1, 1.0);
+	lua_getfield(L, cfg, "seed");
+	seed = lua_touserdata(L, -1);
+	if (duration < lua_tointeger(L, -3) ||
+	    (sample < 1.0 && explain_random(seed) >= sample)) {
+		lua_settop(L, top);
+		return 0;
+	}
+	lua_getfield(L, cfg, "analyze");
+	analyze = lua_toboolean(L, -1) && (name != NULL ?
+	    stmt_readonly(L, idx, name) : sql_readonly(command));
+	lua_settop(L, cfg);
+
+	luaL_buffinit(L, &b);
+	luaL_addstring(&b, analyze ? "EXPLAIN (ANALYZE, BUFFERS) " :
+	    "EXPLAIN ");
+	if (name != NULL) {
+		ident = PQescapeIdentifier(conn, name, strlen(name));
+		if (ident == NULL) {
+			lua_settop(L, top);
+			return 0;
+		}
+		luaL_addstring(&b, "EXECUTE ");
+		luaL_addstring(&b, ident);
+		PQfreemem(ident);
+		/* the statement declares its own parameter types */
+		types = NULL;
+		for (k = 0; k < n; k++) {
+			snprintf(num, sizeof num, "%c$%d", k == 0 ? '(' : ',',
+			    k + 1);
+			luaL_addstring(&b, num);
+		}
+		if (n > 0)
+			luaL_addchar(&b, ')');
+	} else
+		luaL_addstring(&b, command);
+	luaL_pushresult(&b);
+	explain = lua_tostring(L, -1);
+
+	if (status == PQTRANS_INTRANS) {
+		PQclear(PQexec(conn, "SAVEPOINT " EXPLAIN_SAVEPOINT));
+		r = PQexecParams(conn, explain, n, types, values, lengths,
+		    formats, 0);
+		PQclear(PQexec(conn, "ROLLBACK TO SAVEPOINT "
+		    EXPLAIN_SAVEPOINT));
+		PQclear(PQexec(conn, "RELEASE SAVEPOINT " EXPLAIN_SAVEPOINT));
+	} else if (analyze) {
+		r = tx_run(conn, "BEGIN", NULL, explain, n, types, values,
+		    lengths, formats, 0, "ROLLBACK", &last);
+		PQclear(last);
+		if (PQtransactionStatus(conn) != PQTRANS_IDLE)
+			PQclear(PQexec(conn, "ROLLBACK"));
+	} else
+		r = PQexecParams(conn, explain, n, types, values, lengths,
+		    formats, 0);
+
+	lua_createtable(L, 0, 4);
+	lua_pushstring(L, name != NULL ? name : command);
+	lua_setfield(L, -2, "statement");
+	lua_pushinteger(L, duration);
+	lua_setfield(L, -2, "duration");
+	lua_pushboolean(L, analyze);
+	lua_setfield(L, -2, "analyze");
+	if (explain_plan(L, r))
+		lua_setfield(L, -2, "plan");
+	else {
+		lua_pushstring(L, r != NULL ? PQresultErrorMessage(r) :
+		    PQerrorMessage(conn));
+		lua_setfield(L, -2, "error");
+	}
+	PQclear(r);
+	lua_replace(L, top + 1);
+	lua_settop(L, top + 1);
+	return 1;
+}
+
+/*
+ * Hand the report on top of the stack to the hook or the ring buffer
+ * of the connection at idx and pop it.  Callers release what the hook
+ * could leak if it raises first.
+ */
+static void
+explain_report(lua_State *L, int idx)
+{
+	int top, cfg, size, next;
+
+	top = lua_gettop(L) - 1;
+	lua_getuservalue(L, idx);
+	lua_getfield(L, -1, "explain");
+	cfg = lua_gettop(L);
+	lua_getfield(L, cfg, "hook");
+	if (!lua_isnil(L, -1)) {
+		lua_pushvalue(L, top + 1);
+		lua_call(L, 1, 0);
+	} else {
+		lua_pop(L, 1);
+		lua_getfield(L, cfg, "size");
+		size = lua_tointeger(L, -1);
+		lua_getfield(L, cfg, "next");
+		next = lua_tointeger(L, -1);
+		lua_pop(L, 2);
+		lua_getfield(L, cfg, "plans");
+		lua_pushvalue(L, top + 1);
+		lua_rawseti(L, -2, next + 1);
+		lua_pushinteger(L, (next + 1) % size);
+		lua_setfield(L, cfg, "next");
+	}
+	lua_settop(L, top);
+}
+
+/*
+ * conn:setExplain(opts) explains statements that run opts.threshold
+ * milliseconds or longer, a fraction opts.sample of them (all by
+ * default), with ANALYZE if opts.analyze is set and the statement only
+ * reads.  The plans go to opts.hook or to a ring buffer of opts.buffer
+ * entries (16 by default).  conn:setExplain() turns this off.
+ */
+static int
+conn_setExplain(lua_State *L)
+{
+	struct timespec now;
+	lua_Integer size;
+	uint64_t *seed;
+
+	pgsql_conn(L, 1);
+	lua_settop(L, 2);
+	if (lua_isnil(L, 2)) {
+		explain_off(L, 1);
+		return 0;
+	}
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_getuservalue(L, 1);
+	lua_createtable(L, 0, 8);
+	lua_getfield(L, 2, "threshold");
+	luaL_argcheck(L, lua_isnumber(L, -1), 2, "threshold expected");
+	lua_setfield(L, -2, "threshold");
+	lua_getfield(L, 2, "sample");
+	luaL_argcheck(L, lua_isnil(L, -1) || lua_isnumber(L, -1), 2,
+	    "sample must be a number");
+	lua_setfield(L, -2, "sample");
+	lua_getfield(L, 2, "analyze");
+	lua_pushboolean(L, lua_toboolean(L, -1));
+	lua_setfield(L, -3, "analyze");
+	lua_pop(L, 1);
+	lua_getfield(L, 2, "hook");
+	luaL_argcheck(L, lua_isnil(L, -1) || lua_isfunction(L, -1), 2,
+	    "hook must be a function");
+	lua_setfield(L, -2, "hook");
+	lua_getfield(L, 2, "buffer");
+	size = luaL_optinteger(L, -1, EXPLAIN_BUFFER);
+	luaL_argcheck(L, size > 0, 2, "buffer size must be positive");
+	lua_pop(L, 1);
+	lua_pushinteger(L, size);
+	lua_setfield(L, -2, "size");
+	lua_pushinteger(L, 0);
+	lua_setfield(L, -2, "next");
+	lua_createtable(L, size, 0);
+	lua_setfield(L, -2, "plans");
+
+	/* each connection samples with its own generator */
+	clock_gettime(CLOCK_REALTIME, &now);
+	seed = lua_newuserdata(L, sizeof(uint64_t));
+	*seed = ((uint64_t)now.tv_sec * 1000000000 + now.tv_nsec) ^
+	    (uint64_t)(uintptr_t)lua_touserdata(L, 1) ^
+	    (uint64_t)getpid() << 32;
+	if (*seed == 0)
+		*seed = 1;
+	lua_setfield(L, -2, "seed");
+	explain_off(L, 1);
+	lua_setfield(L, 3, "explain");
+	state_counters(L)->explains++;
+	return 0;
+}
+
+/* The plans in the ring buffer, the oldest first */
+static int
+conn_explains(lua_State *L)
+{
+	int n, k, size, next;
+
+	pgsql_conn(L, 1);
+	lua_getuservalue(L, 1);
+	lua_getfield(L, -1, "explain");
+	lua_newtable(L);
+	if (!lua_istable(L, -2))
+		return 1;
+	lua_getfield(L, -2, "size");
+	size = lua_tointeger(L, -1);
+	lua_getfield(L, -3, "next");
+	next = lua_tointeger(L, -1);
+	lua_getfield(L, -4, "plans");
+	for (n = 0, k = 0; n < size; n++) {
+		lua_rawgeti(L, -1, (next + n) % size + 1);
+		if (lua_isnil(L, -1))
+			lua_pop(L, 1);
+		else
+			lua_rawseti(L, -5, ++k);
+	}
+	lua_pop(L, 3);
+	return 1;
+}
+
+/*
+ * Command Execution Functions
+ */
+static int
+conn_exec(lua_State *L)
+{
+	PGresult **res;
+	PGconn *conn;
+	PGTransactionStatusType before;
+	const char *command;
+	char begin[TX_BEGIN_SIZE];
+	struct timespec start;
+	deadline d;
+	int armed, timed;
+
+	conn = pgsql_conn_query(L, 1);
+	command = luaL_checkstring(L, 2);
+	codec_resolve(L, 1);
+	before = PQtransactionStatus(conn);
+	timed = explain_start(L, 1, &start);
+	if (tx_take(L, 1, begin, sizeof begin)) {
+		lua_pushfstring(L, "%s; %s", begin, command);
+		command = lua_tostring(L, -1);
+		before = PQTRANS_INTRANS;
+	}
+	res = pgsql_res_new(L, 1);
+	armed = query_deadline(L, 1, 3, &d);
+	*res = PQexec(conn, command);
+	if (armed)
+		deadline_disarm(&d);
+	if (pgsql_lost(conn, *res) && pgsql_recover(L, 1, before) &&
+	    sql_readonly(command)) {
+		PQclear(*res);
+		*res = NULL;
+		armed = query_deadline(L, 1, 3, &d);
+		*res = PQexec(conn, command);
+		if (armed)
+			deadline_disarm(&d);
+	}
+	if (timed && explain_slow(L, 1, &start, lua_tostring(L, 2), NULL, 0,
+	    NULL, NULL, NULL, NULL))
+		explain_report(L, 1);
+	composite_resolve(L, 1, *res);
+	tx_track(L, 1, *res);
+	pgsql_res_account(L, *res);
+	return 1;
+}
+
+static int
+get_sql_params(lua_State *L, int t, int n, Oid *paramTypes, char **paramValues,
+    int *paramLengths, int *paramFormats, int *count)
+{
+	int k, c, total, format, encoder;
+
+	encoder = 0;
+	if ((lua_type(L, t) == LUA_TTABLE || lua_type(L, t) == LUA_TUSERDATA)
+	    && codec_match(L, t)) {
+		/*
+		 * A codec without an encoder leaves the value as it is, in
+		 * both passes, so that the count matches the values stored.
+		 */
+		lua_getfield(L, -1, "encode");
+		encoder = !lua_isnil(L, -1);
+		lua_pop(L, encoder ? 1 : 2);
+	}
+	if (encoder) {
+		const char *s;
+		size_t len;
+
+		if (t < 0)
+			t = lua_gettop(L) + t;
+		if (paramTypes != NULL) {
+			lua_getfield(L, -1, "oid");
+			paramTypes[n] = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+		}
+		if (paramValues == NULL) {
+			lua_pop(L, 1);
+			*count = 1;
+			return 0;
+		}
+		/* the encoded value is a copy, the original stays */
+		lua_pushvalue(L, t);
+		lua_insert(L, -2);
+		format = codec_encode(L, lua_gettop(L) - 1);
+		s = lua_tolstring(L, -1, &len);
+		paramValues[n] = malloc(len + 1);
+		if (paramValues[n] == NULL)
+			return -1;
+		memcpy(paramValues[n], s, len + 1);
+		paramLengths[n] = len;
+		paramFormats[n] = format;
+		lua_pop(L, 1);
+		*count = 1;
+		return 0;
+	}
+
+	switch (lua_type(L, t)) {
+	case LUA_TBOOLEAN:
+		if (paramTypes != NULL)
+			paramTypes[n] = BOOLOID;
+		if (paramValues != NULL) {
+			paramValues[n] = malloc(1);
+			if (paramValues[n] == NULL)
+				return -1;
+			*(char *)paramValues[n] = lua_toboolean(L, t);
+			paramLengths[n] = 1;
+			paramFormats[n] = 1;
+		}
+		n = 1;
+		break;
+	case LUA_TNUMBER:
+		if (paramTypes != NULL)
+#if LUA_VERSION_NUM >= 503
+			if (lua_isinteger(L, t))
+				paramTypes[n] = INT8OID;
+			else
+#endif
+				paramTypes[n] = FLOAT8OID;
+		if (paramValues != NULL) {
+			union {
+				double v;
+				uint64_t i;
+			} swap;
+
+#if LUA_VERSION_NUM >= 503
+			if (lua_isinteger(L, t))
+				swap.i = lua_tointeger(L, t);
+			else
+#endif
+				swap.v = lua_tonumber(L, t);
+			paramValues[n] = malloc(sizeof(uint64_t));
+			if (paramValues[n] == NULL)
+				return -1;
+			*(uint64_t *)paramValues[n] = htobe64(swap.i);
+			paramLengths[n] = sizeof(uint64_t);
+			paramFormats[n] = 1;
+		}
+		n = 1;
+		break;
+	case LUA_TSTRING:
+		if (paramTypes != NULL)
+			paramTypes[n] = TEXTOID;
+		if (paramValues != NULL) {
+			const char *s;
+			size_t len;
+
+			s = lua_tolstring(L, t, &len);
+			paramValues[n] = malloc(len + 1);
+			if (paramValues[n] == NULL)
+				return -1;
+			/*
+			 * lua_tolstring returns a string with '\0' after
+			 * the last character.
+			 */
+			memcpy(paramValues[n], s, len + 1);
+		}
+		n = 1;
+		break;
+	case LUA_TNIL:
+		if (paramValues != NULL)
+			paramValues[n] = NULL;
+		n = 1;
+		break;
+	case LUA_TUSERDATA:
+		{
+			numeric *num;
+
+			if ((num = numeric_test(L, t)) == NULL)
+				return luaL_argerror(L, t, "unsupported type");
+			if (paramTypes != NULL)
+				paramTypes[n] = NUMERICOID;
+			if (paramValues != NULL) {
+				paramValues[n] = malloc(8 + 2 * num->ndigits);
+				if (paramValues[n] == NULL)
+					return -1;
+				numeric_to_binary(num, paramValues[n]);
+				paramLengths[n] = 8 + 2 * num->ndigits;
+				paramFormats[n] = 1;
+			}
+		}
+		n = 1;
+		break;
+	case LUA_TTABLE:
+		if (t < 0)
+			t = lua_gettop(L) + t + 1;
+		for (k = 1, total = 0;; k++) {
+			lua_pushinteger(L, k);
+			lua_gettable(L, t);
+			if (lua_isnil(L, -1))
+				break;
+			c = 0;
+			if (get_sql_params(L, -1, n + total, paramTypes,
+			    paramValues, paramLengths, paramFormats, &c))
+			    	return -1;
+			total += c;
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+		n = total;
+		break;
+	default:
+		return luaL_argerror(L, t, "unsupported type");
+	}
+	*count = n;
+	return 0;
+}
+
+/*
+ * Convert the Lua values at stack positions first to last to query
+ * parameters.  If values is zero, only the parameter types are
+ * determined (as needed for prepare).
+ */
+static void
+sql_params_get(lua_State *L, int first, int last, sqlParams *p, int values)
+{
+	int n, count;
+
+	memset(p, 0, sizeof(sqlParams));
+	for (n = first; n <= last; n++) {
+		get_sql_params(L, n, 0, NULL, NULL, NULL, NULL, &count);
+		p->n += count;
+	}
+	if (p->n == 0)
+		return;
+
+	p->types = calloc(p->n, sizeof(Oid));
+	if (values) {
+		p->values = calloc(p->n, sizeof(char *));
+		p->lengths = calloc(p->n, sizeof(int));
+		p->formats = calloc(p->n, sizeof(int));
+	}
+	if (p->types == NULL || (values && (p->values == NULL
+	    || p->lengths == NULL || p->formats == NULL)))
+		goto errout;
+
+	for (n = first, count = 0; n <= last; n++) {
+		int c;
+
+		if (get_sql_params(L, n, count, p->types, p->values,
+		    p->lengths, p->formats, &c))
+			goto errout;
+		count += c;
+	}
+	return;
+
+errout:
+	sql_params_free(p);
+	luaL_error(L, "out of memory");
+}
+
+static void
+sql_params_free(sqlParams *p)
+{
+	int n;
+
+	if (p->values != NULL)
+		for (n = 0; n < p->n; n++)
+			free(p->values[n]);
+	free(p->types);
+	free(p->values);
+	free(p->lengths);
+	free(p->formats);
+	memset(p, 0, sizeof(sqlParams));
+}
+
+static int
+conn_execParams(lua_State *L)
+{
+	PGresult **res;
+	PGconn *conn;
+	PGTransactionStatusType before;
+	const char *command;
+	char begin[TX_BEGIN_SIZE];
+	struct timespec start;
+	sqlParams p;
+	deadline d;
+	int armed, timed, pending;
+
+	conn = pgsql_conn_query(L, 1);
+	command = luaL_checkstring(L, 2);
+	codec_resolve(L, 1);
+	sql_params_get(L, 3, lua_gettop(L), &p, 1);
+	before = PQtransactionStatus(conn);
+	timed = explain_start(L, 1, &start);
+	res = pgsql_res_new(L, 1);
+	pending = tx_take(L, 1, begin, sizeof begin);
+	armed = query_deadline(L, 1, 0, &d);
+	if (pending) {
+		before = PQTRANS_INTRANS;
+		*res = tx_run(conn, begin, NULL, command, p.n, p.types,
+		    (const char * const*)p.values, p.lengths, p.formats, 0,
+		    NULL, NULL);
+	} else
+		*res = PQexecParams(conn, command, p.n, p.types,
+		    (const char * const*)p.values, p.lengths, p.formats, 0);
+	if (armed)
+		deadline_disarm(&d);
+	if (pgsql_lost(conn, *res) && pgsql_recover(L, 1, before) &&
+	    sql_readonly(command)) {
+		PQclear(*res);
+		*res = NULL;
+		armed = query_deadline(L, 1, 0, &d);
+		*res = PQexecParams(conn, command, p.n, p.types,
+		    (const char * const*)p.values, p.lengths, p.formats, 0);
+		if (armed)
+			deadline_disarm(&d);
+	}
+	if (timed)
+		timed = explain_slow(L, 1, &start, command, NULL, p.n, p.types,
+		    (const char * const*)p.values, p.lengths, p.formats);
+	sql_params_free(&p);
+	if (timed)
+		explain_report(L, 1);
+	composite_resolve(L, 1, *res);
+	tx_track(L, 1, *res);
+	pgsql_res_account(L, *res);
+	return 1;
+}
+
+static int
+conn_prepare(lua_State *L)
+{
+	PGresult **res;
+	PGconn *conn;
+	PGTransactionStatusType before;
+	const char *name, *command;
+	sqlParams p;
+
+	conn = pgsql_conn_query(L, 1);
+	name = luaL_checkstring(L, 2);
+	command = luaL_checkstring(L, 3);
+	tx_flush(L, 1);
+	sql_params_get(L, 4, lua_gettop(L), &p, 0);
+	before = PQtransactionStatus(conn);
+	res = pgsql_res_new(L, 1);
+	*res = PQprepare(conn, name, command, p.n, p.types);
+	if (pgsql_lost(conn, *res) && pgsql_recover(L, 1, before)) {
+		PQclear(*res);
+		*res = PQprepare(conn, name, command, p.n, p.types);
+	}
+	if (PQresultStatus(*res) == PGRES_COMMAND_OK)
+		pgsql_track_prepare(L, 1, name, command, p.n, p.types);
+	sql_params_free(&p);
+	pgsql_res_account(L, *res);
+	return 1;
+}
+
+static int
+conn_execPrepared(lua_State *L)
+{
+	PGresult **res;
+	PGconn *conn;
+	PGTransactionStatusType before;
+	const char *name;
+	char begin[TX_BEGIN_SIZE];
+	struct timespec start;
+	sqlParams p;
+	deadline d;
+	int armed, timed, pending;
+
+	conn = pgsql_conn_query(L, 1);
+	name = luaL_checkstring(L, 2);
+	codec_resolve(L, 1);
+	sql_params_get(L, 3, lua_gettop(L), &p, 1);
+	before = PQtransactionStatus(conn);
+	timed = explain_start(L, 1, &start);
+	res = pgsql_res_new(L, 1);
+	pending = tx_take(L, 1, begin, sizeof begin);
+	armed = query_deadline(L, 1, 0, &d);
+	if (pending) {
+		before = PQTRANS_INTRANS;
+		*res = tx_run(conn, begin, name, NULL, p.n, NULL,
+		    (const char * const*)p.values, p.lengths, p.formats, 0,
+		    NULL, NULL);
+	} else
+		*res = PQexecPrepared(conn, name, p.n,
+		    (const char * const*)p.values, p.lengths, p.formats, 0);
+	if (armed)
+		deadline_disarm(&d);
+	if (pgsql_lost(conn, *res) && pgsql_recover(L, 1, before) &&
+	    stmt_readonly(L, 1, name)) {
+		PQclear(*res);
+		*res = NULL;
+		armed = query_deadline(L, 1, 0, &d);
+		*res = PQexecPrepared(conn, name, p.n,
+		    (const char * const*)p.values, p.lengths, p.formats, 0);
+		if (armed)
+			deadline_disarm(&d);
+	}
+	if (timed)
+		timed = explain_slow(L, 1, &start, NULL, name, p.n, p.types,
+		    (const char * const*)p.values, p.lengths, p.formats);
+	sql_params_free(&p);
+	if (timed)
+		explain_report(L, 1);
+	composite_resolve(L, 1, *res);
+	tx_track(L, 1, *res);
+	pgsql_res_account(L, *res);
+	return 1;
+}
+
+static int
+conn_describePrepared(lua_State *L)
+{
+	PGresult **res;
+	res = pgsql_res_new(L, 1);
+	*res = PQdescribePrepared(pgsql_conn_query(L, 1), luaL_checkstring(L, 2));
+	pgsql_res_account(L, *res);
+	return 1;
+}
+
+static int
+conn_describePortal(lua_State *L)
+{
+	PGresult **res;
+	res = pgsql_res_new(L, 1);
+	*res = PQdescribePortal(pgsql_conn_query(L, 1), luaL_checkstring(L, 2));
+	pgsql_res_account(L, *res);
+	return 1;
+}
+
+static int
+conn_escapeString(lua_State *L)
+{
+	PGconn *d;
+	size_t len;
+	char *buf;
+	const char *str;
+	int error;
+
+	d = pgsql_conn(L, 1);
+
+	str = lua_tolstring(L, 2, &len);
+	if (str == NULL) {
+		lua_pushnil(L);
+		return 1;
+	}
+	buf = calloc(len + 1, 2);
+	if (buf == NULL)
+		return luaL_error(L, "out of memory");
+
+	PQescapeStringConn(d, buf, str, len, &error);
+	if (!error)
+		lua_pushstring(L, buf);
+	else
+		lua_pushnil(L);
+	free(buf);
+	return 1;
+}
+
+static int
+conn_escapeLiteral(lua_State *L)
+{
+	const char *s;
+	char *p;
+	PGconn *d;
+	size_t len;
+
+	d = pgsql_conn(L, 1);
+	s = luaL_checklstring(L, 2, &len);
+	p = PQescapeLiteral(d, s, len);
+	lua_pushstring(L, p);
+	PQfreemem(p);
+	return 1;
+}
+
+static int
+conn_escapeIdentifier(lua_State *L)
+{
+	const char *s;
+	char *p;
+	PGconn *d;
+	size_t len;
+
+	d = pgsql_conn(L, 1);
+	s = luaL_checklstring(L, 2, &len);
+	p = PQescapeIdentifier(d, s, len);
+	lua_pushstring(L, p);
+	PQfreemem(p);
+	return 1;
+}
+
+static int
+conn_escapeBytea(lua_State *L)
+{
+	unsigned char *p;
+	const unsigned char *s;
+	PGconn *d;
+	size_t from_length, to_length;
+
+	d = pgsql_conn(L, 1);
+	s = (const unsigned char *)luaL_checklstring(L, 2, &from_length);
+	p = PQescapeByteaConn(d, s, from_length, &to_length);
+	lua_pushstring(L, (const char *)p);
+	lua_pushinteger(L, to_length);
+	PQfreemem(p);
+	return 2;
+}
+
+static int
+conn_unescapeBytea(lua_State *L)
+{
+	unsigned char *p;
+	size_t len;
+
+	p = PQunescapeBytea((const unsigned char *)luaL_checkstring(L, 2),
+	    &len);
+	if (p == NULL)
+		lua_pushnil(L);
+	else {
+		lua_pushlstring(L, (const char *)p, len);
+		PQfreemem(p);
+	}
+	return 1;
+}
+
+/*
+ * Asynchronous execution in a thread pool
+ *
+ * conn:execAsync() detaches the PGconn from its userdata and queues the
+ * query for a pool of native threads.  The connection is attached again
+ * when the future is found to be finished, until then all methods on the
+ * connection fail as if it had been finished.  Notices raised while the
+ * query runs in the pool are queued and passed on when the connection is
+ * attached again, as their message: to a notice receiver set with
+ * conn:setNoticeReceiver() instead of a result, otherwise to the notice
+ * processor.  A receiver installed from C gets them through the notice
+ * processor as well and a NULL argument when it is restored.  A
+ * connection that was finished or collected while detached is finished
+ * by the future.
+ */
+
+#define POOL_MAX_THREADS	64
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static pthread_t pool_thread[POOL_MAX_THREADS];
+static future *pool_head, *pool_tail;
+static int pool_threads, pool_idle, pool_stop, pool_max = 4;
+static int threads_users;
+
+static void noticeReceiver(void *, const PGresult *);
+static void noticeProcessor(void *, const char *);
+
+/* Runs in the pool, the Lua state must not be touched */
+static void
+queueNotice(void *arg, const PGresult *r)
+{
+	future *f = arg;
+	futureNotice *n;
+	const char *message;
+
+	message = PQresultErrorMessage(r);
+	n = malloc(sizeof(futureNotice) + strlen(message));
+	if (n == NULL)
+		return;
+	strcpy(n->message, message);
+	n->next = NULL;
+	if (f->last != NULL)
+		f->last->next = n;
+	else
+		f->notices = n;
+	f->last = n;
+}
+
+static void
+future_free_notices(future *f)
+{
+	futureNotice *n;
+
+	while ((n = f->notices) != NULL) {
+		f->notices = n->next;
+		free(n);
+	}
+	f->last = NULL;
+}
+
+/* Pass the queued notices on, as the connection would have */
+static void
+future_notices(lua_State *L, future *f)
+{
+	PQnoticeProcessor processor;
+	futureNotice *n;
+
+	processor = PQsetNoticeProcessor(f->conn, NULL, NULL);
+	while ((n = f->notices) != NULL) {
+		/* unlinked first, whatever remains is freed by __gc */
+		f->notices = n->next;
+		if (f->notices == NULL)
+			f->last = NULL;
+		lua_pushstring(L, n->message);
+		free(n);
+		if (f->receiver == noticeReceiver) {
+			lua_pushstring(L, "__pgsqlNoticeReceiver");
+			lua_rawget(L, LUA_REGISTRYINDEX);
+			lua_insert(L, -2);
+			if (lua_pcall(L, 1, 0, 0))
+				luaL_error(L, "%s", lua_tostring(L, -1));
+		} else if (processor != NULL) {
+			processor(processor == noticeProcessor ? L : NULL,
+			    lua_tostring(L, -1));
+			lua_pop(L, 1);
+		} else
+			lua_pop(L, 1);
+	}
+}
+
+static PGresult *
+future_run(future *f)
+{
+	PGresult *r;
+	deadline d;
+	int armed;
+
+	armed = deadline_arm(&d, f->cancel, f->timeout);
+	if (f->params.n == 0)
+		r = PQexec(f->conn, f->command);
+	else
+		r = PQexecParams(f->conn, f->command, f->params.n,
+		    f->params.types, (const char * const *)f->params.values,
+		    f->params.lengths, f->params.formats, 0);
+	if (armed)
+		deadline_disarm(&d);
+	return r;
+}
+
+static void *
+pool_worker(void *arg)
+{
+	future *f;
+	PGresult *r;
+
+	pthread_mutex_lock(&pool_lock);
+	for (;;) {
+		while (pool_head == NULL && !pool_stop)
+			pthread_cond_wait(&pool_work, &pool_lock);
+		if (pool_head == NULL)
+			break;
+		f = pool_head;
+		pool_head = f->next;
+		if (pool_head == NULL)
+			pool_tail = NULL;
+		pool_idle--;
+		pthread_mutex_unlock(&pool_lock);
+
+		r = future_run(f);
+
+		pthread_mutex_lock(&pool_lock);
+		f->res = r;
+		f->done = 1;
+		pool_idle++;
+		pthread_cond_broadcast(&pool_done);
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return NULL;
+}
+
+/* Queue a future, returns 0 if there is no thread to run it */
+static int
+pool_submit(future *f)
+{
+	pthread_mutex_lock(&pool_lock);
+	if (pool_idle == 0 && pool_threads < pool_max) {
+		if (!pthread_create(&pool_thread[pool_threads], NULL,
+		    pool_worker, NULL)) {
+			pool_threads++;
+			pool_idle++;
+		}
+	}
+	if (pool_threads == 0) {
+		pthread_mutex_unlock(&pool_lock);
+		return 0;
+	}
+	f->next = NULL;
+	if (pool_tail != NULL)
+		pool_tail->next = f;
+	else
+		pool_head = f;
+	pool_tail = f;
+	pthread_cond_signal(&pool_work);
+	pthread_mutex_unlock(&pool_lock);
+	return 1;
+}
+
+/* Stop the pool after the queued queries have run */
+static void
+pool_shutdown(void)
+{
+	int n, nthreads;
+
+	pthread_mutex_lock(&pool_lock);
+	pool_stop = 1;
+	nthreads = pool_threads;
+	pthread_cond_broadcast(&pool_work);
+	pthread_mutex_unlock(&pool_lock);
+	for (n = 0; n < nthreads; n++)
+		pthread_join(pool_thread[n], NULL);
+	pthread_mutex_lock(&pool_lock);
+	pool_threads = pool_idle = pool_stop = 0;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/* Stop all threads when the last Lua state using them is closed */
+static int
+threads_release(lua_State *L)
+{
+	int last;
+
+	pthread_mutex_lock(&pool_lock);
+	last = --threads_users == 0;
+	pthread_mutex_unlock(&pool_lock);
+	if (last) {
+		pool_shutdown();
+		watchdog_shutdown();
+	}
+	return 0;
+}
+
+/* Set the maximum number of pool threads, returns the previous one */
+static int
+pgsql_setThreads(lua_State *L)
+{
+	lua_Integer n;
+
+	n = luaL_checkinteger(L, 1);
+	luaL_argcheck(L, n > 0 && n <= POOL_MAX_THREADS, 1,
+	    "number of threads out of range");
+	pthread_mutex_lock(&pool_lock);
+	lua_pushinteger(L, pool_max);
+	pool_max = n;
+	pthread_mutex_unlock(&pool_lock);
+	return 1;
+}
+
+static int
+conn_execAsync(lua_State *L)
+{
+	PGconn **connp;
+	future *f;
+	const char *command;
+	sqlParams p;
+
+	pgsql_conn_query(L, 1);
+	command = luaL_checkstring(L, 2);
+	tx_flush(L, 1);
+	sql_params_get(L, 3, lua_gettop(L), &p, 1);
+
+	f = lua_newuserdata(L, sizeof(future));
+	memset(f, 0, sizeof(future));
+	f->params = p;
+	luaL_getmetatable(L, FUTURE_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_newtable(L);
+	lua_pushvalue(L, 1);
+	lua_setfield(L, -2, "conn");
+	lua_setuservalue(L, -2);
+
+	f->command = strdup(command);
+	if (f->command == NULL) {
+		f->collected = 1;	/* nothing to wait for */
+		sql_params_free(&f->params);
+		return luaL_error(L, "out of memory");
+	}
+	f->timeout = query_timeout(L, 1, 0);
+
+	connp = lua_touserdata(L, 1);
+	f->connp = connp;
+	f->conn = *connp;
+	*connp = NULL;
+
+	/*
+	 * Not the cached handle of the connection, that may be freed
+	 * while the worker still has a deadline armed on it.
+	 */
+	if (f->timeout > 0)
+		f->cancel = PQgetCancel(f->conn);
+	f->receiver = PQsetNoticeReceiver(f->conn, queueNotice, f);
+
+	if (!pool_submit(f)) {
+		f->res = future_run(f);
+		f->done = 1;
+	}
+	return 1;
+}
+
+/* Attach the connection again once the query has finished */
+static void
+future_collect(lua_State *L, int idx, future *f)
+{
+	PGresult **res;
+	int finished;
+
+	if (f->collected)
+		return;
+	f->collected = 1;
+	free(f->command);
+	f->command = NULL;
+	sql_params_free(&f->params);
+	if (f->cancel != NULL) {
+		PQfreeCancel(f->cancel);
+		f->cancel = NULL;
+	}
+
+	/* the connection may have been finished or collected meanwhile */
+	lua_getuservalue(L, idx);
+	lua_getfield(L, -1, "conn");
+	lua_getuservalue(L, -1);
+	lua_getfield(L, -1, "finished");
+	finished = lua_toboolean(L, -1);
+	lua_pushnil(L);
+	lua_setfield(L, -3, "finished");
+	lua_pop(L, 2);
+	if (finished) {
+		lua_pushlightuserdata(L, f->conn);
+		lua_gettable(L, LUA_REGISTRYINDEX);
+		finished = lua_isnil(L, -1);
+		lua_pop(L, 1);
+	}
+	if (f->receiver != NULL)
+		PQsetNoticeReceiver(f->conn, f->receiver,
+		    f->receiver == noticeReceiver ? L : NULL);
+	if (!finished)
+		*f->connp = f->conn;
+
+	res = pgsql_res_new(L, lua_gettop(L));
+	*res = f->res;
+	f->res = NULL;
+	pgsql_res_account(L, *res);
+	lua_setfield(L, -3, "result");
+	lua_pop(L, 2);
+
+	if (finished) {
+		future_free_notices(f);
+		PQfinish(f->conn);
+	} else
+		future_notices(L, f);
+	f->conn = NULL;
+}
+
+static int
+future_ready(lua_State *L)
+{
+	future *f;
+	int done;
+
+	f = luaL_checkudata(L, 1, FUTURE_METATABLE);
+	pthread_mutex_lock(&pool_lock);
+	done = f->done;
+	pthread_mutex_unlock(&pool_lock);
+	if (done)
+		future_collect(L, 1, f);
+	lua_pushboolean(L, done);
+	return 1;
+}
+
+/* Wait for the query to finish, at most timeout ms if given */
+static int
+future_wait(lua_State *L)
+{
+	future *f;
+	struct timespec at;
+	lua_Integer timeout;
+	int done;
+
+	f = luaL_checkudata(L, 1, FUTURE_METATABLE);
+	timeout = luaL_optinteger(L, 2, -1);
+	if (timeout >= 0) {
+		clock_gettime(CLOCK_REALTIME, &at);
+		at.tv_sec += timeout / 1000;
+		at.tv_nsec += (timeout % 1000) * 1000000L;
+		if (at.tv_nsec >= 1000000000L) {
+			at.tv_sec++;
+			at.tv_nsec -= 1000000000L;
+		}
+	}
+	pthread_mutex_lock(&pool_lock);
+	while (!f->done) {
+		if (timeout < 0)
+			pthread_cond_wait(&pool_done, &pool_lock);
+		else if (pthread_cond_timedwait(&pool_done, &pool_lock, &at)
+		    == ETIMEDOUT)
+			break;
+	}
+	done = f->done;
+	pthread_mutex_unlock(&pool_lock);
+	if (done)
+		future_collect(L, 1, f);
+	lua_pushboolean(L, done);
+	return 1;
+}
+
+static int
+future_result(lua_State *L)
+{
+	lua_settop(L, 1);
+	future_wait(L);
+	lua_getuservalue(L, 1);
+	lua_getfield(L, -1, "result");
+	return 1;
+}
+
+/* A future that is collected while its query runs waits for it */
+static int
+future_clear(lua_State *L)
+{
+	future *f;
+
+	f = luaL_checkudata(L, 1, FUTURE_METATABLE);
+	if (!f->collected) {
+		pthread_mutex_lock(&pool_lock);
+		while (!f->done)
+			pthread_cond_wait(&pool_done, &pool_lock);
+		pthread_mutex_unlock(&pool_lock);
+		future_collect(L, 1, f);
+	}
+	future_free_notices(f);
+	return 0;
+}
+
+/*
+ * Connection groups
+ *
+ * A group holds connections to a primary and its replicas.  Statements
+ * that only read, or calls marked with read = true, go to the replicas
+ * in turn, skipping those that are busy with a query of their own;
+ * everything else and anything issued while the primary is in a
+ * transaction goes to the primary.
+ * Roles are found with pg_is_in_recovery() and checked again by
+ * group:refresh(), e.g. after a failover.
+ */
+
+/* Push node n (0 based) of the group at idx, return its PGconn or NULL */
+static PGconn *
+group_node(lua_State *L, int idx, int n)
+{
+	lua_getuservalue(L, idx);
+	lua_rawgeti(L, -1, n + 1);
+	lua_remove(L, -2);
+	return *(PGconn **)lua_touserdata(L, -1);
+}
+
+/*
+ * Whether a node can't take a call now: its connection is detached by
+ * execAsync() or still has an asynchronous query running.
+ */
+static int
+group_busy(PGconn *conn)
+{
+	return conn == NULL || PQisBusy(conn);
+}
+
+static int
+group_refresh(lua_State *L)
+{
+	connGroup *g;
+	PGconn *conn;
+	PGresult *r;
+	int n;
+
+	g = luaL_checkudata(L, 1, GROUP_METATABLE);
+	g->primary = -1;
+	for (n = 0; n < g->nnodes; n++) {
+		conn = group_node(L, 1, n);
+		lua_pop(L, 1);
+		if (conn == NULL) {
+			/* running a query in the pool, keep its role */
+			if (g->role[n] == GROUP_PRIMARY && g->primary == -1)
+				g->primary = n;
+			continue;
+		}
+		g->role[n] = GROUP_DOWN;
+		if (PQstatus(conn) != CONNECTION_OK)
+			PQreset(conn);
+		if (PQstatus(conn) != CONNECTION_OK)
+			continue;
+		r = PQexec(conn, "SELECT pg_catalog.pg_is_in_recovery()");
+		if (PQresultStatus(r) == PGRES_TUPLES_OK &&
+		    PQntuples(r) == 1) {
+			if (*PQgetvalue(r, 0, 0) == 't')
+				g->role[n] = GROUP_REPLICA;
+			else {
+				g->role[n] = GROUP_PRIMARY;
+				if (g->primary == -1)
+					g->primary = n;
+			}
+		}
+		PQclear(r);
+	}
+	lua_pushboolean(L, g->primary != -1);
+	return 1;
+}
+
+/*
+ * Create a group from an array of conninfo strings.  Nodes that can
+ * not be reached are kept and tried again on refresh.
+ */
+static int
+pgsql_group(lua_State *L)
+{
+	connGroup *g;
+	PGconn **data;
+	size_t nnodes;
+	int n;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	nnodes = lua_rawlen(L, 1);
+	luaL_argcheck(L, nnodes > 0, 1, "no nodes");
+	luaL_argcheck(L, nnodes <= INT_MAX, 1, "too many nodes");
+	for (n = 1; n <= (int)nnodes; n++) {
+		lua_rawgeti(L, 1, n);
+		luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 1,
+		    "conninfo strings expected");
+		lua_pop(L, 1);
+	}
+
+	g = lua_newuserdata(L, sizeof(connGroup) + nnodes);
+	g->nnodes = nnodes;
+	g->primary = -1;
+	g->next = 0;
+	memset(g->role, GROUP_DOWN, nnodes);
+	luaL_getmetatable(L, GROUP_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_createtable(L, nnodes, 0);
+	for (n = 0; n < (int)nnodes; n++) {
+		lua_rawgeti(L, 1, n + 1);
+		data = pgsql_conn_new(L);
+		*data = PQconnectdb(lua_tostring(L, -2));
+		if (*data == NULL)
+			return luaL_error(L, "out of memory");
+		lua_rawseti(L, -3, n + 1);
+		lua_pop(L, 1);
+	}
+	lua_setuservalue(L, -2);
+
+	lua_pushcfunction(L, group_refresh);
+	lua_pushvalue(L, -2);
+	lua_call(L, 1, 1);
+	if (!lua_toboolean(L, -1)) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "no primary found");
+		return 2;
+	}
+	lua_pop(L, 1);
+	return 1;
+}
+
+/*
+ * Push the connection to use and return 1, or push nil and an error
+ * message and return 0.
+ */
+static int
+group_pick(lua_State *L, int idx, int read)
+{
+	connGroup *g;
+	PGconn *conn;
+	int n, k;
+
+	g = luaL_checkudata(L, idx, GROUP_METATABLE);
+	if (g->primary != -1) {
+		conn = group_node(L, idx, g->primary);
+		lua_pop(L, 1);
+		/* a transaction pins the group to the primary */
+		if (conn != NULL && PQtransactionStatus(conn) != PQTRANS_IDLE)
+			read = 0;
+	}
+	if (read) {
+		for (k = 0; k < g->nnodes; k++) {
+			n = (g->next + k) % g->nnodes;
+			if (g->role[n] != GROUP_REPLICA)
+				continue;
+			conn = group_node(L, idx, n);
+			lua_pop(L, 1);
+			if (group_busy(conn) ||
+			    PQstatus(conn) != CONNECTION_OK)
+				continue;
+			g->next = (n + 1) % g->nnodes;
+			group_node(L, idx, n);
+			return 1;
+		}
+	}
+	if (g->primary == -1) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "no primary available");
+		return 0;
+	}
+	if (group_node(L, idx, g->primary) == NULL) {
+		lua_pop(L, 1);
+		lua_pushnil(L);
+		lua_pushliteral(L, "primary is busy");
+		return 0;
+	}
+	return 1;
+}
+
+/* Replace the group at index 1 by the connection for the call */
+static int
+group_route(lua_State *L, int read)
+{
+	if (!group_pick(L, 1, read))
+		return 0;
+	lua_replace(L, 1);
+	return 1;
+}
+
+static int
+group_exec(lua_State *L)
+{
+	int read;
+
+	read = sql_readonly(luaL_checkstring(L, 2));
+	if (lua_istable(L, 3)) {
+		lua_getfield(L, 3, "read");
+		if (!lua_isnil(L, -1))
+			read = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+	if (!group_route(L, read))
+		return 2;
+	return conn_exec(L);
+}
+
+static int
+group_execParams(lua_State *L)
+{
+	if (!group_route(L, sql_readonly(luaL_checkstring(L, 2))))
+		return 2;
+	return conn_execParams(L);
+}
+
+static int
+group_execAsync(lua_State *L)
+{
+	if (!group_route(L, sql_readonly(luaL_checkstring(L, 2))))
+		return 2;
+	return conn_execAsync(L);
+}
+
+/* The connection a read-only call would use, for explicit routing */
+static int
+group_reader(lua_State *L)
+{
+	return group_pick(L, 1, 1) ? 1 : 2;
+}
+
+static int
+group_primary(lua_State *L)
+{
+	connGroup *g;
+
+	g = luaL_checkudata(L, 1, GROUP_METATABLE);
+	if (g->primary == -1)
+		lua_pushnil(L);
+	else
+		group_node(L, 1, g->primary);
+	return 1;
+}
+
+/*
+ * Result cache
+ *
+ * conn:resultCache() returns a cache of query results keyed by the SQL
+ * text and the encoded parameters.  Entries expire after a TTL and the
+ * least recently used ones are evicted to stay within a memory budget.
+ * The cache listens on its channels; a notification on one of them
+ * drops the entries tagged with that channel and all untagged entries.
+ * Draining the notifications is up to the cache, notifications for
+ * other channels are handed to the onNotify function if one was given.
+ *
+ * Only queries run outside of a transaction are looked up and stored:
+ * rows read in a transaction may never be committed, and cached rows
+ * would not be those of the transaction's snapshot.
+ *
+ * A hit returns the cached result itself, it must not be cleared or
+ * modified.  Entries are userdata in the entries table of the cache's
+ * uservalue, keyed by the cache key, and linked into the LRU list.
+ * Notifications for other channels that no onNotify function takes are
+ * kept for conn:notifies().  The caches of a connection are listed in
+ * its uservalue; after a reconnect they listen again and are emptied,
+ * as notifications may have been missed.
+ */
+
+static int64_t
+cache_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void
+cache_unlink(resultCache *c, cacheEntry *e)
+{
+	if (e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		c->head = e->next;
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		c->tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void
+cache_push(resultCache *c, cacheEntry *e)
+{
+	e->prev = NULL;
+	e->next = c->head;
+	if (c->head != NULL)
+		c->head->prev = e;
+	c->head = e;
+	if (c->tail == NULL)
+		c->tail = e;
+}
+
+/* Remove an entry from the cache at cidx */
+static void
+cache_remove(lua_State *L, int cidx, cacheEntry *e)
+{
+	resultCache *c;
+
+	c = lua_touserdata(L, cidx);
+	cache_unlink(c, e);
+	c->used -= e->size;
+	c->entries--;
+	lua_getuservalue(L, cidx);
+	lua_getfield(L, -1, "entries");
+	lua_pushlstring(L, e->key, e->keylen);
+	lua_pushnil(L);
+	lua_rawset(L, -3);
+	lua_pop(L, 2);
+}
+
+/* Make room for needed bytes by evicting the least recently used */
+static void
+cache_evict(lua_State *L, int cidx, size_t needed)
+{
+	resultCache *c;
+
+	c = lua_touserdata(L, cidx);
+	while (c->tail != NULL && c->used + needed > c->budget)
+		cache_remove(L, cidx, c->tail);
+}
+
+/* Drop the entries tagged with channel and untagged ones, or all */
+static void
+cache_drop(lua_State *L, int cidx, const char *channel)
+{
+	int drop;
+
+	lua_getuservalue(L, cidx);
+	lua_getfield(L, -1, "entries");
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		drop = 1;
+		if (channel != NULL) {
+			lua_getuservalue(L, -1);
+			lua_getfield(L, -1, "channels");
+			if (lua_istable(L, -1)) {
+				lua_getfield(L, -1, channel);
+				drop = lua_toboolean(L, -1);
+				lua_pop(L, 1);
+			}
+			lua_pop(L, 2);
+		}
+		/* clearing fields while traversing is allowed */
+		if (drop)
+			cache_remove(L, cidx, lua_touserdata(L, -1));
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 2);
+}
+
+/* LISTEN on channel, returns 0 if that failed */
+static int
+cache_listen(lua_State *L, PGconn *conn, const char *channel)
+{
+	PGresult *r;
+	char *ident;
+	int ok;
+
+	ident = PQescapeIdentifier(conn, channel, strlen(channel));
+	if (ident == NULL)
+		return 0;
+	lua_pushfstring(L, "LISTEN %s", ident);
+	PQfreemem(ident);
+	r = PQexec(conn, lua_tostring(L, -1));
+	lua_pop(L, 1);
+	ok = PQresultStatus(r) == PGRES_COMMAND_OK;
+	PQclear(r);
+	return ok;
+}
+
+/* Queue a notification for conn:notifies() of the cache's connection */
+static void
+cache_keep(lua_State *L, int cidx, PGnotify *n)
+{
+	PGnotify **notify;
+
+	notify = lua_newuserdata(L, sizeof(PGnotify *));
+	*notify = n;
+	luaL_getmetatable(L, NOTIFY_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_getuservalue(L, cidx);
+	lua_getfield(L, -1, "conn");
+	lua_getuservalue(L, -1);
+	lua_getfield(L, -1, "notifies");
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -3, "notifies");
+	}
+	lua_pushvalue(L, -5);
+	lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+	lua_pop(L, 5);
+}
+
+/* Empty the caches of the connection at idx and listen again */
+static void
+cache_reconnected(lua_State *L, int idx)
+{
+	PGconn *conn;
+	int cidx;
+
+	conn = *(PGconn **)lua_touserdata(L, idx);
+	lua_getuservalue(L, idx);
+	lua_getfield(L, -1, "caches");
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 2);
+		return;
+	}
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		lua_pop(L, 1);
+		cidx = lua_gettop(L);
+		cache_drop(L, cidx, NULL);
+		lua_getuservalue(L, cidx);
+		lua_getfield(L, -1, "channels");
+		lua_pushnil(L);
+		while (lua_next(L, -2)) {
+			lua_pop(L, 1);
+			cache_listen(L, conn, lua_tostring(L, -1));
+		}
+		lua_pop(L, 2);
+	}
+	lua_pop(L, 2);
+}
+
+/* Process pending notifications on the cache's connection */
+static void
+cache_drain(lua_State *L, int cidx)
+{
+	resultCache *c;
+	PGnotify *n, **notify;
+	int listening;
+
+	c = lua_touserdata(L, cidx);
+	if (!c->listening || *c->conn == NULL)
+		return;
+	PQconsumeInput(*c->conn);
+	while ((n = PQnotifies(*c->conn)) != NULL) {
+		lua_getuservalue(L, cidx);
+		lua_getfield(L, -1, "channels");
+		lua_getfield(L, -1, n->relname);
+		listening = lua_toboolean(L, -1);
+		lua_pop(L, 2);
+		if (listening) {
+			cache_drop(L, cidx, n->relname);
+			PQfreemem(n);
+			lua_pop(L, 1);
+			continue;
+		}
+		lua_getfield(L, -1, "onNotify");
+		lua_remove(L, -2);
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			cache_keep(L, cidx, n);
+			continue;
+		}
+		notify = lua_newuserdata(L, sizeof(PGnotify *));
+		*notify = n;
+		luaL_getmetatable(L, NOTIFY_METATABLE);
+		lua_setmetatable(L, -2);
+		lua_call(L, 1, 0);
+	}
+}
+
+static int
+conn_resultCache(lua_State *L)
+{
+	resultCache *c;
+	PGconn *conn;
+	lua_Integer budget;
+	int n;
+
+	conn = pgsql_conn(L, 1);
+	c = lua_newuserdata(L, sizeof(resultCache));
+	memset(c, 0, sizeof(resultCache));
+	c->conn = lua_touserdata(L, 1);
+	c->ttl = 60000;
+	c->budget = 64 * 1024 * 1024;
+	luaL_getmetatable(L, CACHE_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_createtable(L, 0, 4);
+	lua_pushvalue(L, 1);
+	lua_setfield(L, -2, "conn");
+	lua_newtable(L);
+	lua_setfield(L, -2, "entries");
+	lua_newtable(L);
+	lua_setfield(L, -2, "channels");
+
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "ttl");
+		c->ttl = luaL_optinteger(L, -1, c->ttl);
+		lua_getfield(L, 2, "budget");
+		budget = luaL_optinteger(L, -1, (lua_Integer)c->budget);
+		luaL_argcheck(L, budget >= 0, 2, "budget must not be negative");
+		c->budget = budget;
+		lua_getfield(L, 2, "onNotify");
+		lua_setfield(L, -4, "onNotify");
+		lua_pop(L, 2);
+
+		lua_getfield(L, 2, "channels");
+		if (lua_istable(L, -1)) {
+			lua_getfield(L, -2, "channels");
+			for (n = 1; ; n++) {
+				lua_rawgeti(L, -2, n);
+				if (lua_isnil(L, -1)) {
+					lua_pop(L, 1);
+					break;
+				}
+				if (!cache_listen(L, conn,
+				    luaL_checkstring(L, -1))) {
+					lua_pushnil(L);
+					lua_pushstring(L, PQerrorMessage(conn));
+					return 2;
+				}
+				lua_pushboolean(L, 1);
+				lua_rawset(L, -3);
+				c->listening = 1;
+			}
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+	lua_setuservalue(L, -2);
+
+	/* weak keys, so that the list does not keep caches alive */
+	lua_getuservalue(L, 1);
+	lua_getfield(L, -1, "caches");
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_createtable(L, 0, 1);
+		lua_pushliteral(L, "k");
+		lua_setfield(L, -2, "__mode");
+		lua_setmetatable(L, -2);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -3, "caches");
+	}
+	lua_pushvalue(L, -3);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, -3);
+	lua_pop(L, 2);
+	return 1;
+}
+
+/*
+ * Look up or run a query.  The SQL text is at index 2, the encoded
+ * parameters in p and the options table, if any, at opts.
+ */
+static int
+cache_query(lua_State *L, sqlParams *p, int opts)
+{
+	resultCache *c;
+	cacheEntry *e;
+	PGresult **res, *r;
+	luaL_Buffer b;
+	const char *command, *key;
+	char tag[5];
+	size_t len, keylen;
+	lua_Integer ttl;
+	int n, top, entries, cidx, cacheable;
+
+	c = luaL_checkudata(L, 1, CACHE_METATABLE);
+	luaL_argcheck(L, *c->conn != NULL, 1,
+	    "database connection is finished");
+	cursor_drain(L, *c->conn);
+	command = luaL_checkstring(L, 2);
+	ttl = c->ttl;
+	if (opts) {
+		lua_getfield(L, opts, "ttl");
+		ttl = luaL_optinteger(L, -1, ttl);
+		lua_pop(L, 1);
+	}
+	cache_drain(L, 1);
+
+	/* not in conn:transaction(), whose BEGIN must go first */
+	lua_getuservalue(L, 1);
+	lua_getfield(L, -1, "conn");
+	lua_remove(L, -2);
+	cidx = lua_gettop(L);
+	tx_flush(L, cidx);
+	cacheable = PQtransactionStatus(*c->conn) == PQTRANS_IDLE;
+	if (tx_push(L, cidx)) {
+		cacheable = 0;
+		lua_pop(L, 1);
+	}
+
+	/* the key is the command followed by the encoded parameters */
+	top = lua_gettop(L);
+	luaL_buffinit(L, &b);
+	luaL_addstring(&b, command);
+	for (n = 0; n < p->n; n++) {
+		memcpy(tag, &p->types[n], 4);
+		tag[4] = p->values[n] == NULL ? 'n' :
+		    p->formats[n] ? 'b' : 't';
+		luaL_addlstring(&b, tag, sizeof tag);
+		if (p->values[n] == NULL)
+			continue;
+		len = p->formats[n] ? (size_t)p->lengths[n] :
+		    strlen(p->values[n]);
+		luaL_addlstring(&b, (const char *)&len, sizeof len);
+		luaL_addlstring(&b, p->values[n], len);
+	}
+	luaL_pushresult(&b);
+	lua_getuservalue(L, 1);
+	lua_getfield(L, -1, "entries");
+	lua_remove(L, -2);
+	entries = top + 2;
+
+	lua_pushvalue(L, top + 1);
+	if (cacheable)
+		lua_rawget(L, entries);
+	else {
+		lua_pop(L, 1);
+		lua_pushnil(L);
+	}
+	e = lua_touserdata(L, -1);
+	if (e != NULL) {
+		lua_getuservalue(L, -1);
+		lua_getfield(L, -1, "result");
+		res = lua_touserdata(L, -1);
+		if (*res != NULL && cache_now() < e->expires) {
+			cache_unlink(c, e);
+			cache_push(c, e);
+			c->hits++;
+			sql_params_free(p);
+			return 1;
+		}
+		lua_pop(L, 2);
+		cache_remove(L, 1, e);
+	}
+	lua_pop(L, 1);
+	if (cacheable)
+		c->misses++;
+
+	r = PQexecParams(*c->conn, command, p->n, p->types,
+	    (const char * const *)p->values, p->lengths, p->formats, 0);
+	tx_track(L, cidx, r);
+	sql_params_free(p);
+	res = pgsql_res_new(L, cidx);
+	*res = r;
+	pgsql_res_account(L, r);
+	if (!cacheable || PQresultStatus(r) != PGRES_TUPLES_OK || ttl <= 0)
+		return 1;
+
+	key = lua_tolstring(L, top + 1, &keylen);
+	len = pgsql_res_size(r) + sizeof(cacheEntry) + keylen;
+	if (len > c->budget)
+		return 1;
+	cache_evict(L, 1, len);
+
+	/* the key is kept after the entry to remove it from the table */
+	e = lua_newuserdata(L, sizeof(cacheEntry) + keylen);
+	memset(e, 0, sizeof(cacheEntry));
+	e->size = len;
+	e->expires = cache_now() + ttl;
+	e->keylen = keylen;
+	memcpy(e->key, key, keylen);
+	lua_createtable(L, 0, 2);
+	lua_pushvalue(L, -3);
+	lua_setfield(L, -2, "result");
+	if (opts) {
+		lua_getfield(L, opts, "channels");
+		if (lua_istable(L, -1)) {
+			lua_newtable(L);
+			for (n = 1; ; n++) {
+				lua_rawgeti(L, -2, n);
+				if (lua_isnil(L, -1)) {
+					lua_pop(L, 1);
+					break;
+				}
+				lua_pushboolean(L, 1);
+				lua_rawset(L, -3);
+			}
+			lua_setfield(L, -3, "channels");
+		}
+		lua_pop(L, 1);
+	}
+	lua_setuservalue(L, -2);
+	cache_push(c, e);
+	c->used += len;
+	c->entries++;
+	lua_pushvalue(L, top + 1);
+	lua_insert(L, -2);
+	lua_rawset(L, entries);
+	return 1;
+}
+
+/* cache:exec(sql [, {ttl = ms, channels = {...}}]) */
+static int
+cache_exec(lua_State *L)
+{
+	sqlParams p;
+
+	memset(&p, 0, sizeof p);
+	return cache_query(L, &p, lua_istable(L, 3) ? 3 : 0);
+}
+
+static int
+cache_execParams(lua_State *L)
+{
+	sqlParams p;
+
+	luaL_checkstring(L, 2);
+	sql_params_get(L, 3, lua_gettop(L), &p, 1);
+	return cache_query(L, &p, 0);
+}
+
+/* Drop the entries for a channel, or all entries */
+static int
+cache_invalidate(lua_State *L)
+{
+	luaL_checkudata(L, 1, CACHE_METATABLE);
+	cache_drop(L, 1, luaL_optstring(L, 2, NULL));
+	return 0;
+}
+
+static int
+cache_poll(lua_State *L)
+{
+	luaL_checkudata(L, 1, CACHE_METATABLE);
+	cache_drain(L, 1);
+	return 0;
+}
+
+static int
+cache_stats(lua_State *L)
+{
+	resultCache *c;
+
+	c = luaL_checkudata(L, 1, CACHE_METATABLE);
+	lua_createtable(L, 0, 5);
+	pgsql_pushint64(L, c->hits);
+	lua_setfield(L, -2, "hits");
+	pgsql_pushint64(L, c->misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushinteger(L, c->entries);
+	lua_setfield(L, -2, "entries");
+	pgsql_pushint64(L, c->used);
+	lua_setfield(L, -2, "bytes");
+	pgsql_pushint64(L, c->budget);
+	lua_setfield(L, -2, "budget");
+	return 1;
+}
+
+/*
+ * Asynchronous Command Execution Functions
+ */
+static int
+conn_sendQuery(lua_State *L)
+{
+	PGconn *conn;
+
+	conn = pgsql_conn_query(L, 1);
+	codec_resolve(L, 1);
+	tx_flush(L, 1);
+	lua_pushinteger(L, PQsendQuery(conn, luaL_checkstring(L, 2)));
+	return 1;
+}
+
+static int
+conn_sendQueryParams(lua_State *L)
+{
+	PGconn *conn;
+	const char *command;
+	sqlParams p;
+
+	conn = pgsql_conn_query(L, 1);
+	command = luaL_checkstring(L, 2);
+	codec_resolve(L, 1);
+	sql_params_get(L, 3, lua_gettop(L), &p, 1);
+	tx_flush(L, 1);
+	lua_pushinteger(L, PQsendQueryParams(conn, command, p.n, p.types,
+	    (const char * const*)p.values, p.lengths, p.formats, 0));
+	sql_params_free(&p);
+	return 1;
+}
+
+static int
+conn_sendPrepare(lua_State *L)
+{
+	PGconn *conn;
+	const char *name, *command;
+	sqlParams p;
+
+	conn = pgsql_conn_query(L, 1);
+	name = luaL_checkstring(L, 2);
+	command = luaL_checkstring(L, 3);
+	sql_params_get(L, 4, lua_gettop(L), &p, 0);
+	lua_pushinteger(L, PQsendPrepare(conn, name, command, p.n, p.types));
+	pgsql_track_prepare(L, 1, name, command, p.n, p.types);
+	sql_params_free(&p);
+	return 1;
+}
+
+static int
+conn_sendQueryPrepared(lua_State *L)
+{
+	PGconn *conn;
+	const char *name;
+	sqlParams p;
+
+	conn = pgsql_conn_query(L, 1);
+	name = luaL_checkstring(L, 2);
+	codec_resolve(L, 1);
+	sql_params_get(L, 3, lua_gettop(L), &p, 1);
+	tx_flush(L, 1);
+	lua_pushinteger(L, PQsendQueryPrepared(conn, name, p.n,
+	    (const char * const*)p.values, p.lengths, p.formats, 0));
+	sql_params_free(&p);
+	return 1;
+}
+
+static int
+conn_sendDescribePrepared(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQsendDescribePrepared(pgsql_conn_query(L, 1), luaL_checkstring(L, 2)));
+	return 1;
+}
+
+static int
+conn_sendDescribePortal(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQsendDescribePortal(pgsql_conn_query(L, 1), luaL_checkstring(L, 2)));
+	return 1;
+}
+
+static int
+conn_getResult(lua_State *L)
+{
+	PGresult *r, **res;
+
+	r = PQgetResult(pgsql_conn_query(L, 1));
+	if (r == NULL)
+		lua_pushnil(L);
+	else {
+		res = pgsql_res_new(L, 1);
+		*res = r;
+		pgsql_res_account(L, *res);
+	}
+	return 1;
+}
+
+static int
+conn_cancel(lua_State *L)
+{
+	PGcancel *cancel;
+	char errbuf[256];
+
+	cancel = conn_canceler(L, 1);
+	if (cancel == NULL) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	if (!PQcancel(cancel, errbuf, sizeof errbuf)) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, errbuf);
+		return 2;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+#if PG_VERSION_NUM >= 90200
+static int
+conn_setSingleRowMode(lua_State *L)
+{
+	lua_pushinteger(L, PQsetSingleRowMode(pgsql_conn(L, 1)));
+	return 1;
+}
+#endif
+
+/*
+ * Asynchronous Notification Functions
+ */
+static int
+conn_notifies(lua_State *L)
+{
+	PGnotify **notify, *n;
+	int k, len;
+
+	pgsql_conn(L, 1);
+
+	/* those a result cache took from libpq come first */
+	lua_getuservalue(L, 1);
+	lua_getfield(L, -1, "notifies");
+	if (lua_istable(L, -1) && (len = lua_rawlen(L, -1)) > 0) {
+		lua_rawgeti(L, -1, 1);
+		for (k = 1; k < len; k++) {
+			lua_rawgeti(L, -2, k + 1);
+			lua_rawseti(L, -3, k);
+		}
+		lua_pushnil(L);
+		lua_rawseti(L, -3, len);
+		return 1;
+	}
+	lua_pop(L, 2);
+
+	n = PQnotifies(pgsql_conn(L, 1));
+	if (n == NULL)
+		lua_pushnil(L);
+	else {
+		notify = lua_newuserdata(L, sizeof(PGnotify *));
+		*notify = n;
+		luaL_getmetatable(L, NOTIFY_METATABLE);
+		lua_setmetatable(L, -2);
+	}
+	return 1;
+}
+
+/*
+ * Commands associated with the COPY command
+ */
+static int
+conn_putCopyData(lua_State *L)
+{
+	const char *data;
+	size_t len;
+
+	data = luaL_checklstring(L, 2, &len);
+	lua_pushinteger(L, PQputCopyData(pgsql_conn_query(L, 1), data, len));
+	return 1;
+}
+
+static int
+conn_putCopyEnd(lua_State *L)
+{
+	lua_pushinteger(L, PQputCopyEnd(pgsql_conn_query(L, 1), NULL));
+	return 1;
+}
+
+static int
+conn_getCopyData(lua_State *L)
+{
+	char *data;
+	int res;
+
+	res = PQgetCopyData(pgsql_conn_query(L, 1), &data,
+	    lua_toboolean(L, 2));
+	if (res > 0) {
+		lua_pushlstring(L, data, res);
+		PQfreemem(data);
+		return 1;
+	}
+	if (res == 0) {
+		/* async and no complete row available yet */
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	lua_pushnil(L);
+	if (res == -2) {
+		lua_pushstring(L, PQerrorMessage(pgsql_conn(L, 1)));
+		return 2;
+	}
+	return 1;
+}
+
+/*
+ * Logical replication
+ *
+ * conn:replicationStream() starts streaming from a logical replication
+ * slot using the pgoutput plugin on a connection that was opened with
+ * replication=database.  stream:poll() never blocks unless asked to
+ * wait, decodes the next change into a table and answers keepalives;
+ * standby status updates report the position acknowledged with
+ * stream:ack() and are also sent periodically.
+ */
+
+/* Seconds between the Unix and the PostgreSQL epoch, 2000-01-01 */
+#define PG_EPOCH_OFFSET		946684800LL
+#define PG_EPOCH_USECS		(PG_EPOCH_OFFSET * 1000000)
+#define USECS_PER_DAY		86400000000LL
+
+typedef struct replReader {
+	lua_State	*L;
+	const char	*p;
+	const char	*end;
+} replReader;
+
+static const char *
+repl_bytes(replReader *r, size_t len)
+{
+	const char *p;
+
+	if ((size_t)(r->end - r->p) < len)
+		luaL_error(r->L, "malformed replication message");
+	p = r->p;
+	r->p += len;
+	return p;
+}
+
+static int
+repl_int8(replReader *r)
+{
+	return *(const unsigned char *)repl_bytes(r, 1);
+}
+
+static int
+repl_int16(replReader *r)
+{
+	uint16_t i;
+
+	memcpy(&i, repl_bytes(r, sizeof i), sizeof i);
+	return (int16_t)ntohs(i);
+}
+
+static uint32_t
+repl_int32(replReader *r)
+{
+	uint32_t i;
+
+	memcpy(&i, repl_bytes(r, sizeof i), sizeof i);
+	return ntohl(i);
+}
+
+static uint64_t
+repl_int64(replReader *r)
+{
+	uint64_t i;
+
+	memcpy(&i, repl_bytes(r, sizeof i), sizeof i);
+	return be64toh(i);
+}
+
+static const char *
+repl_string(replReader *r)
+{
+	const char *s;
+	size_t len;
+
+	s = r->p;
+	len = strnlen(s, r->end - r->p);
+	repl_bytes(r, len + 1);
+	return s;
+}
+
+static void
+repl_pushlsn(lua_State *L, uint64_t lsn)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof buf, "%X/%X", (unsigned)(lsn >> 32),
+	    (unsigned)lsn);
+	lua_pushstring(L, buf);
+}
+
+/*
+ * An LSN as an integer or in the "X/X" form; numbers that are not
+ * integers are only taken as long as they are exact.
+ */
+static uint64_t
+repl_checklsn(lua_State *L, int idx)
+{
+	lua_Number d;
+	unsigned hi, lo;
+
+#if LUA_VERSION_NUM >= 503
+	if (lua_isinteger(L, idx))
+		return (uint64_t)lua_tointeger(L, idx);
+#endif
+	if (lua_type(L, idx) == LUA_TNUMBER) {
+		d = lua_tonumber(L, idx);
+		luaL_argcheck(L, d >= 0 && d <= 9007199254740992.0 &&
+		    d == floor(d), idx, "LSN must be an exact integer or a "
+		    "string in the X/X form");
+		return (uint64_t)d;
+	}
+	if (sscanf(luaL_checkstring(L, idx), "%X/%X", &hi, &lo) != 2)
+		luaL_argerror(L, idx, "invalid LSN");
+	return (uint64_t)hi << 32 | lo;
+}
+
+/* Push a timestamp in microseconds since 2000 as seconds since 1970 */
+static void
+repl_pushtime(lua_State *L, int64_t t)
+{
+	lua_pushnumber(L, (lua_Number)t / 1000000.0 + PG_EPOCH_OFFSET);
+}
+
+static int64_t
+repl_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return ((int64_t)now.tv_sec - PG_EPOCH_OFFSET) * 1000000 +
+	    now.tv_nsec / 1000;
+}
+
+/* Send a standby status update */
+static int
+repl_feedback(replStream *s, int reply)
+{
+	char msg[1 + 4 * 8 + 1];
+	uint64_t v[4];
+
+	v[0] = htobe64(s->received);
+	v[1] = htobe64(s->flushed);
+	v[2] = htobe64(s->flushed);
+	v[3] = htobe64((uint64_t)repl_now());
+	msg[0] = 'r';
+	memcpy(msg + 1, v, sizeof v);
+	msg[sizeof msg - 1] = reply;
+	clock_gettime(CLOCK_MONOTONIC, &s->sent);
+	if (PQputCopyData(*s->conn, msg, sizeof msg) != 1)
+		return 0;
+	return PQflush(*s->conn) != -1;
+}
+
+/*
+ * Decode the columns of a TupleData into a table keyed by column name,
+ * using the types from the relation table at rel.  Columns that are
+ * NULL are left out, unchanged TOAST values are listed in a table
+ * under the key unchanged of the message at msg.
+ */
+static void
+repl_tuple(replReader *r, int rel, int msg)
+{
+	lua_State *L = r->L;
+	pgsql_decoder decode;
+	const char *v;
+	uint32_t len;
+	int n, ncols, kind, nunchanged = 0;
+
+	ncols = repl_int16(r);
+	lua_createtable(L, 0, ncols);
+	for (n = 1; n <= ncols; n++) {
+		kind = repl_int8(r);
+		if (kind == 'n')
+			continue;
+		lua_getfield(L, rel, "columns");
+		lua_rawgeti(L, -1, n);
+		lua_remove(L, -2);
+		if (kind == 'u') {
+			lua_getfield(L, msg, "unchanged");
+			if (lua_isnil(L, -1)) {
+				lua_pop(L, 1);
+				lua_newtable(L);
+				lua_pushvalue(L, -1);
+				lua_setfield(L, msg, "unchanged");
+			}
+			lua_insert(L, -2);
+			lua_rawseti(L, -2, ++nunchanged);
+			lua_pop(L, 1);
+			continue;
+		}
+		len = repl_int32(r);
+		v = repl_bytes(r, len);
+		lua_pushlstring(L, v, len);
+		if (kind == 't') {
+			lua_getfield(L, rel, "types");
+			lua_rawgeti(L, -1, n);
+			decode = pgsql_decoder_for(lua_tointeger(L, -1), 0);
+			lua_pop(L, 2);
+			/* the decoders expect a terminated value */
+			if (decode != decode_string) {
+				decode(L, lua_tostring(L, -1), len);
+				lua_remove(L, -2);
+			}
+		}
+		lua_settable(L, -3);
+	}
+}
+
+/* Push the relation table for relid, raising an error if unknown */
+static void
+repl_relation(lua_State *L, int stream, uint32_t relid, int msg)
+{
+	lua_getuservalue(L, stream);
+	lua_getfield(L, -1, "relations");
+	lua_rawgeti(L, -1, relid);
+	if (lua_isnil(L, -1))
+		luaL_error(L, "change for unknown relation %d", (int)relid);
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+	lua_getfield(L, -1, "namespace");
+	lua_setfield(L, msg, "namespace");
+	lua_getfield(L, -1, "name");
+	lua_setfield(L, msg, "relation");
+}
+
+/* Decode one pgoutput message into a table */
+static void
+repl_decode(lua_State *L, int stream, replReader *r)
+{
+	const char *name;
+	uint32_t relid;
+	char ident;
+	int n, ncols, msg, rel, kind;
+
+	lua_newtable(L);
+	msg = lua_gettop(L);
+	switch (repl_int8(r)) {
+	case 'B':
+		lua_pushliteral(L, "begin");
+		lua_setfield(L, msg, "type");
+		repl_pushlsn(L, repl_int64(r));
+		lua_setfield(L, msg, "finalLsn");
+		repl_pushtime(L, (int64_t)repl_int64(r));
+		lua_setfield(L, msg, "time");
+		pgsql_pushint64(L, repl_int32(r));
+		lua_setfield(L, msg, "xid");
+		break;
+	case 'C':
+		lua_pushliteral(L, "commit");
+		lua_setfield(L, msg, "type");
+		repl_int8(r);
+		repl_pushlsn(L, repl_int64(r));
+		lua_setfield(L, msg, "commitLsn");
+		repl_pushlsn(L, repl_int64(r));
+		lua_setfield(L, msg, "endLsn");
+		repl_pushtime(L, (int64_t)repl_int64(r));
+		lua_setfield(L, msg, "time");
+		break;
+	case 'O':
+		lua_pushliteral(L, "origin");
+		lua_setfield(L, msg, "type");
+		repl_pushlsn(L, repl_int64(r));
+		lua_setfield(L, msg, "originLsn");
+		lua_pushstring(L, repl_string(r));
+		lua_setfield(L, msg, "name");
+		break;
+	case 'Y':
+		lua_pushliteral(L, "type");
+		lua_setfield(L, msg, "type");
+		pgsql_pushint64(L, repl_int32(r));
+		lua_setfield(L, msg, "oid");
+		lua_pushstring(L, repl_string(r));
+		lua_setfield(L, msg, "namespace");
+		lua_pushstring(L, repl_string(r));
+		lua_setfield(L, msg, "name");
+		break;
+	case 'R':
+		lua_pushliteral(L, "relation");
+		lua_setfield(L, msg, "type");
+		relid = repl_int32(r);
+		pgsql_pushint64(L, relid);
+		lua_setfield(L, msg, "relid");
+		lua_pushstring(L, repl_string(r));
+		lua_setfield(L, msg, "namespace");
+		lua_pushstring(L, repl_string(r));
+		lua_setfield(L, msg, "name");
+		ident = repl_int8(r);
+		lua_pushlstring(L, &ident, 1);
+		lua_setfield(L, msg, "replicaIdentity");
+		ncols = repl_int16(r);
+		lua_createtable(L, ncols, 0);
+		lua_createtable(L, ncols, 0);
+		lua_createtable(L, ncols, 0);
+		for (n = 1; n <= ncols; n++) {
+			kind = repl_int8(r);
+			name = repl_string(r);
+			if (kind & 1) {
+				lua_pushstring(L, name);
+				lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+			}
+			lua_pushstring(L, name);
+			lua_rawseti(L, -4, n);
+			pgsql_pushint64(L, repl_int32(r));
+			lua_rawseti(L, -3, n);
+			repl_int32(r);
+		}
+		lua_setfield(L, msg, "key");
+		lua_setfield(L, msg, "types");
+		lua_setfield(L, msg, "columns");
+		/* later changes refer to the relation by its id */
+		lua_getuservalue(L, stream);
+		lua_getfield(L, -1, "relations");
+		lua_pushvalue(L, msg);
+		lua_rawseti(L, -2, relid);
+		lua_pop(L, 2);
+		break;
+	case 'I':
+		lua_pushliteral(L, "insert");
+		lua_setfield(L, msg, "type");
+		repl_relation(L, stream, repl_int32(r), msg);
+		rel = lua_gettop(L);
+		repl_int8(r);			/* 'N' */
+		repl_tuple(r, rel, msg);
+		lua_setfield(L, msg, "new");
+		lua_pop(L, 1);
+		break;
+	case 'U':
+		lua_pushliteral(L, "update");
+		lua_setfield(L, msg, "type");
+		repl_relation(L, stream, repl_int32(r), msg);
+		rel = lua_gettop(L);
+		kind = repl_int8(r);
+		if (kind == 'K' || kind == 'O') {
+			repl_tuple(r, rel, msg);
+			lua_setfield(L, msg, kind == 'K' ? "key" : "old");
+			kind = repl_int8(r);
+		}
+		repl_tuple(r, rel, msg);
+		lua_setfield(L, msg, "new");
+		lua_pop(L, 1);
+		break;
+	case 'D':
+		lua_pushliteral(L, "delete");
+		lua_setfield(L, msg, "type");
+		repl_relation(L, stream, repl_int32(r), msg);
+		rel = lua_gettop(L);
+		kind = repl_int8(r);
+		repl_tuple(r, rel, msg);
+		lua_setfield(L, msg, kind == 'K' ? "key" : "old");
+		lua_pop(L, 1);
+		break;
+	case 'T':
+		lua_pushliteral(L, "truncate");
+		lua_setfield(L, msg, "type");
+		ncols = repl_int32(r);
+		n = repl_int8(r);
+		lua_pushboolean(L, n & 1);
+		lua_setfield(L, msg, "cascade");
+		lua_pushboolean(L, n & 2);
+		lua_setfield(L, msg, "restartIdentity");
+		lua_createtable(L, ncols, 0);
+		for (n = 1; n <= ncols; n++) {
+			pgsql_pushint64(L, repl_int32(r));
+			lua_rawseti(L, -2, n);
+		}
+		lua_setfield(L, msg, "relids");
+		break;
+	default:
+		lua_pushliteral(L, "unknown");
+		lua_setfield(L, msg, "type");
+	}
+}
+
+static int
+conn_replicationStream(lua_State *L)
+{
+	replStream *s;
+	PGconn *conn;
+	PGresult *r;
+	char *slot, *publication;
+	uint64_t start;
+	lua_Integer interval;
+
+	conn = pgsql_conn(L, 1);
+	luaL_checkstring(L, 2);
+	luaL_checkstring(L, 3);
+	start = 0;
+	interval = 10000;
+	if (lua_istable(L, 4)) {
+		lua_getfield(L, 4, "startLsn");
+		if (!lua_isnil(L, -1))
+			start = repl_checklsn(L, -1);
+		lua_getfield(L, 4, "feedbackInterval");
+		interval = luaL_optinteger(L, -1, interval);
+		lua_pop(L, 2);
+	}
+
+	slot = PQescapeIdentifier(conn, lua_tostring(L, 2),
+	    lua_rawlen(L, 2));
+	publication = PQescapeLiteral(conn, lua_tostring(L, 3),
+	    lua_rawlen(L, 3));
+	if (slot == NULL || publication == NULL) {
+		PQfreemem(slot);
+		PQfreemem(publication);
+		lua_pushnil(L);
+		lua_pushstring(L, PQerrorMessage(conn));
+		return 2;
+	}
+	lua_pushfstring(L, "START_REPLICATION SLOT %s LOGICAL ", slot);
+	repl_pushlsn(L, start);
+	lua_pushfstring(L, " (proto_version '1', publication_names %s)",
+	    publication);
+	lua_concat(L, 3);
+	PQfreemem(slot);
+	PQfreemem(publication);
+
+	r = PQexec(conn, lua_tostring(L, -1));
+	if (PQresultStatus(r) != PGRES_COPY_BOTH) {
+		lua_pushnil(L);
+		lua_pushstring(L, PQerrorMessage(conn));
+		PQclear(r);
+		return 2;
+	}
+	PQclear(r);
+
+	s = lua_newuserdata(L, sizeof(replStream));
+	s->conn = lua_touserdata(L, 1);
+	s->received = s->flushed = start;
+	s->interval = interval;
+	s->done = 0;
+	clock_gettime(CLOCK_MONOTONIC, &s->sent);
+	luaL_getmetatable(L, REPL_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_createtable(L, 0, 2);
+	lua_pushvalue(L, 1);
+	lua_setfield(L, -2, "conn");
+	lua_newtable(L);
+	lua_setfield(L, -2, "relations");
+	lua_setuservalue(L, -2);
+	return 1;
+}
+
+static replStream *
+repl_check(lua_State *L, int idx)
+{
+	replStream *s;
+
+	s = luaL_checkudata(L, idx, REPL_METATABLE);
+	luaL_argcheck(L, *s->conn != NULL, idx,
+	    "database connection is finished");
+	return s;
+}
+
+/*
+ * Return the next change as a table, false if none is available within
+ * timeout ms (0 by default, -1 waits indefinitely), or nil and an error
+ * message when the stream ended.
+ */
+static int
+repl_poll(lua_State *L)
+{
+	replStream *s;
+	replReader r;
+	PGresult *res;
+	struct pollfd pfd;
+	char *buf;
+	const char *msg;
+	lua_Integer timeout;
+	uint64_t start, end;
+	int len, reply;
+
+	s = repl_check(L, 1);
+	timeout = luaL_optinteger(L, 2, 0);
+	if (s->done) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "replication stream has ended");
+		return 2;
+	}
+	for (;;) {
+		if (s->interval > 0 && elapsed_ms(&s->sent) >= s->interval)
+			repl_feedback(s, 0);
+		len = PQgetCopyData(*s->conn, &buf, 1);
+		if (len == 0) {
+			if (timeout != 0) {
+				pfd.fd = PQsocket(*s->conn);
+				pfd.events = POLLIN;
+				pfd.revents = 0;
+				if (poll(&pfd, 1, timeout) == -1 &&
+				    errno != EINTR)
+					break;
+				timeout = 0;
+			}
+			if (!PQconsumeInput(*s->conn))
+				break;
+			len = PQgetCopyData(*s->conn, &buf, 1);
+			if (len == 0) {
+				lua_pushboolean(L, 0);
+				return 1;
+			}
+		}
+		if (len < 0)
+			break;
+
+		/* decoding can raise errors, the copy is collected then */
+		lua_pushlstring(L, buf, len);
+		PQfreemem(buf);
+		msg = lua_tostring(L, -1);
+		r.L = L;
+		r.p = msg;
+		r.end = msg + len;
+		switch (msg[0]) {
+		case 'k':
+			repl_int8(&r);
+			end = repl_int64(&r);
+			repl_int64(&r);
+			reply = repl_int8(&r);
+			if (end > s->received)
+				s->received = end;
+			lua_pop(L, 1);
+			if (reply)
+				repl_feedback(s, 0);
+			continue;
+		case 'w':
+			repl_int8(&r);
+			start = repl_int64(&r);
+			end = repl_int64(&r);
+			repl_int64(&r);
+			if (end > s->received)
+				s->received = end;
+			repl_decode(L, 1, &r);
+			repl_pushlsn(L, start);
+			lua_setfield(L, -2, "lsn");
+			return 1;
+		}
+		lua_pop(L, 1);
+	}
+	s->done = 1;
+	while ((res = PQgetResult(*s->conn)) != NULL)
+		PQclear(res);
+	lua_pushnil(L);
+	lua_pushstring(L, PQerrorMessage(*s->conn));
+	return 2;
+}
+
+/* Acknowledge that changes up to lsn have been processed */
+static int
+repl_ack(lua_State *L)
+{
+	replStream *s;
+	uint64_t lsn;
+
+	s = repl_check(L, 1);
+	lsn = repl_checklsn(L, 2);
+	if (lsn > s->flushed)
+		s->flushed = lsn;
+	if (s->flushed > s->received)
+		s->received = s->flushed;
+	return 0;
+}
+
+static int
+repl_sendFeedback(lua_State *L)
+{
+	replStream *s;
+
+	s = repl_check(L, 1);
+	lua_pushboolean(L, repl_feedback(s, lua_toboolean(L, 2)));
+	return 1;
+}
+
+static int
+repl_socket(lua_State *L)
+{
+	lua_pushinteger(L, PQsocket(*repl_check(L, 1)->conn));
+	return 1;
+}
+
+static int
+repl_flushedLsn(lua_State *L)
+{
+	repl_pushlsn(L, repl_check(L, 1)->flushed);
+	return 1;
+}
+
+/* End the stream, the connection can then be used for commands again */
+static int
+repl_stop(lua_State *L)
+{
+	replStream *s;
+	PGresult *r;
+	char *buf;
+
+	s = repl_check(L, 1);
+	if (!s->done) {
+		repl_feedback(s, 0);
+		PQputCopyEnd(*s->conn, NULL);
+		PQflush(*s->conn);
+		while (PQgetCopyData(*s->conn, &buf, 0) > 0)
+			PQfreemem(buf);
+		while ((r = PQgetResult(*s->conn)) != NULL)
+			PQclear(r);
+		s->done = 1;
+	}
+	return 0;
+}
+
+/*
+ * Server side cursors
+ */
+static unsigned int cursor_serial;
+
+static PGconn *
+cursor_conn(lua_State *L, cursor *c)
+{
+	if (*c->conn == NULL)
+		luaL_error(L, "database connection is finished");
+	return *c->conn;
+}
+
+/*
+ * Collect the FETCH that a cursor has in flight on conn, so that the
+ * connection can run another query without libpq discarding the batch.
+ */
+static void
+cursor_drain(lua_State *L, PGconn *conn)
+{
+	cursor *c;
+	PGresult *r;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, CURSORS_REGISTRY);
+	lua_pushlightuserdata(L, conn);
+	lua_rawget(L, -2);
+	c = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (c != NULL) {
+		lua_pushlightuserdata(L, conn);
+		lua_pushnil(L);
+		lua_rawset(L, -3);
+		c->ahead = PQgetResult(conn);
+		if (c->ahead == NULL)
+			c->ahead = PQmakeEmptyPGresult(conn, PGRES_FATAL_ERROR);
+		while ((r = PQgetResult(conn)) != NULL)
+			PQclear(r);
+	}
+	lua_pop(L, 1);
+}
+
+/* Forget the FETCH in flight on conn */
+static void
+cursor_unlist(lua_State *L, PGconn *conn)
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, CURSORS_REGISTRY);
+	lua_pushlightuserdata(L, conn);
+	lua_pushnil(L);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+}
+
+/*
+ * Send the FETCH for the next batch of the cursor at idx so that the
+ * server produces it while Lua is still busy with the current one.
+ */
+static void
+cursor_prefetch(lua_State *L, cursor *c, int idx)
+{
+	char command[64];
+	PGconn *conn;
+
+	if (c->done || c->pending)
+		return;
+	conn = cursor_conn(L, c);
+	cursor_drain(L, conn);
+	snprintf(command, sizeof command, "FETCH %d FROM %s", c->fetch,
+	    c->name);
+	if (!PQsendQuery(conn, command))
+		luaL_error(L, "%s", PQerrorMessage(conn));
+	c->pending = 1;
+	lua_getfield(L, LUA_REGISTRYINDEX, CURSORS_REGISTRY);
+	lua_pushlightuserdata(L, conn);
+	lua_pushvalue(L, idx);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+}
+
+/*
+ * Wait for the pending batch of the cursor at idx; returns the number
+ * of rows in it.
+ */
+static int
+cursor_next_batch(lua_State *L, cursor *c, int idx)
+{
+	PGconn *conn;
+	PGresult *r, *extra;
+
+	if (c->res != NULL) {
+		PQclear(c->res);
+		c->res = NULL;
+	}
+	if (!c->pending)
+		return 0;
+	conn = cursor_conn(L, c);
+	if (c->ahead != NULL) {
+		r = c->ahead;
+		c->ahead = NULL;
+	} else {
+		cursor_unlist(L, conn);
+		r = PQgetResult(conn);
+		while ((extra = PQgetResult(conn)) != NULL)
+			PQclear(extra);
+	}
+	c->pending = 0;
+	if (r == NULL || PQresultStatus(r) != PGRES_TUPLES_OK) {
+		c->done = 1;
+		lua_pushstring(L, r != NULL ? PQresultErrorMessage(r) :
+		    PQerrorMessage(conn));
+		PQclear(r);
+		return lua_error(L);
+	}
+	c->res = r;
+	c->row = 0;
+	pgsql_res_account(L, r);
+	if (PQntuples(r) < c->fetch)
+		c->done = 1;
+	else
+		cursor_prefetch(L, c, idx);
+	return PQntuples(r);
+}
+
+/*
+ * A cursor without hold disappears with its transaction, and a later
+ * transaction may be running when the cursor is released.  Closing it
+ * blindly would then abort that transaction, so it is only closed when
+ * the server still knows it, and never from the garbage collector.
+ */
+static void
+cursor_release(lua_State *L, cursor *c, int explicit)
+{
+	PGconn *conn;
+	PGresult *r;
+	const char *name;
+	char command[64];
+	int exists;
+
+	if (c->closed)
+		return;
+	c->closed = c->done = 1;
+	if (c->res != NULL) {
+		PQclear(c->res);
+		c->res = NULL;
+	}
+	conn = *c->conn;
+	if (conn == NULL)
+		return;
+	if (c->ahead != NULL) {
+		PQclear(c->ahead);
+		c->ahead = NULL;
+	} else if (c->pending) {
+		cursor_unlist(L, conn);
+		while ((r = PQgetResult(conn)) != NULL)
+			PQclear(r);
+	} else
+		cursor_drain(L, conn);
+	c->pending = 0;
+	switch (PQtransactionStatus(conn)) {
+	case PQTRANS_IDLE:
+		exists = c->hold;
+		break;
+	case PQTRANS_INTRANS:
+		if (c->hold)
+			exists = 1;
+		else if (explicit) {
+			name = c->name;
+			r = PQexecParams(conn,
+			    "SELECT 1 FROM pg_cursors WHERE name = $1", 1,
+			    NULL, &name, NULL, NULL, 0);
+			exists = PQresultStatus(r) == PGRES_TUPLES_OK
+			    && PQntuples(r) == 1;
+			PQclear(r);
+		} else
+			exists = 0;
+		break;
+	default:
+		exists = 0;
+	}
+	if (exists) {
+		snprintf(command, sizeof command, "CLOSE %s", c->name);
+		PQclear(PQexec(conn, command));
+	}
+}
+
+static int
+conn_cursor(lua_State *L)
+{
+	cursor *c;
+	PGconn *conn;
+	PGresult *r;
+	sqlParams p;
+	const char *command;
+	char name[32];
+	int fetch, hold;
+
+	conn = pgsql_conn_query(L, 1);
+	command = luaL_checkstring(L, 2);
+	fetch = 1000;
+	hold = 0;
+	if (!lua_isnoneornil(L, 4)) {
+		luaL_checktype(L, 4, LUA_TTABLE);
+		lua_getfield(L, 4, "fetch");
+		if (!lua_isnil(L, -1))
+			fetch = luaL_checkinteger(L, -1);
+		lua_getfield(L, 4, "hold");
+		hold = lua_toboolean(L, -1);
+		lua_pop(L, 2);
+		luaL_argcheck(L, fetch > 0, 4, "fetch size must be positive");
+	}
+	tx_flush(L, 1);
+	if (!hold && PQtransactionStatus(conn) != PQTRANS_INTRANS)
+		return luaL_error(L, "cursor without hold must be declared "
+		    "within a transaction block");
+
+	snprintf(name, sizeof name, "luapgsql_cursor_%u", ++cursor_serial);
+	lua_pushfstring(L, "DECLARE %s NO SCROLL CURSOR %sFOR %s", name,
+	    hold ? "WITH HOLD " : "", command);
+	if (lua_isnoneornil(L, 3))
+		memset(&p, 0, sizeof p);
+	else
+		sql_params_get(L, 3, 3, &p, 1);
+	r = PQexecParams(conn, lua_tostring(L, -1), p.n, p.types,
+	    (const char * const*)p.values, p.lengths, p.formats, 0);
+	sql_params_free(&p);
+	if (PQresultStatus(r) != PGRES_COMMAND_OK) {
+		lua_pushnil(L);
+		lua_pushstring(L, r != NULL ? PQresultErrorMessage(r) :
+		    PQerrorMessage(conn));
+		PQclear(r);
+		return 2;
+	}
+	PQclear(r);
+
+	c = lua_newuserdata(L, sizeof(cursor));
+	memset(c, 0, sizeof(cursor));
+	c->conn = luaL_checkudata(L, 1, CONN_METATABLE);
+	c->fetch = fetch;
+	c->hold = hold;
+	strcpy(c->name, name);
+	luaL_getmetatable(L, CURSOR_METATABLE);
+	lua_setmetatable(L, -2);
+
+	/* keep the connection alive as long as the cursor is */
+	lua_newtable(L);
+	lua_pushvalue(L, 1);
+	lua_setfield(L, -2, "conn");
+	lua_setuservalue(L, -2);
+
+	cursor_prefetch(L, c, lua_gettop(L));
+	return 1;
+}
+
+/*
+ * Control functions
+ */
+static int
+conn_clientEncoding(lua_State *L)
+{
+	lua_pushstring(L,
+	    pg_encoding_to_char(PQclientEncoding(pgsql_conn(L, 1))));
+	return 1;
+}
+
+static int
+conn_setClientEncoding(lua_State *L)
+{
+	if (PQsetClientEncoding(pgsql_conn(L, 1), luaL_checkstring(L, 2)))
+		lua_pushboolean(L, 0);
+	else
+		lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int
+conn_setErrorVerbosity(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQsetErrorVerbosity(pgsql_conn(L, 1), luaL_checkinteger(L, 2)));
+	return 1;
+}
+
+#ifdef LIBPQ_HAS_TRACE_FLAGS
+/*
+ * Protocol trace ring
+ *
+ * conn:traceBuffer() makes libpq trace to a stream whose write function
+ * parses the trace as it is written and keeps the direction, type, length
+ * and time of each message, and the statement it belongs to, in a ring
+ * buffer of fixed size.  Nothing is written out, so the ring can stay on
+ * under load; conn:traceDump() returns its contents.
+ */
+#define TRACE_BUFFER	4096
+
+/* Fields of a trace line, see trace_parse() */
+#define TRACE_FROM	0
+#define TRACE_TAB	1
+#define TRACE_LENGTH	2
+#define TRACE_NAME	3
+#define TRACE_REST	4
+#define TRACE_SKIP	5
+
+typedef struct traceMessage {
+	const char	*name;		/* as libpq traces it */
+	char		 from;		/* 'F' frontend, 'B' backend */
+	char		 type;		/* '\0' for untyped messages */
+} traceMessage;
+
+/* Index 0 is for messages not in the list */
+static const traceMessage trace_messages[] = {
+	{ "Unknown", '?', '\0' },
+	{ "Query", 'F', 'Q' },
+	{ "Parse", 'F', 'P' },
+	{ "Bind", 'F', 'B' },
+	{ "Describe", 'F', 'D' },
+	{ "Execute", 'F', 'E' },
+	{ "Close", 'F', 'C' },
+	{ "Sync", 'F', 'S' },
+	{ "Flush", 'F', 'H' },
+	{ "FunctionCall", 'F', 'F' },
+	{ "CopyData", 'F', 'd' },
+	{ "CopyDone", 'F', 'c' },
+	{ "CopyFail", 'F', 'f' },
+	{ "Terminate", 'F', 'X' },
+	{ "PasswordMessage", 'F', 'p' },
+	{ "SASLInitialResponse", 'F', 'p' },
+	{ "SASLResponse", 'F', 'p' },
+	{ "GSSResponse", 'F', 'p' },
+	{ "StartupMessage", 'F', '\0' },
+	{ "SSLRequest", 'F', '\0' },
+	{ "GSSENCRequest", 'F', '\0' },
+	{ "CancelRequest", 'F', '\0' },
+	{ "ParseComplete", 'B', '1' },
+	{ "BindComplete", 'B', '2' },
+	{ "CloseComplete", 'B', '3' },
+	{ "NotificationResponse", 'B', 'A' },
+	{ "CommandComplete", 'B', 'C' },
+	{ "DataRow", 'B', 'D' },
+	{ "ErrorResponse", 'B', 'E' },
+	{ "CopyInResponse", 'B', 'G' },
+	{ "CopyOutResponse", 'B', 'H' },
+	{ "EmptyQueryResponse", 'B', 'I' },
+	{ "BackendKeyData", 'B', 'K' },
+	{ "NoData", 'B', 'n' },
+	{ "NoticeResponse", 'B', 'N' },
+	{ "Authentication", 'B', 'R' },
+	{ "PortalSuspended", 'B', 's' },
+	{ "ParameterStatus", 'B', 'S' },
+	{ "ParameterDescription", 'B', 't' },
+	{ "RowDescription", 'B', 'T' },
+	{ "NegotiateProtocolVersion", 'B', 'v' },
+	{ "FunctionCallResponse", 'B', 'V' },
+	{ "CopyBothResponse", 'B', 'W' },
+	{ "ReadyForQuery", 'B', 'Z' },
+	{ "CopyData", 'B', 'd' },
+	{ "CopyDone", 'B', 'c' },
+	{ NULL, '\0', '\0' }
+};
+
+/* Find the message by its direction and traced name, 0 if not found */
+static unsigned char
+trace_message(char from, const char *name)
+{
+	const traceMessage *m;
+
+	for (m = &trace_messages[1]; m->name != NULL; m++)
+		if (m->from == from && (!strcmp(m->name, name) ||
+		    (m->type == 'R' && !strncmp(name, m->name,
+		    sizeof "Authentication" - 1))))
+			return m - trace_messages;
+	return 0;
+}
+
+/* Count statements and sync points, return the statement of the message */
+static uint32_t
+trace_statement(traceRing *t, const traceMessage *m)
+{
+	uint32_t statement;
+
+	if (m->from == 'F') {
+		switch (m->type) {
+		case 'B':
+			if (t->last == 'P')
+				break;
+			/* FALLTHROUGH */
+		case 'Q':
+		case 'P':
+		case 'F':
+			t->sent++;
+		}
+		t->last = m->type;
+		if (m->type == 'S' || m->type == 'Q' || m->type == 'F') {
+			/* when full, the newest mark moves forward */
+			if (t->nmarks == TRACE_MARKS)
+				t->nmarks--;
+			t->marks[(t->mark + t->nmarks++) % TRACE_MARKS] =
+			    t->sent;
+		}
+		return t->sent;
+	}
+
+	/* a reply belongs to the first statement not answered yet */
+	statement = t->answered + 1;
+	if (t->nmarks > 0 && statement > t->marks[t->mark])
+		statement = t->marks[t->mark];
+	else if (statement > t->sent)
+		statement = t->sent;
+	switch (m->type) {
+	case 'C':
+	case 'E':
+	case 'I':
+	case 'V':
+		if (t->answered < statement)
+			t->answered = statement;
+		break;
+	case 'Z':
+		if (t->nmarks > 0) {
+			t->answered = t->marks[t->mark];
+			t->mark = (t->mark + 1) % TRACE_MARKS;
+			t->nmarks--;
+		}
+		break;
+	}
+	return statement;
+}
+
+/* Record the message of the line parsed so far */
+static void
+trace_record(traceRing *t)
+{
+	traceEvent *e;
+	unsigned char message;
+
+	t->name[t->namelen] = '\0';
+	message = trace_message(t->from, t->name);
+	e = &t->events[t->next];
+	e->at = t->at;
+	e->size = t->len;
+	e->message = message;
+	e->from = t->from;
+	e->statement = message != 0 ?
+	    trace_statement(t, &trace_messages[message]) : 0;
+	t->next = (t->next + 1) % t->size;
+	if (t->count < t->size)
+		t->count++;
+}
+
+/*
+ * Parse trace lines of the form "F|B <tab> length <tab> name ...".
+ * Values in the traced messages may contain newlines, lines that do not
+ * start like a message are skipped.
+ */
+static void
+trace_parse(traceRing *t, const char *buf, size_t size)
+{
+	struct timespec now;
+	const char *p, *end;
+
+	for (p = buf, end = buf + size; p < end; p++) {
+		if (*p == '\n') {
+			if (t->field == TRACE_NAME || t->field == TRACE_REST)
+				trace_record(t);
+			t->field = TRACE_FROM;
+			continue;
+		}
+		switch (t->field) {
+		case TRACE_FROM:
+			if (*p != 'F' && *p != 'B') {
+				t->field = TRACE_SKIP;
+				break;
+			}
+			clock_gettime(CLOCK_REALTIME, &now);
+			t->at = (uint64_t)now.tv_sec * 1000000 +
+			    now.tv_nsec / 1000;
+			t->from = *p;
+			t->len = 0;
+			t->namelen = 0;
+			t->field = TRACE_TAB;
+			break;
+		case TRACE_TAB:
+			t->field = *p == '\t' ? TRACE_LENGTH : TRACE_SKIP;
+			break;
+		case TRACE_LENGTH:
+			if (*p >= '0' && *p <= '9')
+				t->len = t->len * 10 + (*p - '0');
+			else
+				t->field = *p == '\t' ? TRACE_NAME : TRACE_SKIP;
+			break;
+		case TRACE_NAME:
+			if (*p == '\t' || *p == ' ' || *p == ':')
+				t->field = TRACE_REST;
+			else if (t->namelen < (int)sizeof t->name - 1)
+				t->name[t->namelen++] = *p;
+			break;
+		}
+	}
+}
+
+#ifdef __linux__
+static ssize_t
+trace_write(void *cookie, const char *buf, size_t size)
+{
+	trace_parse(cookie, buf, size);
+	return size;
+}
+#else
+static int
+trace_write(void *cookie, const char *buf, int size)
+{
+	trace_parse(cookie, buf, size);
+	return size;
+}
+#endif
+
+/* Stop a ring that is no longer the trace of its connection */
+static void
+trace_detach(lua_State *L, int idx)
+{
+	traceRing *t;
+
+	lua_getuservalue(L, idx);
+	lua_getfield(L, -1, "trace_ring");
+	t = lua_touserdata(L, -1);
+	if (t != NULL) {
+		t->conn = NULL;
+		lua_pushnil(L);
+		lua_setfield(L, -3, "trace_ring");
+	}
+	lua_pop(L, 2);
+}
+
+/*
+ * conn:traceBuffer(size) records the last size protocol messages (4096 by
+ * default) in a ring buffer instead of tracing to a file,
+ * conn:traceBuffer(0) turns it off.
+ */
+static int
+conn_traceBuffer(lua_State *L)
+{
+	PGconn **conn;
+	traceRing *t;
+	lua_Integer size;
+#ifdef __linux__
+	cookie_io_functions_t io = { NULL, trace_write, NULL, NULL };
+#endif
+
+	pgsql_conn(L, 1);
+	conn = lua_touserdata(L, 1);
+	size = luaL_optinteger(L, 2, TRACE_BUFFER);
+	luaL_argcheck(L, size >= 0 &&
+	    size <= INT_MAX / (lua_Integer)sizeof(traceEvent), 2,
+	    "invalid buffer size");
+	trace_detach(L, 1);
+	PQuntrace(*conn);
+	lua_getuservalue(L, 1);
+	lua_pushnil(L);
+	lua_setfield(L, -2, "trace_file");
+	if (size == 0)
+		return 0;
+
+	t = lua_newuserdata(L, sizeof(traceRing) + size * sizeof(traceEvent));
+	memset(t, 0, sizeof(traceRing));
+	t->events = (traceEvent *)(t + 1);
+	t->size = size;
+#ifdef __linux__
+	t->f = fopencookie(t, "w", io);
+#else
+	t->f = funopen(t, NULL, trace_write, NULL, NULL);
+#endif
+	if (t->f == NULL)
+		return luaL_error(L, "cannot open trace stream: %s",
+		    strerror(errno));
+	setvbuf(t->f, NULL, _IOLBF, 0);
+	luaL_getmetatable(L, TRACE_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_setfield(L, -2, "trace_ring");
+	t->conn = conn;
+	PQtrace(*conn, t->f);
+	PQsetTraceFlags(*conn, PQTRACE_SUPPRESS_TIMESTAMPS);
+	return 0;
+}
+
+/*
+ * conn:traceDump() returns the recorded messages, the oldest first, as
+ * tables with the fields from ("F" or "B"), type, message (the name),
+ * size, time (in seconds since the epoch) and statement, a number that
+ * the messages of one statement and their replies share.
+ */
+static int
+conn_traceDump(lua_State *L)
+{
+	traceRing *t;
+	const traceEvent *e;
+	const traceMessage *m;
+	uint32_t n;
+
+	pgsql_conn(L, 1);
+	lua_getuservalue(L, 1);
+	lua_getfield(L, -1, "trace_ring");
+	t = lua_touserdata(L, -1);
+	lua_createtable(L, t != NULL ? t->count : 0, 0);
+	if (t == NULL)
+		return 1;
+	for (n = 0; n < t->count; n++) {
+		e = &t->events[(t->next + t->size - t->count + n) % t->size];
+		m = &trace_messages[e->message];
+		lua_createtable(L, 0, 6);
+		lua_pushlstring(L, &e->from, 1);
+		lua_setfield(L, -2, "from");
+		if (m->type != '\0') {
+			lua_pushlstring(L, &m->type, 1);
+			lua_setfield(L, -2, "type");
+		}
+		lua_pushstring(L, m->name);
+		lua_setfield(L, -2, "message");
+		lua_pushinteger(L, e->size);
+		lua_setfield(L, -2, "size");
+		lua_pushnumber(L, e->at / 1e6);
+		lua_setfield(L, -2, "time");
+		lua_pushinteger(L, e->statement);
+		lua_setfield(L, -2, "statement");
+		lua_rawseti(L, -2, n + 1);
+	}
+	return 1;
+}
+
+static int
+trace_clear(lua_State *L)
+{
+	traceRing *t;
+
+	t = luaL_checkudata(L, 1, TRACE_METATABLE);
+	/* the connection may be finalized later and trace its Terminate */
+	if (t->conn != NULL && *t->conn != NULL)
+		PQuntrace(*t->conn);
+	if (t->f != NULL)
+		fclose(t->f);
+	t->f = NULL;
+	return 0;
+}
+#endif
+
+static int
+closef_untrace(lua_State *L)
+{
+	PGconn *conn;
+	lua_CFunction cf;
+
+	luaL_checkudata(L, 1, LUA_FILEHANDLE);
+
+	/* untrace so libpq doesn't segfault */
+	lua_getuservalue(L, 1);
+	lua_getfield(L, -1, "PGconn");
+	conn = pgsql_conn(L, -1);
+	lua_getfield(L, -2, "old_uservalue");
+#if LUA_VERSION_NUM >= 502
+	lua_getfield(L, -3, "old_closef");
+#else
+	lua_getfield(L, -1, "__close");
+#endif
+	cf = lua_tocfunction(L, -1);
+	lua_pop(L, 1);
+	lua_setuservalue(L, 1);
+
+	/*
+	 * Untrace and let go of PGconn's reference to file handle, unless
+	 * the connection traces elsewhere by now.
+	 */
+	lua_getuservalue(L, -1);
+	lua_getfield(L, -1, "trace_file");
+	if (lua_rawequal(L, -1, 1)) {
+		PQuntrace(conn);
+		lua_pushnil(L);
+		lua_setfield(L, -3, "trace_file");
+	}
+
+	/* pop stream uservalue, PGconn, PGconn uservalue, trace file */
+	lua_pop(L, 4);
+
+	/* call original close function */
+	return (*cf)(L);
+}
+
+static int
+conn_trace(lua_State *L)
+{
+	PGconn *conn;
+#if LUA_VERSION_NUM >= 502
+	luaL_Stream *stream;
+
+	conn = pgsql_conn(L, 1);
+	stream = luaL_checkudata(L, 2, LUA_FILEHANDLE);
+	luaL_argcheck(L, stream->f != NULL, 2, "invalid file handle");
+
+	/*
+	 * Keep a reference to the file object in uservalue of connection
+	 * so it doesn't get garbage collected.
+	 */
+	lua_getuservalue(L, 1);
+	lua_pushvalue(L, 2);
+	lua_setfield(L, -2, "trace_file");
+
+	/*
+	 * Swap out closef luaL_Stream member for our wrapper that will
+	 * untrace.
+	 */
+	lua_createtable(L, 0, 3);
+	lua_getuservalue(L, 2);
+	lua_setfield(L, -2, "old_uservalue");
+	lua_pushcfunction(L, stream->closef);
+	lua_setfield(L, -2, "old_closef");
+	lua_pushvalue(L, 1);
+	lua_setfield(L, -2, "PGconn");
+	lua_setuservalue(L, 2);
+	stream->closef = closef_untrace;
+
+#ifdef LIBPQ_HAS_TRACE_FLAGS
+	trace_detach(L, 1);
+#endif
+	PQtrace(conn, stream->f);
+#else
+	FILE **fp;
+
+	conn = pgsql_conn(L, 1);
+	fp = luaL_checkudata(L, 2, LUA_FILEHANDLE);
+	luaL_argcheck(L, *fp != NULL, 2, "invalid file handle");
+
+	/*
+	 * Keep a reference to the file object in uservalue of connection
+	 * so it doesn't get garbage collected.
+	 */
+	lua_getuservalue(L, 1);
+	lua_pushvalue(L, 2);
+	lua_setfield(L, -2, "trace_file");
+
+	/*
+	 * Swap __close field in file environment for our wrapper that will
+	 * untrace keep the old closef under the key of the PGconn.
+	 */
+	lua_createtable(L, 0, 3);
+	lua_pushcfunction(L, closef_untrace);
+	lua_setfield(L, -2, "__close");
+	lua_getuservalue(L, 2);
+	lua_setfield(L, -2, "old_uservalue");
+	lua_pushvalue(L, 1);
+	lua_setfield(L, -2, "PGconn");
+	lua_setuservalue(L, 2);
+
+#ifdef LIBPQ_HAS_TRACE_FLAGS
+	trace_detach(L, 1);
+#endif
+	PQtrace(conn, *fp);
+#endif
+	return 0;
+}
+
+static int
+conn_untrace(lua_State *L)
+{
+	PQuntrace(pgsql_conn(L, 1));
+
+	/* Let go of PGconn's reference to file handle. */
+	lua_getuservalue(L, 1);
+	lua_pushnil(L);
+	lua_setfield(L, -2, "trace_file");
+#ifdef LIBPQ_HAS_TRACE_FLAGS
+	trace_detach(L, 1);
+#endif
+
+	return 0;
+}
+
+/*
+ * Miscellaneous Functions
+ */
+static int
+conn_consumeInput(lua_State *L)
+{
+	lua_pushboolean(L, PQconsumeInput(pgsql_conn(L, 1)));
+	return 1;
+}
+
+static int
+conn_isBusy(lua_State *L)
+{
+	lua_pushboolean(L, PQisBusy(pgsql_conn(L, 1)));
+	return 1;
+}
+
+static int
+conn_setnonblocking(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQsetnonblocking(pgsql_conn(L, 1), lua_toboolean(L, 2)));
+	return 1;
+}
+
+static int
+conn_isnonblocking(lua_State *L)
+{
+	lua_pushboolean(L, PQisnonblocking(pgsql_conn(L, 1)));
+	return 1;
+}
+
+static int
+conn_flush(lua_State *L)
+{
+	lua_pushinteger(L, PQflush(pgsql_conn(L, 1)));
+	return 1;
+}
+
+#ifdef LUAPGSQL_BENCH
+static int
+conn_makeEmptyPGresult(lua_State *L)
+{
+	PGresult **res;
+
+	res = pgsql_res_new(L, 1);
+	*res = PQmakeEmptyPGresult(pgsql_conn(L, 1), luaL_optinteger(L, 2,
+	    PGRES_EMPTY_QUERY));
+	pgsql_res_account(L, *res);
+	return 1;
+}
+#endif
+
+/* Notice processing */
+static void
+noticeReceiver(void *arg, const PGresult *r)
+{
+	lua_State *L = (lua_State *)arg;
+	PGresult **res;
+
+	lua_pushstring(L, "__pgsqlNoticeReceiver");
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	res = lua_newuserdata(L, sizeof(PGresult *));
+	*res = (PGresult *)r;
+	luaL_getmetatable(L, RES_METATABLE);
+	lua_setmetatable(L, -2);
+
+	if (lua_pcall(L, 1, 0, 0))
+		luaL_error(L, "%s", lua_tostring(L, -1));
+	*res = NULL;	/* avoid double free */
+}
+
+static void
+noticeProcessor(void *arg, const char *message)
+{
+	lua_State *L = (lua_State *)arg;
+
+	lua_pushstring(L, "__pgsqlNoticeProcessor");
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	lua_pushstring(L, message);
+	if (lua_pcall(L, 1, 0, 0))
+		luaL_error(L, "%s", lua_tostring(L, -1));
+}
+
+static int
+conn_setNoticeReceiver(lua_State *L)
+{
+	lua_pushstring(L, "__pgsqlNoticeReceiver");
+	lua_pushvalue(L, -2);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+	PQsetNoticeReceiver(pgsql_conn(L, 1), noticeReceiver, L);
+	return 0;
+}
+
+static int
+conn_setNoticeProcessor(lua_State *L)
+{
+	lua_pushstring(L, "__pgsqlNoticeProcessor");
+	lua_pushvalue(L, -2);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+	PQsetNoticeProcessor(pgsql_conn(L, 1), noticeProcessor, L);
+	return 0;
+}
+
+/* Large objects */
+static int
+conn_lo_create(lua_State *L)
+{
+	Oid oid;
+
+	if (lua_gettop(L) == 2)
+		oid = luaL_checkinteger(L, 2);
+	else
+		oid = 0;
+	tx_flush(L, 1);
+	lua_pushinteger(L, lo_create(pgsql_conn_query(L, 1), oid));
+	return 1;
+}
+
+static int
+conn_lo_import(lua_State *L)
+{
+	tx_flush(L, 1);
+	lua_pushinteger(L, lo_import(pgsql_conn_query(L, 1), luaL_checkstring(L, 2)));
+	return 1;
+}
+
+static int
+conn_lo_import_with_oid(lua_State *L)
+{
+	tx_flush(L, 1);
+	lua_pushinteger(L,
+	    lo_import_with_oid(pgsql_conn_query(L, 1), luaL_checkstring(L, 2),
+	    luaL_checkinteger(L, 3)));
+	return 1;
+}
+
+static int
+conn_lo_export(lua_State *L)
+{
+	tx_flush(L, 1);
+	lua_pushinteger(L,
+	    lo_export(pgsql_conn_query(L, 1), luaL_checkinteger(L, 2),
+	    luaL_checkstring(L, 3)));
+	return 1;
+}
+
+static int
+conn_lo_open(lua_State *L)
+{
+	PGconn *conn;
+	largeObject **o;
+	Oid oid;
+	int mode, fd;
+
+	conn = pgsql_conn_query(L, 1);
+	oid = luaL_checkinteger(L, 2);
+	mode = luaL_checkinteger(L, 3);
+	tx_flush(L, 1);
+	o = lua_newuserdata(L, sizeof(largeObject *));
+	*o = NULL;
+	luaL_getmetatable(L, LO_METATABLE);
+	lua_setmetatable(L, -2);
+	fd = lo_open(conn, oid, mode);
+	if (fd < 0) {
+		lua_pushnil(L);
+		lua_pushstring(L, PQerrorMessage(conn));
+		return 2;
+	}
+	*o = malloc(sizeof(largeObject));
+	if (*o == NULL) {
+		lo_close(conn, fd);
+		return luaL_error(L, "out of memory");
+	}
+	(*o)->conn = conn;
+	(*o)->fd = fd;
+	return 1;
+}
+
+/*
+ * Result set functions
+ */
+static int
+res_status(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQresultStatus(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
+	return 1;
+}
+
+static int
+res_resStatus(lua_State *L)
+{
+	lua_pushstring(L, PQresStatus(luaL_checkinteger(L, 2)));
+	return 1;
+}
+
+static int
+res_errorMessage(lua_State *L)
+{
+	lua_pushstring(L,
+	    PQresultErrorMessage(*(PGresult **)luaL_checkudata(L, 1,
+	    RES_METATABLE)));
+	return 1;
+}
+
+static int
+res_errorField(lua_State *L)
+{
+	char *field;
+
+	field = PQresultErrorField(
+	    *(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    lua_tointeger(L, 2));
+	if (field == NULL)
+		lua_pushnil(L);
+	else
+		lua_pushstring(L, field);
+	return 1;
+}
+
+static int
+res_nfields(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQnfields(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
+	return 1;
+}
+
+static int
+res_ntuples(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQntuples(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
+	return 1;
+}
+
+static int
+res_fname(lua_State *L)
+{
+	lua_pushstring(L,
+	    PQfname(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    luaL_checkinteger(L, 2) - 1));
+	return 1;
+}
+
+static int
+res_fnumber(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQfnumber(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    luaL_checkstring(L, 2)) + 1);
+	return 1;
+}
+
+static int
+res_ftable(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQftable(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    luaL_checkinteger(L, 2) - 1));
+	return 1;
+}
+
+static int
+res_ftablecol(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQftablecol(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    luaL_checkinteger(L, 2) - 1));
+	return 1;
+}
+
+static int
+res_fformat(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQfformat(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    luaL_checkinteger(L, 2) - 1));
+	return 1;
+}
+
+static int
+res_ftype(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQftype(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    luaL_checkinteger(L, 2) - 1));
+	return 1;
+}
+
+static int
+res_fmod(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQfmod(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    luaL_checkinteger(L, 2) - 1));
+	return 1;
+}
+
+static int
+res_fsize(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQfsize(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    luaL_checkinteger(L, 2) - 1));
+	return 1;
+}
+
+static int
+res_binaryTuples(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQbinaryTuples(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
+	return 1;
+}
+
+static int
+res_getvalue(lua_State *L)
+{
+	lua_pushstring(L,
+	    PQgetvalue(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    luaL_checkinteger(L, 2) - 1, luaL_checkinteger(L, 3) - 1));
+	return 1;
+}
+
+static int
+res_getisnull(lua_State *L)
+{
+	lua_pushboolean(L,
+	    PQgetisnull(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    luaL_checkinteger(L, 2) - 1, luaL_checkinteger(L, 3) - 1));
+	return 1;
+}
+
+static int
+res_getlength(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQgetlength(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    luaL_checkinteger(L, 2) - 1, luaL_checkinteger(L, 3) - 1));
+	return 1;
+}
+
+static int
+res_nparams(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQnparams(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
+	return 1;
+}
+
+static int
+res_paramtype(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQparamtype(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    luaL_checkinteger(L, 2)) - 1);
+	return 1;
+}
+
+static int
+res_cmdStatus(lua_State *L)
+{
+	lua_pushstring(L,
+	    PQcmdStatus(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
+	return 1;
+}
+
+static int
+res_cmdTuples(lua_State *L)
+{
+	lua_pushstring(L,
+	    PQcmdTuples(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
+	return 1;
+}
+
+static int
+res_oidValue(lua_State *L)
+{
+	lua_pushinteger(L,
+	    PQoidValue(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
+	return 1;
+}
+
+static int
+res_oidStatus(lua_State *L)
+{
+	lua_pushstring(L,
+	    PQoidStatus(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
+	return 1;
+}
+
+#ifdef LUAPGSQL_BENCH
+/*
+ * Result construction, only in the build for the microbenchmarks
+ * (-DLUAPGSQL_BENCH): results are otherwise immutable, and slices,
+ * packed results, row maps and the binary decoders rely on that.
+ */
+static int
+res_copyResult(lua_State *L)
+{
+	PGresult **res;
+	PGresult *src;
+
+	src = *(PGresult **)luaL_checkudata(L, 1, RES_METATABLE);
+	res = pgsql_res_new(L, 0);
+	if (pgsql_types(L, 1))
+		lua_setuservalue(L, -2);
+	else
+		lua_pop(L, 1);
+	*res = PQcopyResult(src, luaL_optinteger(L, 2,
+	    PG_COPYRES_ATTRS | PG_COPYRES_TUPLES));
+	pgsql_res_account(L, *res);
+	return 1;
+}
+
+static int
+attr_integer(lua_State *L, const char *field, int dflt)
+{
+	int v;
+
+	lua_getfield(L, -1, field);
+	v = lua_isnil(L, -1) ? dflt : lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	return v;
+}
+
+static int
+res_setResultAttrs(lua_State *L)
+{
+	PGresAttDesc *attDescs;
+	PGresult *res;
+	int n, numAttributes, rv;
+
+	res = *(PGresult **)luaL_checkudata(L, 1, RES_METATABLE);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	numAttributes = lua_rawlen(L, 2);
+	attDescs = calloc(numAttributes ? numAttributes : 1,
+	    sizeof(PGresAttDesc));
+	if (attDescs == NULL)
+		return luaL_error(L, "out of memory");
+
+	/*
+	 * The name strings are referenced by the table argument and stay
+	 * valid until PQsetResultAttrs has copied them.
+	 */
+	for (n = 0; n < numAttributes; n++) {
+		lua_rawgeti(L, 2, n + 1);
+		if (!lua_istable(L, -1)) {
+			free(attDescs);
+			return luaL_argerror(L, 2,
+			    "attribute descriptions must be tables");
+		}
+		lua_getfield(L, -1, "name");
+		if (lua_type(L, -1) != LUA_TSTRING) {
+			free(attDescs);
+			return luaL_argerror(L, 2, "attribute name missing");
+		}
+		attDescs[n].name = (char *)lua_tostring(L, -1);
+		lua_pop(L, 1);
+		attDescs[n].tableid = attr_integer(L, "tableid", 0);
+		attDescs[n].columnid = attr_integer(L, "columnid", 0);
+		attDescs[n].format = attr_integer(L, "format", 0);
+		attDescs[n].typid = attr_integer(L, "typid", TEXTOID);
+		attDescs[n].typlen = attr_integer(L, "typlen", -1);
+		attDescs[n].atttypmod = attr_integer(L, "atttypmod", -1);
+		lua_pop(L, 1);
+	}
+	rv = PQsetResultAttrs(res, numAttributes, attDescs);
+	free(attDescs);
+	lua_pushboolean(L, rv);
+	return 1;
+}
+
+static int
+res_setvalue(lua_State *L)
+{
+	const char *value;
+	size_t len;
+
+	value = lua_tolstring(L, 4, &len);
+	lua_pushboolean(L,
+	    PQsetvalue(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
+	    luaL_checkinteger(L, 2) - 1, luaL_checkinteger(L, 3) - 1,
+	    (char *)value, value == NULL ? -1 : (int)len));
+	return 1;
+}
+#endif
+
+static int
+res_memorySize(lua_State *L)
+{
+	PGresult *r;
+
+	r = *(PGresult **)luaL_checkudata(L, 1, RES_METATABLE);
+	lua_pushinteger(L, r != NULL ? pgsql_res_size(r) : 0);
+	return 1;
+}
+
+/*
+ * Row access
+ */
+
+/* Key under which a field map refers to its result */
+static char fieldmap_result;
+
+/*
+ * Decoders convert a field value in text or binary format to the
+ * matching Lua value.
+ */
+static void
+decode_string(lua_State *L, const char *v, int len)
+{
+	lua_pushlstring(L, v, len);
+}
+
+static void
+decode_text_bool(lua_State *L, const char *v, int len)
+{
+	lua_pushboolean(L, *v == 't');
+}
+
+static void
+decode_text_int(lua_State *L, const char *v, int len)
+{
+	pgsql_pushint64(L, strtoll(v, NULL, 10));
+}
+
+static void
+decode_text_float(lua_State *L, const char *v, int len)
+{
+	lua_pushnumber(L, strtod(v, NULL));
+}
+
+static void
+decode_text_bytea(lua_State *L, const char *v, int len)
+{
+	unsigned char *bytea;
+	size_t blen;
+
+	bytea = PQunescapeBytea((const unsigned char *)v, &blen);
+	if (bytea == NULL)
+		luaL_error(L, "out of memory");
+	lua_pushlstring(L, (const char *)bytea, blen);
+	PQfreemem(bytea);
+}
+
+static void
+decode_bool(lua_State *L, const char *v, int len)
+{
+	lua_pushboolean(L, *v != 0);
+}
+
+static void
+decode_int2(lua_State *L, const char *v, int len)
+{
+	uint16_t i;
+
+	memcpy(&i, v, sizeof i);
+	lua_pushinteger(L, (int16_t)ntohs(i));
+}
+
+static void
+decode_int4(lua_State *L, const char *v, int len)
+{
+	uint32_t i;
+
+	memcpy(&i, v, sizeof i);
+	lua_pushinteger(L, (int32_t)ntohl(i));
+}
+
+static void
+decode_oid(lua_State *L, const char *v, int len)
+{
+	uint32_t i;
+
+	memcpy(&i, v, sizeof i);
+	pgsql_pushint64(L, ntohl(i));
+}
+
+static void
+decode_int8(lua_State *L, const char *v, int len)
+{
+	uint64_t i;
+
+	memcpy(&i, v, sizeof i);
+	pgsql_pushint64(L, (int64_t)be64toh(i));
+}
+
+static void
+decode_float4(lua_State *L, const char *v, int len)
+{
+	union {
+		uint32_t i;
+		float f;
+	} u;
+
+	memcpy(&u.i, v, sizeof u.i);
+	u.i = ntohl(u.i);
+	lua_pushnumber(L, u.f);
+}
+
+static void
+decode_float8(lua_State *L, const char *v, int len)
+{
+	union {
+		uint64_t i;
+		double f;
+	} u;
+
+	memcpy(&u.i, v, sizeof u.i);
+	u.i = be64toh(u.i);
+	lua_pushnumber(L, u.f);
+}
+
+/*
+ * Dates and timestamps decode to microseconds since the Unix epoch,
+ * dates at midnight UTC, and times of day to microseconds since
+ * midnight.  infinity and -infinity become math.huge and -math.huge.
+ */
+static void
+decode_date(lua_State *L, const char *v, int len)
+{
+	uint32_t i;
+	int32_t days;
+
+	memcpy(&i, v, sizeof i);
+	days = (int32_t)ntohl(i);
+	if (days == INT32_MAX || days == INT32_MIN)
+		lua_pushnumber(L, days == INT32_MAX ? HUGE_VAL : -HUGE_VAL);
+	else if (days > INT64_MAX / USECS_PER_DAY - 10958 ||
+	    days < INT64_MIN / USECS_PER_DAY)
+		/* far beyond what the microseconds can count */
+		lua_pushnumber(L, (lua_Number)days * USECS_PER_DAY +
+		    PG_EPOCH_USECS);
+	else
+		pgsql_pushint64(L, days * USECS_PER_DAY + PG_EPOCH_USECS);
+}
+
+static void
+decode_timestamp(lua_State *L, const char *v, int len)
+{
+	uint64_t i;
+	int64_t t;
+
+	memcpy(&i, v, sizeof i);
+	t = (int64_t)be64toh(i);
+	if (t == INT64_MAX || t == INT64_MIN)
+		lua_pushnumber(L, t == INT64_MAX ? HUGE_VAL : -HUGE_VAL);
+	else if (t > INT64_MAX - PG_EPOCH_USECS)
+		lua_pushnumber(L, (lua_Number)t + PG_EPOCH_USECS);
+	else
+		pgsql_pushint64(L, t + PG_EPOCH_USECS);
+}
+
+/* The components of an interval can not be combined, keep them apart */
+static void
+decode_interval(lua_State *L, const char *v, int len)
+{
+	uint64_t usecs;
+	uint32_t days, months;
+
+	memcpy(&usecs, v, sizeof usecs);
+	memcpy(&days, v + 8, sizeof days);
+	memcpy(&months, v + 12, sizeof months);
+	lua_createtable(L, 0, 3);
+	pgsql_pushint64(L, (int64_t)be64toh(usecs));
+	lua_setfield(L, -2, "microseconds");
+	lua_pushinteger(L, (int32_t)ntohl(days));
+	lua_setfield(L, -2, "days");
+	lua_pushinteger(L, (int32_t)ntohl(months));
+	lua_setfield(L, -2, "months");
+}
+
+/*
+ * Return the decoder for a type in the given format.  For types that
+ * have no binary decoder NULL is returned if format is 1, all types
+ * can be decoded from text.
+ */
+static pgsql_decoder
+pgsql_decoder_for(Oid type, int format)
+{
+	switch (type) {
+	case BOOLOID:
+		return format ? decode_bool : decode_text_bool;
+	case INT2OID:
+		return format ? decode_int2 : decode_text_int;
+	case INT4OID:
+		return format ? decode_int4 : decode_text_int;
+	case INT8OID:
+		return format ? decode_int8 : decode_text_int;
+	case OIDOID:
+		return format ? decode_oid : decode_text_int;
+	case FLOAT4OID:
+		return format ? decode_float4 : decode_text_float;
+	case FLOAT8OID:
+		return format ? decode_float8 : decode_text_float;
+	case BYTEAOID:
+		return format ? decode_string : decode_text_bytea;
+	case NUMERICOID:
+		return format ? decode_numeric : decode_string;
+	case DATEOID:
+		return format ? decode_date : decode_string;
+	case TIMEOID:
+		return format ? decode_int8 : decode_string;
+	case TIMESTAMPOID:
+	case TIMESTAMPTZOID:
+		return format ? decode_timestamp : decode_string;
+	case INTERVALOID:
+		return format ? decode_interval : decode_string;
+	case TEXTOID:
+	case VARCHAROID:
+	case BPCHAROID:
+	case NAMEOID:
+		return decode_string;
+	}
+	return format ? NULL : decode_string;
+}
+
+/*
+ * Push the value of a field converted to the matching Lua type.  NULL
+ * becomes nil, booleans, integers and floating point numbers become
+ * their Lua counterparts in both text and binary format, bytea is
+ * unescaped, types with a codec or of composite or array type are
+ * decoded by these and everything else is returned as a string.
+ */
+static void
+pgsql_push_value(lua_State *L, int types, const PGresult *r, int row,
+    int col)
+{
+	if (PQgetisnull(r, row, col)) {
+		lua_pushnil(L);
+		return;
+	}
+	pgsql_decode_typed(L, types, PQftype(r, col), PQfformat(r, col),
+	    PQgetvalue(r, row, col), PQgetlength(r, row, col));
+}
+
+/*
+ * Push the field map of the result at index idx, a table mapping field
+ * names to column numbers.  It is built on first use and kept as the
+ * uservalue of the result, in place of the type table it refers to;
+ * row proxies keep it (and through it the result) alive.
+ */
+static void
+res_fieldmap(lua_State *L, int idx)
+{
+	PGresult *r;
+	int n, nfields;
+
+	lua_getuservalue(L, idx);
+	if (lua_istable(L, -1)) {
+		lua_pushlightuserdata(L, &fieldmap_result);
+		lua_rawget(L, -2);
+		if (!lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			return;
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+
+	r = *(PGresult **)lua_touserdata(L, idx);
+	nfields = PQnfields(r);
+	lua_createtable(L, 0, nfields + 1);
+	/* the first of duplicate names wins, as with PQfnumber() */
+	for (n = nfields - 1; n >= 0; n--) {
+		lua_pushinteger(L, n + 1);
+		lua_setfield(L, -2, PQfname(r, n));
+	}
+	lua_pushlightuserdata(L, &fieldmap_result);
+	lua_pushvalue(L, idx);
+	lua_rawset(L, -3);
+	lua_pushlightuserdata(L, &result_types);
+	pgsql_types(L, idx);
+	lua_rawset(L, -3);
+	lua_pushvalue(L, -1);
+	lua_setuservalue(L, idx);
+}
+
+static void
+res_pushrow(lua_State *L, int idx, PGresult **res, int row)
+{
+	resRow *proxy;
+
+	proxy = lua_newuserdata(L, sizeof(resRow));
+	proxy->res = res;
+	proxy->row = row;
+	luaL_getmetatable(L, ROW_METATABLE);
+	lua_setmetatable(L, -2);
+	res_fieldmap(L, idx);
+	lua_setuservalue(L, -2);
+}
+
+static int
+res_row(lua_State *L)
+{
+	PGresult **res;
+	int row;
+
+	res = luaL_checkudata(L, 1, RES_METATABLE);
+	luaL_argcheck(L, *res != NULL, 1, "result has been cleared");
+	row = luaL_checkinteger(L, 2) - 1;
+	if (row < 0 || row >= PQntuples(*res))
+		lua_pushnil(L);
+	else
+		res_pushrow(L, 1, res, row);
+	return 1;
+}
+
+static int
+res_rows_iterate(lua_State *L)
+{
+	PGresult **res;
+	int row;
+
+	res = luaL_checkudata(L, 1, RES_METATABLE);
+	row = lua_tointeger(L, 2);
+	if (*res == NULL || row >= PQntuples(*res))
+		return 0;
+	lua_pushinteger(L, row + 1);
+	res_pushrow(L, 1, res, row);
+	return 2;
+}
+
+static int
+res_rows(lua_State *L)
+{
+	luaL_checkudata(L, 1, RES_METATABLE);
+	lua_pushcfunction(L, res_rows_iterate);
+	lua_pushvalue(L, 1);
+	lua_pushinteger(L, 0);
+	return 3;
+}
+
+/*
+ * Value slices
+ *
+ * res:slice() refers to a field value in the memory of the PGresult
+ * instead of copying it into a Lua string, so that large values can be
+ * measured, cut and written to files directly from libpq's buffer.  The
+ * slice keeps its result alive, but not from an explicit res:clear().
+ */
+
+static int
+res_slice(lua_State *L)
+{
+	PGresult **res;
+	valueSlice *s;
+	int row, col;
+
+	res = luaL_checkudata(L, 1, RES_METATABLE);
+	luaL_argcheck(L, *res != NULL, 1, "result has been cleared");
+	row = luaL_checkinteger(L, 2) - 1;
+	col = luaL_checkinteger(L, 3) - 1;
+	if (row < 0 || row >= PQntuples(*res) || col < 0 ||
+	    col >= PQnfields(*res) || PQgetisnull(*res, row, col)) {
+		lua_pushnil(L);
+		return 1;
+	}
+	s = lua_newuserdata(L, sizeof(valueSlice));
+	s->res = res;
+	s->data = PQgetvalue(*res, row, col);
+	s->len = PQgetlength(*res, row, col);
+	luaL_getmetatable(L, SLICE_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_newtable(L);
+	lua_pushvalue(L, 1);
+	lua_setfield(L, -2, "result");
+	lua_setuservalue(L, -2);
+	return 1;
+}
+
+static valueSlice *
+slice_check(lua_State *L, int idx)
+{
+	valueSlice *s;
+
+	s = luaL_checkudata(L, idx, SLICE_METATABLE);
+	luaL_argcheck(L, *s->res != NULL, idx, "result has been cleared");
+	return s;
+}
+
+static int
+slice_len(lua_State *L)
+{
+	lua_pushinteger(L, slice_check(L, 1)->len);
+	return 1;
+}
+
+/* Positions as in string.sub() */
+static size_t
+slice_position(lua_Integer pos, size_t len)
+{
+	if (pos >= 0)
+		return (size_t)pos;
+	if ((size_t)-pos > len)
+		return 0;
+	return len + (size_t)pos + 1;
+}
+
+static int
+slice_sub(lua_State *L)
+{
+	valueSlice *s;
+	size_t first, last;
+
+	s = slice_check(L, 1);
+	first = slice_position(luaL_optinteger(L, 2, 1), s->len);
+	last = slice_position(luaL_optinteger(L, 3, -1), s->len);
+	if (first < 1)
+		first = 1;
+	if (last > s->len)
+		last = s->len;
+	if (first > last)
+		lua_pushliteral(L, "");
+	else
+		lua_pushlstring(L, s->data + first - 1, last - first + 1);
+	return 1;
+}
+
+static int
+slice_tostring(lua_State *L)
+{
+	valueSlice *s;
+
+	s = slice_check(L, 1);
+	lua_pushlstring(L, s->data, s->len);
+	return 1;
+}
+
+/* Return the FILE of the Lua file handle at idx */
+static FILE *
+pgsql_checkfile(lua_State *L, int idx)
+{
+#if LUA_VERSION_NUM >= 502
+	luaL_Stream *stream;
+
+	stream = luaL_checkudata(L, idx, LUA_FILEHANDLE);
+	luaL_argcheck(L, stream->closef != NULL, idx, "file is closed");
+	return stream->f;
+#else
+	FILE **f;
+
+	f = luaL_checkudata(L, idx, LUA_FILEHANDLE);
+	luaL_argcheck(L, *f != NULL, idx, "file is closed");
+	return *f;
+#endif
+}
+
+static int
+slice_write(lua_State *L)
+{
+	valueSlice *s;
+	FILE *f;
+
+	s = slice_check(L, 1);
+	f = pgsql_checkfile(L, 2);
+	if (fwrite(s->data, 1, s->len, f) != s->len) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * Packed results
+ *
+ * res:pack() decodes booleans, integers and floating point numbers of a
+ * result into one C array per column, using several threads for large
+ * results; the PGresult is never modified, so the threads only share
+ * read access to it.  Other columns are left in the PGresult and are
+ * converted on access, which is why a packed result keeps its result
+ * alive.
+ */
+
+/* Rows below which an additional thread does not pay off */
+#define PACK_MIN_ROWS	16384
+
+typedef struct packJob {
+	const PGresult	*r;
+	packedResult	*p;
+	int		 first;		/* rows first to last - 1 */
+	int		 last;
+} packJob;
+
+static int
+packed_kind(Oid type)
+{
+	switch (type) {
+	case BOOLOID:
+		return PACKED_BOOL;
+	case INT2OID:
+	case INT4OID:
+	case INT8OID:
+	case OIDOID:
+		return PACKED_INT;
+	case FLOAT4OID:
+	case FLOAT8OID:
+		return PACKED_FLOAT;
+	}
+	return PACKED_STRING;
+}
+
+static int64_t
+pack_binary_int(const char *v, int len, Oid type)
+{
+	uint16_t i2;
+	uint32_t i4;
+	uint64_t i8;
+
+	switch (len) {
+	case 2:
+		memcpy(&i2, v, sizeof i2);
+		return (int16_t)ntohs(i2);
+	case 4:
+		memcpy(&i4, v, sizeof i4);
+		return type == OIDOID ? (int64_t)ntohl(i4) :
+		    (int64_t)(int32_t)ntohl(i4);
+	}
+	memcpy(&i8, v, sizeof i8);
+	return (int64_t)be64toh(i8);
+}
+
+static double
+pack_binary_float(const char *v, int len)
+{
+	union {
+		uint32_t i;
+		float f;
+	} u4;
+	union {
+		uint64_t i;
+		double f;
+	} u8;
+
+	if (len == 4) {
+		memcpy(&u4.i, v, sizeof u4.i);
+		u4.i = ntohl(u4.i);
+		return u4.f;
+	}
+	memcpy(&u8.i, v, sizeof u8.i);
+	u8.i = be64toh(u8.i);
+	return u8.f;
+}
+
+static void *
+pack_rows(void *arg)
+{
+	packJob *job = arg;
+	packedColumn *c;
+	const char *v;
+	int row, col, format, len;
+	Oid type;
+
+	for (col = 0; col < job->p->nfields; col++) {
+		c = &job->p->columns[col];
+		if (c->kind == PACKED_STRING)
+			continue;
+		format = PQfformat(job->r, col);
+		type = PQftype(job->r, col);
+		for (row = job->first; row < job->last; row++) {
+			c->isnull[row] = PQgetisnull(job->r, row, col);
+			if (c->isnull[row])
+				continue;
+			v = PQgetvalue(job->r, row, col);
+			len = PQgetlength(job->r, row, col);
+			switch (c->kind) {
+			case PACKED_BOOL:
+				c->v.b[row] = format ? *v != 0 : *v == 't';
+				break;
+			case PACKED_INT:
+				c->v.i[row] = format ?
+				    pack_binary_int(v, len, type) :
+				    strtoll(v, NULL, 10);
+				break;
+			case PACKED_FLOAT:
+				c->v.d[row] = format ?
+				    pack_binary_float(v, len) :
+				    strtod(v, NULL);
+				break;
+			}
+		}
+	}
+	return NULL;
+}
+
+static void
+packed_free(packedResult *p)
+{
+	int n;
+
+	if (p->columns == NULL)
+		return;
+	for (n = 0; n < p->nfields; n++) {
+		free(p->columns[n].isnull);
+		free(p->columns[n].v.b);
+	}
+	free(p->columns);
+	p->columns = NULL;
+}
+
+/* Number of threads to use for a result with ntuples rows */
+static int
+pack_threads(lua_State *L, int opts, int ntuples)
+{
+	lua_Integer threads;
+	long ncpu;
+
+	threads = 0;
+	if (lua_istable(L, opts)) {
+		lua_getfield(L, opts, "threads");
+		threads = luaL_optinteger(L, -1, 0);
+		lua_pop(L, 1);
+	}
+	if (threads <= 0) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = ncpu > 0 ? ncpu : 1;
+	}
+	if (threads > ntuples / PACK_MIN_ROWS)
+		threads = ntuples / PACK_MIN_ROWS;
+	if (threads > POOL_MAX_THREADS)
+		threads = POOL_MAX_THREADS;
+	return threads < 1 ? 1 : threads;
+}
+
+static int
+res_pack(lua_State *L)
+{
+	PGresult **res;
+	packedResult *p;
+	packedColumn *c;
+	packJob job[POOL_MAX_THREADS];
+	pthread_t thread[POOL_MAX_THREADS];
+	size_t size, total;
+	int n, nthreads, started;
+
+	res = luaL_checkudata(L, 1, RES_METATABLE);
+	luaL_argcheck(L, *res != NULL, 1, "result has been cleared");
+
+	p = lua_newuserdata(L, sizeof(packedResult));
+	p->res = res;
+	p->ntuples = PQntuples(*res);
+	p->nfields = PQnfields(*res);
+	p->columns = NULL;
+	luaL_getmetatable(L, PACKED_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_newtable(L);
+	lua_pushvalue(L, 1);
+	lua_setfield(L, -2, "result");
+	lua_pushlightuserdata(L, &result_types);
+	pgsql_types(L, 1);
+	lua_rawset(L, -3);
+	lua_setuservalue(L, -2);
+
+	p->columns = calloc(p->nfields > 0 ? p->nfields : 1,
+	    sizeof(packedColumn));
+	if (p->columns == NULL)
+		return luaL_error(L, "out of memory");
+	total = 0;
+	for (n = 0; n < p->nfields; n++) {
+		c = &p->columns[n];
+		c->kind = packed_kind(PQftype(*res, n));
+		switch (c->kind) {
+		case PACKED_STRING:
+			continue;
+		case PACKED_BOOL:
+			size = sizeof(unsigned char);
+			break;
+		case PACKED_INT:
+			size = sizeof(int64_t);
+			break;
+		default:
+			size = sizeof(double);
+		}
+		c->isnull = malloc(p->ntuples > 0 ? p->ntuples : 1);
+		c->v.b = malloc(p->ntuples > 0 ? p->ntuples * size : 1);
+		if (c->isnull == NULL || c->v.b == NULL) {
+			packed_free(p);
+			return luaL_error(L, "out of memory");
+		}
+		total += p->ntuples * (size + 1);
+	}
+
+	nthreads = pack_threads(L, 2, p->ntuples);
+	for (n = 0; n < nthreads; n++) {
+		job[n].r = *res;
+		job[n].p = p;
+		job[n].first = (int)((int64_t)p->ntuples * n / nthreads);
+		job[n].last = (int)((int64_t)p->ntuples * (n + 1) / nthreads);
+	}
+	/* the calling thread takes the first range itself */
+	for (started = 1; started < nthreads; started++)
+		if (pthread_create(&thread[started], NULL, pack_rows,
+		    &job[started]))
+			break;
+	pack_rows(&job[0]);
+	for (n = started; n < nthreads; n++)
+		pack_rows(&job[n]);
+	for (n = 1; n < started; n++)
+		pthread_join(thread[n], NULL);
+
+	if ((total >> 10) > 0)
+		lua_gc(L, LUA_GCSTEP, (total >> 10) > INT_MAX ? INT_MAX :
+		    (int)(total >> 10));
+	return 1;
+}
+
+static packedResult *
+packed_check(lua_State *L, int idx)
+{
+	packedResult *p;
+
+	p = luaL_checkudata(L, idx, PACKED_METATABLE);
+	luaL_argcheck(L, p->columns != NULL, idx,
+	    "packed result has been cleared");
+	return p;
+}
+
+/* Column argument, a number or a field name */
+static int
+packed_column(lua_State *L, packedResult *p, int idx)
+{
+	int col;
+
+	if (lua_type(L, idx) == LUA_TSTRING) {
+		luaL_argcheck(L, *p->res != NULL, 1,
+		    "result has been cleared");
+		col = PQfnumber(*p->res, lua_tostring(L, idx));
+	} else
+		col = luaL_checkinteger(L, idx) - 1;
+	luaL_argcheck(L, col >= 0 && col < p->nfields, idx,
+	    "no such column");
+	return col;
+}
+
+static int
+packed_get(lua_State *L)
+{
+	packedResult *p;
+	packedColumn *c;
+	int row, col;
+
+	p = packed_check(L, 1);
+	row = luaL_checkinteger(L, 2) - 1;
+	col = packed_column(L, p, 3);
+	if (row < 0 || row >= p->ntuples) {
+		lua_pushnil(L);
+		return 1;
+	}
+	c = &p->columns[col];
+	if (c->kind == PACKED_STRING) {
+		luaL_argcheck(L, *p->res != NULL, 1,
+		    "result has been cleared");
+		pgsql_push_value(L, pgsql_types(L, 1), *p->res, row, col);
+	} else if (c->isnull[row])
+		lua_pushnil(L);
+	else if (c->kind == PACKED_BOOL)
+		lua_pushboolean(L, c->v.b[row]);
+	else if (c->kind == PACKED_INT)
+		pgsql_pushint64(L, c->v.i[row]);
+	else
+		lua_pushnumber(L, c->v.d[row]);
+	return 1;
+}
+
+static int
+packed_ntuples(lua_State *L)
+{
+	lua_pushinteger(L, packed_check(L, 1)->ntuples);
+	return 1;
+}
+
+static int
+packed_nfields(lua_State *L)
+{
+	lua_pushinteger(L, packed_check(L, 1)->nfields);
+	return 1;
+}
+
+static int
+packed_clear(lua_State *L)
+{
+	packed_free(luaL_checkudata(L, 1, PACKED_METATABLE));
+	return 0;
+}
+
+/*
+ * Spilled results
+ *
+ * conn:execSpilled() streams the rows of a result in single row mode,
+ * or in chunks where libpq has them, into an unlinked temporary file and
+ * maps the file into memory, so that results larger than the heap can be
+ * rescanned and sorted through an object with the accessors of a
+ * result.  Each row is stored as the array of its field lengths (-1 for
+ * NULL) followed by the NUL terminated values; the offsets of the rows
+ * follow the last row.  Only the field descriptions live in the heap.
+ */
+#define SPILL_CHUNK	1024
+
+typedef struct spillWriter {
+	FILE		*data;
+	FILE		*index;		/* row offsets, appended to data */
+	uint64_t	 offset;
+	int		 ntuples;
+	int		 described;
+	int		 error;		/* errno of the first failure */
+} spillWriter;
+
+static FILE *
+spill_tmpfile(void)
+{
+	const char *dir;
+	char path[PATH_MAX];
+	FILE *f;
+	int fd;
+
+	dir = getenv("TMPDIR");
+	if (dir == NULL || *dir == '\0')
+		dir = "/tmp";
+	snprintf(path, sizeof path, "%s/luapgsql.XXXXXX", dir);
+	if ((fd = mkstemp(path)) == -1)
+		return NULL;
+	unlink(path);
+	if ((f = fdopen(fd, "w+")) == NULL)
+		close(fd);
+	return f;
+}
+
+/* Copy the field descriptions of r, the names to the table on top */
+static void
+spill_describe(lua_State *L, spilledResult *s, spillWriter *w,
+    const PGresult *r)
+{
+	int n;
+
+	w->described = 1;
+	s->nfields = PQnfields(r);
+	s->types = malloc((s->nfields + 1) * (sizeof(Oid) + 2 * sizeof(int)));
+	if (s->types == NULL) {
+		w->error = ENOMEM;
+		return;
+	}
+	s->formats = (int *)(s->types + s->nfields);
+	s->mods = s->formats + s->nfields;
+	for (n = 0; n < s->nfields; n++) {
+		s->types[n] = PQftype(r, n);
+		s->formats[n] = PQfformat(r, n);
+		s->mods[n] = PQfmod(r, n);
+		lua_pushstring(L, PQfname(r, n));
+		lua_rawseti(L, -2, n + 1);
+	}
+}
+
+static int
+spill_rows(spillWriter *w, const PGresult *r)
+{
+	int32_t len;
+	int row, col, ntuples, nfields;
+
+	ntuples = PQntuples(r);
+	nfields = PQnfields(r);
+	for (row = 0; row < ntuples; row++) {
+		if (w->ntuples == INT_MAX)
+			return EFBIG;
+		if (fwrite(&w->offset, sizeof w->offset, 1, w->index) != 1)
+			return errno;
+		for (col = 0; col < nfields; col++) {
+			len = PQgetisnull(r, row, col) ? -1 :
+			    PQgetlength(r, row, col);
+			if (fwrite(&len, sizeof len, 1, w->data) != 1)
+				return errno;
+		}
+		w->offset += nfields * sizeof len;
+		for (col = 0; col < nfields; col++) {
+			if (PQgetisnull(r, row, col))
+				continue;
+			len = PQgetlength(r, row, col);
+			if (fwrite(PQgetvalue(r, row, col), 1, len + 1,
+			    w->data) != (size_t)len + 1)
+				return errno;
+			w->offset += len + 1;
+		}
+		w->ntuples++;
+	}
+	return 0;
+}
+
+/* Append the row offsets, aligned, and map the file */
+static int
+spill_map(spillWriter *w, spilledResult *s)
+{
+	static const char zero[sizeof(uint64_t)];
+	char block[8192];
+	size_t pad, n;
+	void *map;
+
+	pad = (sizeof(uint64_t) - w->offset % sizeof(uint64_t)) %
+	    sizeof(uint64_t);
+	if (fwrite(zero, 1, pad, w->data) != pad)
+		return errno;
+	rewind(w->index);
+	while ((n = fread(block, 1, sizeof block, w->index)) > 0)
+		if (fwrite(block, 1, n, w->data) != n)
+			return errno;
+	if (ferror(w->index) || fflush(w->data))
+		return errno;
+	s->ntuples = w->ntuples;
+	s->size = w->offset + pad + (size_t)w->ntuples * sizeof(uint64_t);
+	if (s->size == 0) {
+		s->map = zero;
+		return 0;
+	}
+	map = mmap(NULL, s->size, PROT_READ, MAP_SHARED, fileno(w->data), 0);
+	if (map == MAP_FAILED)
+		return errno;
+	s->map = map;
+	s->rows = (const uint64_t *)(s->map + w->offset + pad);
+	return 0;
+}
+
+/*
+ * conn:execSpilled(command, ...) executes command with the parameters
+ * like conn:execParams() and returns a spilled result, or nil and an
+ * error message.
+ */
+static int
+conn_execSpilled(lua_State *L)
+{
+	spilledResult *s;
+	spillWriter w;
+	PGconn *conn;
+	PGresult *r, *failed;
+	const char *command;
+	sqlParams p;
+	int sent;
+
+	conn = pgsql_conn_query(L, 1);
+	command = luaL_checkstring(L, 2);
+	codec_resolve(L, 1);
+	tx_flush(L, 1);
+	sql_params_get(L, 3, lua_gettop(L), &p, 1);
+
+	s = lua_newuserdata(L, sizeof(spilledResult));
+	memset(s, 0, sizeof(spilledResult));
+	luaL_getmetatable(L, SPILL_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_newtable(L);
+	lua_pushlightuserdata(L, &result_types);
+	conn_types(L, 1);
+	lua_rawset(L, -3);
+
+	memset(&w, 0, sizeof w);
+	w.data = spill_tmpfile();
+	w.index = spill_tmpfile();
+	if (w.data == NULL || w.index == NULL) {
+		w.error = errno;
+		sent = 0;
+	} else
+		sent = PQsendQueryParams(conn, command, p.n, p.types,
+		    (const char * const*)p.values, p.lengths, p.formats, 0);
+	sql_params_free(&p);
+	failed = NULL;
+	if (sent) {
+#ifdef LIBPQ_HAS_CHUNK_MODE
+		PQsetChunkedRowsMode(conn, SPILL_CHUNK);
+#else
+		PQsetSingleRowMode(conn);
+#endif
+		while ((r = PQgetResult(conn)) != NULL) {
+			switch (PQresultStatus(r)) {
+			case PGRES_SINGLE_TUPLE:
+#ifdef LIBPQ_HAS_CHUNK_MODE
+			case PGRES_TUPLES_CHUNK:
+#endif
+			case PGRES_TUPLES_OK:
+				if (!w.described)
+					spill_describe(L, s, &w, r);
+				if (w.error == 0)
+					w.error = spill_rows(&w, r);
+				break;
+			case PGRES_COMMAND_OK:
+				break;
+			default:
+				if (failed == NULL) {
+					failed = r;
+					continue;
+				}
+			}
+			PQclear(r);
+		}
+		if (failed == NULL && w.error == 0)
+			w.error = spill_map(&w, s);
+	}
+	if (w.data != NULL)
+		fclose(w.data);
+	if (w.index != NULL)
+		fclose(w.index);
+
+	if (failed != NULL || w.error != 0 || !sent) {
+		lua_pushnil(L);
+		if (failed != NULL)
+			lua_pushstring(L, PQresultErrorMessage(failed));
+		else if (w.error != 0)
+			lua_pushstring(L, strerror(w.error));
+		else
+			lua_pushstring(L, PQerrorMessage(conn));
+		PQclear(failed);
+		return 2;
+	}
+	lua_setuservalue(L, -2);
+	return 1;
+}
+
+static spilledResult *
+spill_check(lua_State *L, int idx)
+{
+	spilledResult *s;
+
+	s = luaL_checkudata(L, idx, SPILL_METATABLE);
+	luaL_argcheck(L, s->map != NULL, idx,
+	    "spilled result has been cleared");
+	return s;
+}
+
+/* Column argument, a number or a field name */
+static int
+spill_column(lua_State *L, spilledResult *s, int idx)
+{
+	int col;
+
+	if (lua_type(L, idx) == LUA_TSTRING) {
+		lua_getuservalue(L, 1);
+		for (col = 0; col < s->nfields; col++) {
+			lua_rawgeti(L, -1, col + 1);
+			if (lua_rawequal(L, -1, idx)) {
+				lua_pop(L, 2);
+				return col;
+			}
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+		col = -1;
+	} else
+		col = luaL_checkinteger(L, idx) - 1;
+	luaL_argcheck(L, col >= 0 && col < s->nfields, idx, "no such column");
+	return col;
+}
+
+/*
+ * The value at row, col of the spilled result, with its length in *len,
+ * or NULL if it is NULL or row is out of range.
+ */
+static const char *
+spill_value(spilledResult *s, int row, int col, int32_t *len)
+{
+	const char *p, *v;
+	int n;
+
+	*len = -1;
+	if (row < 0 || row >= s->ntuples)
+		return NULL;
+	p = s->map + s->rows[row];
+	v = p + s->nfields * sizeof(int32_t);
+	for (n = 0; n <= col; n++) {
+		memcpy(len, p + n * sizeof(int32_t), sizeof(int32_t));
+		if (n < col && *len >= 0)
+			v += *len + 1;
+	}
+	return *len < 0 ? NULL : v;
+}
+
+static int
+spill_ntuples(lua_State *L)
+{
+	lua_pushinteger(L, spill_check(L, 1)->ntuples);
+	return 1;
+}
+
+static int
+spill_nfields(lua_State *L)
+{
+	lua_pushinteger(L, spill_check(L, 1)->nfields);
+	return 1;
+}
+
+static int
+spill_fname(lua_State *L)
+{
+	spilledResult *s;
+
+	s = spill_check(L, 1);
+	lua_getuservalue(L, 1);
+	lua_rawgeti(L, -1, spill_column(L, s, 2) + 1);
+	return 1;
+}
+
+static int
+spill_fnumber(lua_State *L)
+{
+	spilledResult *s;
+	int col;
+
+	s = spill_check(L, 1);
+	luaL_checkstring(L, 2);
+	lua_getuservalue(L, 1);
+	for (col = 0; col < s->nfields; col++) {
+		lua_rawgeti(L, -1, col + 1);
+		if (lua_rawequal(L, -1, 2))
+			break;
+		lua_pop(L, 1);
+	}
+	lua_pushinteger(L, col < s->nfields ? col + 1 : 0);
+	return 1;
+}
+
+static int
+spill_ftype(lua_State *L)
+{
+	spilledResult *s;
+
+	s = spill_check(L, 1);
+	lua_pushinteger(L, s->types[spill_column(L, s, 2)]);
+	return 1;
+}
+
+static int
+spill_fformat(lua_State *L)
+{
+	spilledResult *s;
+
+	s = spill_check(L, 1);
+	lua_pushinteger(L, s->formats[spill_column(L, s, 2)]);
+	return 1;
+}
+
+static int
+spill_fmod(lua_State *L)
+{
+	spilledResult *s;
+
+	s = spill_check(L, 1);
+	lua_pushinteger(L, s->mods[spill_column(L, s, 2)]);
+	return 1;
+}
+
+static int
+spill_getvalue(lua_State *L)
+{
+	spilledResult *s;
+	const char *v;
+	int32_t len;
+
+	s = spill_check(L, 1);
+	v = spill_value(s, luaL_checkinteger(L, 2) - 1,
+	    spill_column(L, s, 3), &len);
+	if (v == NULL)
+		lua_pushliteral(L, "");
+	else
+		lua_pushlstring(L, v, len);
+	return 1;
+}
+
+static int
+spill_getisnull(lua_State *L)
+{
+	spilledResult *s;
+	int32_t len;
+
+	s = spill_check(L, 1);
+	spill_value(s, luaL_checkinteger(L, 2) - 1, spill_column(L, s, 3),
+	    &len);
+	lua_pushboolean(L, len < 0);
+	return 1;
+}
+
+static int
+spill_getlength(lua_State *L)
+{
+	spilledResult *s;
+	int32_t len;
+
+	s = spill_check(L, 1);
+	spill_value(s, luaL_checkinteger(L, 2) - 1, spill_column(L, s, 3),
+	    &len);
+	lua_pushinteger(L, len < 0 ? 0 : len);
+	return 1;
+}
+
+/* The value decoded by its type, as in row proxies */
+static int
+spill_get(lua_State *L)
+{
+	spilledResult *s;
+	const char *v;
+	int32_t len;
+	int col;
+
+	s = spill_check(L, 1);
+	col = spill_column(L, s, 3);
+	v = spill_value(s, luaL_checkinteger(L, 2) - 1, col, &len);
+	if (v == NULL)
+		lua_pushnil(L);
+	else
+		pgsql_decode_typed(L, pgsql_types(L, 1), s->types[col],
+		    s->formats[col], v, len);
+	return 1;
+}
+
+static int
+spill_clear(lua_State *L)
+{
+	spilledResult *s;
+
+	s = luaL_checkudata(L, 1, SPILL_METATABLE);
+	if (s->map != NULL && s->size > 0)
+		munmap((void *)s->map, s->size);
+	free(s->types);
+	s->map = NULL;
+	s->types = NULL;
+	s->ntuples = s->nfields = 0;
+	return 0;
+}
+
+/*
+ * CSV output
+ *
+ * res:toCSV() and res:writeCSV() serialize a whole result with the
+ * quoting rules of COPY ... CSV: a field is quoted if it contains the
+ * delimiter, a quote or a line break, or if it could be mistaken for
+ * NULL.  Output goes to a luaL_Buffer or, in blocks, to a file.
+ * Binary fields are converted for the types that have a binary decoder;
+ * results with binary fields of other types are refused.
+ */
+
+#define CSV_BLOCK	65536
+
+typedef struct csvWriter {
+	luaL_Buffer	*b;		/* either this */
+	FILE		*f;		/* or that */
+	char		*block;
+	size_t		 n;
+	int		 error;
+	const char	*delimiter;
+	size_t		 dlen;
+	const char	*null;
+	size_t		 nlen;
+	int		 header;
+	int		 row;		/* of a value that could not be */
+	int		 col;		/* converted, error is EINVAL */
+} csvWriter;
+
+static void
+csv_flush(csvWriter *w)
+{
+	if (w->f != NULL && w->n > 0 && !w->error) {
+		if (fwrite(w->block, 1, w->n, w->f) != w->n)
+			w->error = errno;
+	}
+	w->n = 0;
+}
+
+static void
+csv_add(csvWriter *w, const char *s, size_t len)
+{
+	if (w->b != NULL) {
+		luaL_addlstring(w->b, s, len);
+		return;
+	}
+	if (w->n + len > CSV_BLOCK) {
+		csv_flush(w);
+		if (len > CSV_BLOCK) {
+			if (!w->error && fwrite(s, 1, len, w->f) != len)
+				w->error = errno;
+			return;
+		}
+	}
+	memcpy(w->block + w->n, s, len);
+	w->n += len;
+}
+
+static void
+csv_field(csvWriter *w, const char *v, size_t len)
+{
+	const char *p, *q, *end;
+	int quote;
+
+	quote = len == w->nlen && !memcmp(v, w->null, len);
+	for (p = v, end = v + len; !quote && p < end; p++)
+		if (*p == '"' || *p == '\n' || *p == '\r' ||
+		    (len - (p - v) >= w->dlen &&
+		    !memcmp(p, w->delimiter, w->dlen)))
+			quote = 1;
+	if (!quote) {
+		csv_add(w, v, len);
+		return;
+	}
+	csv_add(w, "\"", 1);
+	for (p = q = v; q < end; q++)
+		if (*q == '"') {
+			csv_add(w, p, q - p + 1);
+			p = q;
+		}
+	csv_add(w, p, end - p);
+	csv_add(w, "\"", 1);
+}
+
+/* Append the fraction of a second without trailing zeroes */
+static size_t
+csv_fraction(char *buf, size_t size, size_t len, int64_t usecs)
+{
+	if (usecs == 0 || len >= size)
+		return len;
+	len += snprintf(buf + len, size - len, ".%06d", (int)usecs);
+	if (len >= size)
+		return size - 1;
+	while (buf[len - 1] == '0')
+		buf[--len] = '\0';
+	return len;
+}
+
+/* ISO 8601 text of binary dates and times, as with DateStyle ISO */
+static size_t
+csv_time(const char *value, Oid type, char *buf, size_t size)
+{
+	struct tm tm;
+	time_t secs;
+	int64_t t, usecs;
+	int32_t days, months;
+	size_t len;
+
+	if (type == DATEOID) {
+		days = (int32_t)pack_binary_int(value, 4, INT4OID);
+		if (days == INT32_MAX || days == INT32_MIN)
+			return snprintf(buf, size, "%sinfinity",
+			    days == INT32_MIN ? "-" : "");
+		secs = (time_t)days * 86400 + PG_EPOCH_OFFSET;
+		if (gmtime_r(&secs, &tm) == NULL)
+			return 0;
+		return strftime(buf, size, "%Y-%m-%d", &tm);
+	}
+	t = pack_binary_int(value, 8, INT8OID);
+	switch (type) {
+	case TIMEOID:
+		len = snprintf(buf, size, "%02d:%02d:%02d",
+		    (int)(t / 3600000000LL), (int)(t / 60000000 % 60),
+		    (int)(t / 1000000 % 60));
+		return csv_fraction(buf, size, len, t % 1000000);
+	case INTERVALOID:
+		days = (int32_t)pack_binary_int(value + 8, 4, INT4OID);
+		months = (int32_t)pack_binary_int(value + 12, 4, INT4OID);
+		usecs = t % 1000000;
+		len = snprintf(buf, size, "%d mons %d days %s%lld", months,
+		    days, t < 0 && t > -1000000 ? "-" : "",
+		    (long long)(t / 1000000));
+		len = csv_fraction(buf, size, len, usecs < 0 ? -usecs : usecs);
+		if (len + 5 < size) {
+			memcpy(buf + len, " secs", 6);
+			len += 5;
+		}
+		return len;
+	}
+	if (t == INT64_MAX || t == INT64_MIN)
+		return snprintf(buf, size, "%sinfinity", t == INT64_MIN ?
+		    "-" : "");
+	usecs = t % 1000000;
+	if (usecs < 0)
+		usecs += 1000000;
+	secs = (time_t)((t - usecs) / 1000000 + PG_EPOCH_OFFSET);
+	if (gmtime_r(&secs, &tm) == NULL)
+		return 0;
+	len = strftime(buf, size, "%Y-%m-%d %H:%M:%S", &tm);
+	len = csv_fraction(buf, size, len, usecs);
+	if (type == TIMESTAMPTZOID && len + 3 < size) {
+		memcpy(buf + len, "+00", 4);
+		len += 3;
+	}
+	return len;
+}
+
+/* Fail on the value at row, col, the first failure is kept */
+static void
+csv_invalid(csvWriter *w, int row, int col)
+{
+	if (w->error)
+		return;
+	w->error = EINVAL;
+	w->row = row;
+	w->col = col;
+}
+
+/* Whether binary values of type can be written as text */
+static int
+csv_binary_type(Oid type)
+{
+	switch (type) {
+	case BOOLOID:
+	case INT2OID:
+	case INT4OID:
+	case INT8OID:
+	case OIDOID:
+	case FLOAT4OID:
+	case FLOAT8OID:
+	case DATEOID:
+	case TIMEOID:
+	case TIMESTAMPOID:
+	case TIMESTAMPTZOID:
+	case INTERVALOID:
+	case NUMERICOID:
+	case TEXTOID:
+	case VARCHAROID:
+	case BPCHAROID:
+	case NAMEOID:
+		return 1;
+	}
+	return 0;
+}
+
+/* Raise an error if a column of r is binary and can't be written */
+static void
+csv_check(lua_State *L, const PGresult *r)
+{
+	int col, nfields;
+
+	nfields = PQnfields(r);
+	for (col = 0; col < nfields; col++)
+		if (PQfformat(r, col) && !csv_binary_type(PQftype(r, col)))
+			luaL_error(L, "column %s: binary values of type %d "
+			    "have no text form", PQfname(r, col),
+			    (int)PQftype(r, col));
 }
 
 /*
- * Result set functions
+ * Text of a field in binary format for the types that have a binary
+ * decoder, the character types are written as they are.  Returns 0 for
+ * values that could not be converted.
  */
+static size_t
+csv_binary(const PGresult *r, int row, int col, char *buf, size_t size,
+    const char **v)
+{
+	const char *value;
+	double d;
+	int len;
+
+	value = PQgetvalue(r, row, col);
+	len = PQgetlength(r, row, col);
+	*v = buf;
+	switch (PQftype(r, col)) {
+	case BOOLOID:
+		return snprintf(buf, size, "%s", *value ? "t" : "f");
+	case INT2OID:
+	case INT4OID:
+	case INT8OID:
+	case OIDOID:
+		return snprintf(buf, size, "%lld", (long long)pack_binary_int(
+		    value, len, PQftype(r, col)));
+	case FLOAT4OID:
+	case FLOAT8OID:
+		d = pack_binary_float(value, len);
+		snprintf(buf, size, "%.15g", d);
+		if (strtod(buf, NULL) != d)
+			snprintf(buf, size, "%.17g", d);
+		return strlen(buf);
+	case DATEOID:
+	case TIMEOID:
+	case TIMESTAMPOID:
+	case TIMESTAMPTZOID:
+	case INTERVALOID:
+		return csv_time(value, PQftype(r, col), buf, size);
+	}
+	*v = value;
+	return len;
+}
+
+/* Binary numerics can be longer than any fixed buffer */
+static void
+csv_numeric(csvWriter *w, const PGresult *r, int row, int col)
+{
+	numeric *n;
+	char *s;
+
+	n = numeric_from_binary(PQgetvalue(r, row, col),
+	    PQgetlength(r, row, col));
+	if (n == NULL) {
+		if (PQgetlength(r, row, col) < 8)
+			csv_invalid(w, row, col);
+		else if (!w->error)
+			w->error = ENOMEM;
+		return;
+	}
+	if (n->sign == NUMERIC_PINF || n->sign == NUMERIC_NINF)
+		s = strdup(n->sign == NUMERIC_PINF ? "Infinity" : "-Infinity");
+	else
+		s = numeric_format(n);
+	free(n);
+	if (s == NULL) {
+		if (!w->error)
+			w->error = ENOMEM;
+		return;
+	}
+	csv_field(w, s, strlen(s));
+	free(s);
+}
+
+static void
+csv_result(csvWriter *w, const PGresult *r)
+{
+	const char *v;
+	char buf[64];
+	size_t len;
+	int row, col, ntuples, nfields;
+
+	ntuples = PQntuples(r);
+	nfields = PQnfields(r);
+	if (w->header) {
+		for (col = 0; col < nfields; col++) {
+			if (col > 0)
+				csv_add(w, w->delimiter, w->dlen);
+			csv_field(w, PQfname(r, col), strlen(PQfname(r, col)));
+		}
+		csv_add(w, "\n", 1);
+	}
+	for (row = 0; row < ntuples; row++) {
+		for (col = 0; col < nfields; col++) {
+			if (col > 0)
+				csv_add(w, w->delimiter, w->dlen);
+			if (PQgetisnull(r, row, col)) {
+				csv_add(w, w->null, w->nlen);
+				continue;
+			}
+			if (PQfformat(r, col) && PQftype(r, col) == NUMERICOID)
+				csv_numeric(w, r, row, col);
+			else if (PQfformat(r, col)) {
+				len = csv_binary(r, row, col, buf, sizeof buf,
+				    &v);
+				if (len == 0 && v == buf)
+					csv_invalid(w, row, col);
+				else
+					csv_field(w, v, len);
+			} else {
+				v = PQgetvalue(r, row, col);
+				len = PQgetlength(r, row, col);
+				csv_field(w, v, len);
+			}
+		}
+		csv_add(w, "\n", 1);
+	}
+}
+
+static void
+csv_options(lua_State *L, int opts, csvWriter *w)
+{
+	memset(w, 0, sizeof(csvWriter));
+	w->delimiter = ",";
+	w->dlen = 1;
+	w->null = "";
+	w->header = 1;
+	if (lua_isnoneornil(L, opts))
+		return;
+	luaL_checktype(L, opts, LUA_TTABLE);
+	lua_getfield(L, opts, "delimiter");
+	if (!lua_isnil(L, -1))
+		w->delimiter = luaL_checklstring(L, -1, &w->dlen);
+	lua_getfield(L, opts, "null");
+	if (!lua_isnil(L, -1))
+		w->null = luaL_checklstring(L, -1, &w->nlen);
+	lua_getfield(L, opts, "header");
+	if (!lua_isnil(L, -1))
+		w->header = lua_toboolean(L, -1);
+	/* the strings stay referenced by the options table */
+	lua_pop(L, 3);
+	luaL_argcheck(L, w->dlen > 0, opts, "empty delimiter");
+}
+
+/* Push nil and the message of the error of w */
 static int
-res_status(lua_State *L)
+csv_error(lua_State *L, csvWriter *w, const PGresult *r)
 {
-	lua_pushinteger(L,
-	    PQresultStatus(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
+	lua_pushnil(L);
+	if (w->error == EINVAL)
+		lua_pushfstring(L, "invalid binary value in row %d, column %s",
+		    w->row + 1, PQfname(r, w->col));
+	else
+		lua_pushstring(L, strerror(w->error));
+	return 2;
+}
+
+static int
+res_toCSV(lua_State *L)
+{
+	PGresult **res;
+	luaL_Buffer b;
+	csvWriter w;
+
+	res = luaL_checkudata(L, 1, RES_METATABLE);
+	luaL_argcheck(L, *res != NULL, 1, "result has been cleared");
+	csv_options(L, 2, &w);
+	csv_check(L, *res);
+	lua_settop(L, 2);
+	luaL_buffinit(L, &b);
+	w.b = &b;
+	csv_result(&w, *res);
+	luaL_pushresult(&b);
+	if (w.error)
+		return csv_error(L, &w, *res);
 	return 1;
 }
 
 static int
-res_resStatus(lua_State *L)
+res_writeCSV(lua_State *L)
 {
-	lua_pushstring(L, PQresStatus(luaL_checkinteger(L, 2)));
+	PGresult **res;
+	csvWriter w;
+
+	res = luaL_checkudata(L, 1, RES_METATABLE);
+	luaL_argcheck(L, *res != NULL, 1, "result has been cleared");
+	csv_options(L, 3, &w);
+	csv_check(L, *res);
+	w.f = pgsql_checkfile(L, 2);
+	w.block = malloc(CSV_BLOCK);
+	if (w.block == NULL)
+		return luaL_error(L, "out of memory");
+	csv_result(&w, *res);
+	csv_flush(&w);
+	free(w.block);
+	if (w.error)
+		return csv_error(L, &w, *res);
+	lua_pushboolean(L, 1);
 	return 1;
 }
 
 static int
-res_errorMessage(lua_State *L)
+res_clear(lua_State *L)
 {
-	lua_pushstring(L,
-	    PQresultErrorMessage(*(PGresult **)luaL_checkudata(L, 1,
-	    RES_METATABLE)));
+	PGresult **r;
+
+	r = luaL_checkudata(L, 1, RES_METATABLE);
+	if (r && *r)  {
+		PQclear(*r);
+		*r = NULL;
+	}
+	return 0;
+}
+
+/*
+ * Notifies methods (objects returned by conn:notifies())
+ */
+static int
+notify_relname(lua_State *L)
+{
+	PGnotify **n;
+
+	n = luaL_checkudata(L, 1, NOTIFY_METATABLE);
+	lua_pushstring(L, (*n)->relname);
 	return 1;
 }
 
 static int
-res_errorField(lua_State *L)
+notify_pid(lua_State *L)
 {
-	char *field;
+	PGnotify **n;
 
-	field = PQresultErrorField(
-	    *(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    lua_tointeger(L, 2));
-	if (field == NULL)
+	n = luaL_checkudata(L, 1, NOTIFY_METATABLE);
+	lua_pushinteger(L, (*n)->be_pid);
+	return 1;
+}
+
+static int
+notify_extra(lua_State *L)
+{
+	PGnotify **n;
+
+	n = luaL_checkudata(L, 1, NOTIFY_METATABLE);
+	lua_pushstring(L, (*n)->extra);
+	return 1;
+}
+
+static int
+notify_clear(lua_State *L)
+{
+	PGnotify **n;
+
+	n = luaL_checkudata(L, 1, NOTIFY_METATABLE);
+	if (*n)  {
+		PQfreemem(*n);
+		*n = NULL;
+	}
+	return 0;
+}
+
+/*
+ * Cursor methods (objects returned by conn:cursor())
+ */
+static int
+cursor_fetch(lua_State *L)
+{
+	cursor *c;
+	PGresult **res;
+
+	c = luaL_checkudata(L, 1, CURSOR_METATABLE);
+	if (c->closed || (c->done && !c->pending)) {
+		lua_pushnil(L);
+		return 1;
+	}
+	if (cursor_next_batch(L, c, 1) == 0) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_getuservalue(L, 1);
+	lua_getfield(L, -1, "conn");
+	res = pgsql_res_new(L, lua_gettop(L));
+	*res = c->res;
+	c->res = NULL;
+	return 1;
+}
+
+static int
+cursor_iterate(lua_State *L)
+{
+	cursor *c;
+	int n, nfields;
+
+	c = luaL_checkudata(L, 1, CURSOR_METATABLE);
+	if (c->res == NULL || c->row >= PQntuples(c->res)) {
+		if (c->closed || (c->done && !c->pending))
+			return 0;
+		if (cursor_next_batch(L, c, 1) == 0)
+			return 0;
+	}
+	nfields = PQnfields(c->res);
+	lua_createtable(L, 0, nfields);
+	for (n = 0; n < nfields; n++) {
+		if (PQgetisnull(c->res, c->row, n))
+			continue;
+		lua_pushlstring(L, PQgetvalue(c->res, c->row, n),
+		    PQgetlength(c->res, c->row, n));
+		lua_setfield(L, -2, PQfname(c->res, n));
+	}
+	c->row++;
+	return 1;
+}
+
+static int
+cursor_rows(lua_State *L)
+{
+	luaL_checkudata(L, 1, CURSOR_METATABLE);
+	lua_pushcfunction(L, cursor_iterate);
+	lua_pushvalue(L, 1);
+	return 2;
+}
+
+static int
+cursor_close(lua_State *L)
+{
+	cursor_release(L, luaL_checkudata(L, 1, CURSOR_METATABLE), 1);
+	return 0;
+}
+
+static int
+cursor_clear(lua_State *L)
+{
+	cursor_release(L, luaL_checkudata(L, 1, CURSOR_METATABLE), 0);
+	return 0;
+}
+
+/*
+ * Row proxy methods (objects returned by res:row())
+ */
+static PGresult *
+row_result(lua_State *L, resRow *proxy)
+{
+	if (*proxy->res == NULL)
+		luaL_error(L, "result has been cleared");
+	return *proxy->res;
+}
+
+static int
+row_index(lua_State *L)
+{
+	resRow *proxy;
+	PGresult *r;
+	int col;
+
+	proxy = luaL_checkudata(L, 1, ROW_METATABLE);
+	r = row_result(L, proxy);
+	if (lua_type(L, 2) == LUA_TNUMBER)
+		col = lua_tointeger(L, 2) - 1;
+	else {
+		lua_getuservalue(L, 1);
+		lua_pushvalue(L, 2);
+		lua_rawget(L, -2);
+		if (lua_isnil(L, -1))
+			/* fall back for quoted or mixed case names */
+			col = lua_type(L, 2) == LUA_TSTRING ?
+			    PQfnumber(r, lua_tostring(L, 2)) : -1;
+		else
+			col = lua_tointeger(L, -1) - 1;
+	}
+	if (col < 0 || col >= PQnfields(r))
 		lua_pushnil(L);
 	else
-		lua_pushstring(L, field);
+		pgsql_push_value(L, pgsql_types(L, 1), r, proxy->row, col);
 	return 1;
 }
 
-static int
-res_nfields(lua_State *L)
+static int
+row_len(lua_State *L)
+{
+	resRow *proxy;
+
+	proxy = luaL_checkudata(L, 1, ROW_METATABLE);
+	lua_pushinteger(L, PQnfields(row_result(L, proxy)));
+	return 1;
+}
+
+/*
+ * The position is kept in an upvalue rather than derived from the
+ * key, which would not work with duplicate field names.
+ */
+static int
+row_next(lua_State *L)
+{
+	resRow *proxy;
+	PGresult *r;
+	int col, nfields;
+
+	proxy = luaL_checkudata(L, 1, ROW_METATABLE);
+	r = row_result(L, proxy);
+	nfields = PQnfields(r);
+	for (col = lua_tointeger(L, lua_upvalueindex(1)); col < nfields &&
+	    PQgetisnull(r, proxy->row, col); col++)
+		;
+	if (col >= nfields)
+		return 0;
+	lua_pushinteger(L, col + 1);
+	lua_replace(L, lua_upvalueindex(1));
+	lua_pushstring(L, PQfname(r, col));
+	pgsql_push_value(L, pgsql_types(L, 1), r, proxy->row, col);
+	lua_remove(L, -2);
+	return 2;
+}
+
+static int
+row_pairs(lua_State *L)
+{
+	luaL_checkudata(L, 1, ROW_METATABLE);
+	lua_pushinteger(L, 0);
+	lua_pushcclosure(L, row_next, 1);
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	return 3;
+}
+
+/*
+ * Prepared statement handles
+ */
+static unsigned int statement_serial;
+
+static int64_t
+param_integer(lua_State *L, int idx, int64_t min, int64_t max)
+{
+	lua_Number d;
+	int64_t v;
+
+#if LUA_VERSION_NUM >= 503
+	if (lua_isinteger(L, idx))
+		v = lua_tointeger(L, idx);
+	else
+#endif
+	{
+		d = luaL_checknumber(L, idx);
+		v = (int64_t)d;
+		if ((lua_Number)v != d)
+			luaL_argerror(L, idx, "number has no integer "
+			    "representation");
+	}
+	if (v < min || v > max)
+		luaL_argerror(L, idx, "value out of range");
+	return v;
+}
+
+/*
+ * Microseconds since the Unix epoch to microseconds since the server's
+ * epoch; math.huge and -math.huge are sent as infinity and -infinity.
+ */
+static int64_t
+param_time(lua_State *L, int idx)
+{
+	lua_Number d;
+
+	d = lua_tonumber(L, idx);
+	if (isinf(d))
+		return d > 0 ? INT64_MAX : INT64_MIN;
+	return param_integer(L, idx, INT64_MIN + PG_EPOCH_USECS + 1,
+	    INT64_MAX) - PG_EPOCH_USECS;
+}
+
+static lua_Integer
+param_field(lua_State *L, int idx, const char *name, lua_Integer min,
+    lua_Integer max)
+{
+	lua_Number d;
+	lua_Integer v;
+
+	lua_getfield(L, idx, name);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	d = lua_tonumber(L, -1);
+	v = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	if ((lua_Number)v != d || v < min || v > max)
+		luaL_argerror(L, idx, "invalid interval");
+	return v;
+}
+
+/*
+ * An interval from a table with months, days and microseconds or
+ * from a number of microseconds.
+ */
+static void
+param_interval(lua_State *L, int idx)
+{
+	char buf[16];
+	uint64_t usecs;
+	uint32_t days, months;
+
+	if (lua_type(L, idx) == LUA_TNUMBER) {
+		usecs = htobe64((uint64_t)param_integer(L, idx, INT64_MIN,
+		    INT64_MAX));
+		days = months = 0;
+	} else {
+		usecs = htobe64((uint64_t)param_field(L, idx, "microseconds",
+		    INT64_MIN, INT64_MAX));
+		days = htonl((uint32_t)param_field(L, idx, "days", INT32_MIN,
+		    INT32_MAX));
+		months = htonl((uint32_t)param_field(L, idx, "months",
+		    INT32_MIN, INT32_MAX));
+	}
+	memcpy(buf, &usecs, sizeof usecs);
+	memcpy(buf + 8, &days, sizeof days);
+	memcpy(buf + 12, &months, sizeof months);
+	lua_pushlstring(L, buf, sizeof buf);
+	lua_replace(L, idx);
+}
+
+/*
+ * Encode the Lua value at idx as a parameter of the given type, with
+ * the codecs of the type table at index types.  Fixed size types are
+ * sent in binary format using the scratch space, strings are passed
+ * without copying them; they stay valid while they are on the stack.
+ */
+static void
+stmt_encode(lua_State *L, int idx, int types, Oid type, char **value,
+    int *length, int *format, uint64_t *scratch)
+{
+	union {
+		float f;
+		uint32_t i;
+	} u32;
+	union {
+		double f;
+		uint64_t i;
+	} u64;
+	numeric *n;
+	char *s;
+	int64_t i8;
+	size_t len;
+	int t;
+
+	t = lua_type(L, idx);
+	if (t == LUA_TNIL) {
+		*value = NULL;
+		*length = 0;
+		*format = 0;
+		return;
+	}
+	if (codec_push(L, types, type) &&
+	    (*format = codec_encode(L, idx)) != -1) {
+		*value = (char *)lua_tolstring(L, idx, &len);
+		*length = len;
+		return;
+	}
+	if (t == LUA_TUSERDATA && (n = numeric_test(L, idx)) != NULL) {
+		/* binary for numeric parameters, text for anything else */
+		if (type == NUMERICOID) {
+			s = malloc(8 + 2 * n->ndigits);
+			if (s != NULL)
+				numeric_to_binary(n, s);
+			len = 8 + 2 * n->ndigits;
+		} else {
+			s = numeric_format(n);
+			len = s != NULL ? strlen(s) : 0;
+		}
+		if (s == NULL)
+			luaL_error(L, "out of memory");
+		lua_pushlstring(L, s, len);
+		free(s);
+		lua_replace(L, idx);
+		*value = (char *)lua_tostring(L, idx);
+		*length = len;
+		*format = type == NUMERICOID;
+		return;
+	}
+	if (type == INTERVALOID && (t == LUA_TNUMBER || t == LUA_TTABLE)) {
+		param_interval(L, idx);
+		*value = (char *)lua_tolstring(L, idx, &len);
+		*length = len;
+		*format = 1;
+		return;
+	}
+	*value = (char *)scratch;
+	*format = 1;
+	if ((t == LUA_TNUMBER && type != BOOLOID) ||
+	    (t == LUA_TBOOLEAN && type == BOOLOID))
+		switch (type) {
+		case BOOLOID:
+			*(char *)scratch = lua_toboolean(L, idx);
+			*length = 1;
+			return;
+		case INT2OID:
+			*(uint16_t *)scratch = htons((uint16_t)
+			    param_integer(L, idx, INT16_MIN, INT16_MAX));
+			*length = 2;
+			return;
+		case INT4OID:
+			*(uint32_t *)scratch = htonl((uint32_t)
+			    param_integer(L, idx, INT32_MIN, INT32_MAX));
+			*length = 4;
+			return;
+		case OIDOID:
+			*(uint32_t *)scratch = htonl((uint32_t)
+			    param_integer(L, idx, 0, UINT32_MAX));
+			*length = 4;
+			return;
+		case INT8OID:
+			*scratch = htobe64((uint64_t)
+			    param_integer(L, idx, INT64_MIN, INT64_MAX));
+			*length = 8;
+			return;
+		case FLOAT4OID:
+			u32.f = lua_tonumber(L, idx);
+			*(uint32_t *)scratch = htonl(u32.i);
+			*length = 4;
+			return;
+		case FLOAT8OID:
+			u64.f = lua_tonumber(L, idx);
+			*scratch = htobe64(u64.i);
+			*length = 8;
+			return;
+		case DATEOID:
+			i8 = param_time(L, idx);
+			if (i8 == INT64_MAX || i8 == INT64_MIN)
+				i8 = i8 == INT64_MAX ? INT32_MAX : INT32_MIN;
+			else {
+				/* round towards the start of the day */
+				i8 = i8 / USECS_PER_DAY - (i8 % USECS_PER_DAY <
+				    0);
+				if (i8 <= INT32_MIN || i8 >= INT32_MAX)
+					luaL_argerror(L, idx,
+					    "value out of range");
+			}
+			*(uint32_t *)scratch = htonl((uint32_t)(int32_t)i8);
+			*length = 4;
+			return;
+		case TIMEOID:
+			*scratch = htobe64((uint64_t)
+			    param_integer(L, idx, 0, USECS_PER_DAY));
+			*length = 8;
+			return;
+		case TIMESTAMPOID:
+		case TIMESTAMPTZOID:
+			*scratch = htobe64((uint64_t)param_time(L, idx));
+			*length = 8;
+			return;
+		}
+
+	switch (t) {
+	case LUA_TBOOLEAN:
+		*value = lua_toboolean(L, idx) ? "true" : "false";
+		break;
+	case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+		if (!lua_isinteger(L, idx))
+#endif
+		{
+			char buf[32];
+			lua_Number d;
+
+			/* shortest representation that reads back exactly */
+			d = lua_tonumber(L, idx);
+			snprintf(buf, sizeof buf, "%.15g", d);
+			if (strtod(buf, NULL) != d)
+				snprintf(buf, sizeof buf, "%.17g", d);
+			lua_pushstring(L, buf);
+			lua_replace(L, idx);
+		}
+		/* FALLTHROUGH */
+	case LUA_TSTRING:
+		*value = (char *)lua_tolstring(L, idx, &len);
+		*length = len;
+		*format = type == BYTEAOID;
+		return;
+	default:
+		luaL_argerror(L, idx, "unsupported type");
+	}
+	*length = strlen(*value);
+	*format = 0;
+}
+
+static statement *
+stmt_check(lua_State *L, int idx)
 {
-	lua_pushinteger(L,
-	    PQnfields(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
-	return 1;
-}
+	statement *stmt;
 
-static int
-res_ntuples(lua_State *L)
-{
-	lua_pushinteger(L,
-	    PQntuples(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
-	return 1;
+	stmt = luaL_checkudata(L, idx, STMT_METATABLE);
+	luaL_argcheck(L, stmt->name != NULL, idx, "statement is closed");
+	if (*stmt->conn == NULL)
+		luaL_error(L, "database connection is finished");
+	return stmt;
 }
 
-static int
-res_fname(lua_State *L)
+static void
+stmt_release(statement *stmt)
 {
-	lua_pushstring(L,
-	    PQfname(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    luaL_checkinteger(L, 2) - 1));
-	return 1;
+	free(stmt->name);
+	free(stmt->paramTypes);
+	free(stmt->decoders);
+	stmt->name = NULL;
+	stmt->paramTypes = NULL;
+	stmt->decoders = NULL;
 }
 
+/*
+ * Prepare a statement and describe it once.  The parameter types and
+ * a decoder for each result column are kept with the statement, so
+ * that executing it needs neither type inference nor a description.
+ */
 static int
-res_fnumber(lua_State *L)
+conn_prepareStatement(lua_State *L)
 {
-	lua_pushinteger(L,
-	    PQfnumber(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    luaL_checkstring(L, 2)) + 1);
-	return 1;
-}
+	statement *stmt;
+	PGconn *conn;
+	PGresult *r;
+	const char *name, *command;
+	char serial[32];
+	Oid *types;
+	int n, ntypes, binary, format, typeidx;
+
+	conn = pgsql_conn_query(L, 1);
+	command = luaL_checkstring(L, 2);
+	if (lua_isnoneornil(L, 3)) {
+		snprintf(serial, sizeof serial, "luapgsql_stmt_%u",
+		    ++statement_serial);
+		name = serial;
+	} else
+		name = luaL_checkstring(L, 3);
+	codec_resolve(L, 1);
+
+	types = NULL;
+	ntypes = 0;
+	if (!lua_isnoneornil(L, 4)) {
+		luaL_checktype(L, 4, LUA_TTABLE);
+		ntypes = lua_rawlen(L, 4);
+		if (ntypes > 0 && (types = calloc(ntypes, sizeof(Oid))) ==
+		    NULL)
+			return luaL_error(L, "out of memory");
+		for (n = 0; n < ntypes; n++) {
+			lua_rawgeti(L, 4, n + 1);
+			types[n] = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+		}
+	}
 
-static int
-res_ftable(lua_State *L)
-{
-	lua_pushinteger(L,
-	    PQftable(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    luaL_checkinteger(L, 2) - 1));
+	stmt = lua_newuserdata(L, sizeof(statement));
+	memset(stmt, 0, sizeof(statement));
+	stmt->conn = luaL_checkudata(L, 1, CONN_METATABLE);
+	luaL_getmetatable(L, STMT_METATABLE);
+	lua_setmetatable(L, -2);
+	stmt->name = strdup(name);
+	if (stmt->name == NULL) {
+		free(types);
+		return luaL_error(L, "out of memory");
+	}
+
+	r = PQprepare(conn, name, command, ntypes, types);
+	free(types);
+	if (PQresultStatus(r) == PGRES_COMMAND_OK) {
+		PQclear(r);
+		r = PQdescribePrepared(conn, name);
+	}
+	if (PQresultStatus(r) != PGRES_COMMAND_OK) {
+		stmt_release(stmt);
+		lua_pushnil(L);
+		lua_pushstring(L, r != NULL ? PQresultErrorMessage(r) :
+		    PQerrorMessage(conn));
+		PQclear(r);
+		return 2;
+	}
+
+	stmt->nparams = PQnparams(r);
+	stmt->nfields = PQnfields(r);
+	stmt->paramTypes = calloc(stmt->nparams + 1, sizeof(Oid));
+	stmt->decoders = calloc(stmt->nfields + 1, sizeof(pgsql_decoder));
+	if (stmt->paramTypes == NULL || stmt->decoders == NULL) {
+		PQclear(r);
+		stmt_release(stmt);
+		return luaL_error(L, "out of memory");
+	}
+	for (n = 0; n < stmt->nparams; n++)
+		stmt->paramTypes[n] = PQparamtype(r, n);
+	pgsql_track_prepare(L, 1, name, command, stmt->nparams,
+	    stmt->paramTypes);
+
+	/*
+	 * Results are binary if every column can be decoded from it, by a
+	 * codec, as composite or array or built in.  Columns with a codec
+	 * or of composite or array type have no decoder.
+	 */
+	composite_resolve(L, 1, r);
+	conn_types(L, 1);
+	typeidx = lua_gettop(L);
+	for (n = 0, binary = 1; n < stmt->nfields; n++) {
+		format = codec_format(L, typeidx, PQftype(r, n));
+		if (format == 0 || (format == -1 &&
+		    pgsql_decoder_for(PQftype(r, n), 1) == NULL &&
+		    !composite_has(L, typeidx, PQftype(r, n))))
+			binary = 0;
+	}
+	stmt->format = stmt->nfields > 0 && binary;
+	for (n = 0; n < stmt->nfields; n++)
+		if (codec_format(L, typeidx, PQftype(r, n)) == -1 &&
+		    !composite_has(L, typeidx, PQftype(r, n)))
+			stmt->decoders[n] = pgsql_decoder_for(PQftype(r, n),
+			    stmt->format);
+
+	/* keep the connection, its types and the interned field names */
+	lua_createtable(L, 0, 4);
+	lua_pushvalue(L, 1);
+	lua_setfield(L, -2, "conn");
+	lua_pushlightuserdata(L, &result_types);
+	lua_pushvalue(L, typeidx);
+	lua_rawset(L, -3);
+	lua_createtable(L, stmt->nfields, 0);
+	for (n = 0; n < stmt->nfields; n++) {
+		lua_pushstring(L, PQfname(r, n));
+		lua_rawseti(L, -2, n + 1);
+	}
+	lua_setfield(L, -2, "names");
+	lua_createtable(L, stmt->nfields, 0);
+	for (n = 0; n < stmt->nfields; n++) {
+		lua_pushinteger(L, PQftype(r, n));
+		lua_rawseti(L, -2, n + 1);
+	}
+	lua_setfield(L, -2, "ftypes");
+	lua_setuservalue(L, -3);
+	lua_pop(L, 1);
+	PQclear(r);
 	return 1;
 }
 
+/*
+ * Statement methods (objects returned by conn:prepareStatement())
+ */
+#define STMT_INLINE_PARAMS	16
+
 static int
-res_ftablecol(lua_State *L)
+stmt_exec(lua_State *L)
 {
-	lua_pushinteger(L,
-	    PQftablecol(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    luaL_checkinteger(L, 2) - 1));
-	return 1;
+	statement *stmt;
+	PGconn *conn;
+	PGresult *r, **res;
+	char *ivalues[STMT_INLINE_PARAMS], **values;
+	int ilengths[STMT_INLINE_PARAMS], *lengths;
+	int iformats[STMT_INLINE_PARAMS], *formats;
+	uint64_t iscratch[STMT_INLINE_PARAMS], *scratch;
+	PGTransactionStatusType before;
+	char begin[TX_BEGIN_SIZE];
+	struct timespec start;
+	deadline d;
+	int n, row, ntuples, nargs, armed, pending, timed, types, cidx;
+
+	stmt = stmt_check(L, 1);
+	conn = *stmt->conn;
+	cursor_drain(L, conn);
+	nargs = lua_gettop(L) - 1;
+	if (nargs != stmt->nparams)
+		return luaL_error(L, "statement takes %d parameters, %d given",
+		    stmt->nparams, nargs);
+
+	if (stmt->nparams <= STMT_INLINE_PARAMS) {
+		values = ivalues;
+		lengths = ilengths;
+		formats = iformats;
+		scratch = iscratch;
+	} else {
+		/* in a userdata, so that errors while encoding don't leak */
+		values = lua_newuserdata(L, stmt->nparams * (sizeof(char *)
+		    + 2 * sizeof(int) + sizeof(uint64_t)));
+		scratch = (uint64_t *)values;
+		values = (char **)(scratch + stmt->nparams);
+		lengths = (int *)(values + stmt->nparams);
+		formats = lengths + stmt->nparams;
+	}
+	types = pgsql_types(L, 1);
+	for (n = 0; n < stmt->nparams; n++)
+		stmt_encode(L, n + 2, types, stmt->paramTypes[n], &values[n],
+		    &lengths[n], &formats[n], &scratch[n]);
+
+	lua_getuservalue(L, 1);
+	lua_getfield(L, -1, "conn");
+	pending = tx_take(L, lua_gettop(L), begin, sizeof begin);
+	timed = explain_start(L, lua_gettop(L), &start);
+	before = pending ? PQTRANS_INTRANS : PQtransactionStatus(conn);
+	armed = query_deadline(L, lua_gettop(L), 0, &d);
+	lua_pop(L, 2);
+	if (pending)
+		r = tx_run(conn, begin, stmt->name, NULL, stmt->nparams, NULL,
+		    (const char * const *)values, lengths, formats,
+		    stmt->format, NULL, NULL);
+	else
+		r = PQexecPrepared(conn, stmt->name, stmt->nparams,
+		    (const char * const *)values, lengths, formats,
+		    stmt->format);
+	if (armed)
+		deadline_disarm(&d);
+	if (pgsql_lost(conn, r)) {
+		lua_getuservalue(L, 1);
+		lua_getfield(L, -1, "conn");
+		if (pgsql_recover(L, lua_gettop(L), before) &&
+		    stmt_readonly(L, lua_gettop(L), stmt->name)) {
+			PQclear(r);
+			r = NULL;
+			armed = query_deadline(L, lua_gettop(L), 0, &d);
+			r = PQexecPrepared(conn, stmt->name, stmt->nparams,
+			    (const char * const *)values, lengths, formats,
+			    stmt->format);
+			if (armed)
+				deadline_disarm(&d);
+		}
+		lua_pop(L, 2);
+	}
+	if (timed) {
+		lua_getuservalue(L, 1);
+		lua_getfield(L, -1, "conn");
+		cidx = lua_gettop(L);
+		if (explain_slow(L, cidx, &start, NULL, stmt->name,
+		    stmt->nparams, stmt->paramTypes,
+		    (const char * const *)values, lengths, formats)) {
+			/* a result holds r while the hook runs */
+			res = pgsql_res_new(L, 0);
+			*res = r;
+			lua_insert(L, -2);
+			explain_report(L, cidx);
+			*res = NULL;
+		}
+		lua_settop(L, cidx - 2);
+	}
+
+	switch (PQresultStatus(r)) {
+	case PGRES_TUPLES_OK:
+		if (PQnfields(r) != stmt->nfields) {
+			PQclear(r);
+			return luaL_error(L, "result does not match the "
+			    "statement description");
+		}
+		lua_getuservalue(L, 1);
+		lua_getfield(L, -1, "names");
+		ntuples = PQntuples(r);
+		lua_createtable(L, ntuples, 0);
+		for (row = 0; row < ntuples; row++) {
+			lua_createtable(L, 0, stmt->nfields);
+			for (n = 0; n < stmt->nfields; n++) {
+				if (PQgetisnull(r, row, n))
+					continue;
+				lua_rawgeti(L, -3, n + 1);
+				if (stmt->decoders[n] != NULL)
+					stmt->decoders[n](L, PQgetvalue(r, row,
+					    n), PQgetlength(r, row, n));
+				else
+					pgsql_decode_typed(L, types,
+					    PQftype(r, n), stmt->format,
+					    PQgetvalue(r, row, n),
+					    PQgetlength(r, row, n));
+				lua_rawset(L, -3);
+			}
+			lua_rawseti(L, -2, row + 1);
+		}
+		PQclear(r);
+		return 1;
+	case PGRES_COMMAND_OK:
+		pgsql_pushint64(L, strtoll(PQcmdTuples(r), NULL, 10));
+		PQclear(r);
+		return 1;
+	default:
+		lua_getuservalue(L, 1);
+		lua_getfield(L, -1, "conn");
+		tx_track(L, lua_gettop(L), r);
+		lua_pop(L, 2);
+		lua_pushnil(L);
+		lua_pushstring(L, r != NULL ? PQresultErrorMessage(r) :
+		    PQerrorMessage(conn));
+		PQclear(r);
+		return 2;
+	}
 }
 
 static int
-res_fformat(lua_State *L)
+stmt_name(lua_State *L)
 {
-	lua_pushinteger(L,
-	    PQfformat(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    luaL_checkinteger(L, 2) - 1));
+	lua_pushstring(L, stmt_check(L, 1)->name);
 	return 1;
 }
 
 static int
-res_ftype(lua_State *L)
+stmt_nparams(lua_State *L)
 {
-	lua_pushinteger(L,
-	    PQftype(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    luaL_checkinteger(L, 2) - 1));
+	lua_pushinteger(L, stmt_check(L, 1)->nparams);
 	return 1;
 }
 
 static int
-res_fmod(lua_State *L)
+stmt_paramtype(lua_State *L)
 {
-	lua_pushinteger(L,
-	    PQfmod(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    luaL_checkinteger(L, 2) - 1));
+	statement *stmt;
+	int n;
+
+	stmt = stmt_check(L, 1);
+	n = luaL_checkinteger(L, 2) - 1;
+	luaL_argcheck(L, n >= 0 && n < stmt->nparams, 2,
+	    "parameter number out of range");
+	lua_pushinteger(L, stmt->paramTypes[n]);
 	return 1;
 }
 
 static int
-res_fsize(lua_State *L)
+stmt_nfields(lua_State *L)
 {
-	lua_pushinteger(L,
-	    PQfsize(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    luaL_checkinteger(L, 2) - 1));
+	lua_pushinteger(L, stmt_check(L, 1)->nfields);
 	return 1;
 }
 
 static int
-res_binaryTuples(lua_State *L)
+stmt_field(lua_State *L, const char *which)
 {
-	lua_pushinteger(L,
-	    PQbinaryTuples(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
+	statement *stmt;
+	int n;
+
+	stmt = stmt_check(L, 1);
+	n = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, n > 0 && n <= stmt->nfields, 2,
+	    "field number out of range");
+	lua_getuservalue(L, 1);
+	lua_getfield(L, -1, which);
+	lua_rawgeti(L, -1, n);
 	return 1;
 }
 
 static int
-res_getvalue(lua_State *L)
+stmt_fname(lua_State *L)
 {
-	lua_pushstring(L,
-	    PQgetvalue(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    luaL_checkinteger(L, 2) - 1, luaL_checkinteger(L, 3) - 1));
-	return 1;
+	return stmt_field(L, "names");
 }
 
 static int
-res_getisnull(lua_State *L)
+stmt_ftype(lua_State *L)
 {
-	lua_pushboolean(L,
-	    PQgetisnull(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    luaL_checkinteger(L, 2) - 1, luaL_checkinteger(L, 3) - 1));
-	return 1;
+	return stmt_field(L, "ftypes");
 }
 
 static int
-res_getlength(lua_State *L)
+stmt_close(lua_State *L)
 {
-	lua_pushinteger(L,
-	    PQgetlength(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    luaL_checkinteger(L, 2) - 1, luaL_checkinteger(L, 3) - 1));
-	return 1;
+	statement *stmt;
+	PGconn *conn;
+	char *ident;
+
+	stmt = luaL_checkudata(L, 1, STMT_METATABLE);
+	if (stmt->name == NULL)
+		return 0;
+	conn = *stmt->conn;
+	if (conn != NULL)
+		cursor_drain(L, conn);
+	if (conn != NULL && PQtransactionStatus(conn) != PQTRANS_INERROR &&
+	    (ident = PQescapeIdentifier(conn, stmt->name,
+	    strlen(stmt->name))) != NULL) {
+		lua_pushfstring(L, "DEALLOCATE %s", ident);
+		PQfreemem(ident);
+		PQclear(PQexec(conn, lua_tostring(L, -1)));
+		lua_getuservalue(L, 1);
+		lua_getfield(L, -1, "conn");
+		pgsql_untrack_prepare(L, lua_gettop(L), stmt->name);
+	}
+	stmt_release(stmt);
+	return 0;
 }
 
 static int
-res_nparams(lua_State *L)
+stmt_clear(lua_State *L)
 {
-	lua_pushinteger(L,
-	    PQnparams(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
-	return 1;
+	stmt_release(luaL_checkudata(L, 1, STMT_METATABLE));
+	return 0;
 }
 
-static int
-res_paramtype(lua_State *L)
+/*
+ * Batch execution of prepared statements
+ *
+ * conn:execPreparedBatch() runs a prepared statement once for every
+ * parameter tuple of an array.  With pipelining, the executions are
+ * streamed to the server in nonblocking mode while the results are
+ * read, with a Sync after every opts.sync rows (1000 by default): an
+ * error aborts the remaining rows up to the next Sync, so sync = 1
+ * makes every row independent.  Parameters are encoded by the types of
+ * the statement as for prepared statement handles.
+ */
+#define BATCH_SYNC	1000
+#define BATCH_WINDOW	4096	/* rows sent but not yet answered */
+
+typedef struct batchState {
+	PGconn		*conn;
+	const char	*name;
+	Oid		*types;
+	int		 nparams;
+	int		 sync;
+	int		 sent;
+	int		 received;
+	int		 syncs;		/* sent, but not yet received */
+	int		 answered;	/* the current row has a result */
+} batchState;
+
+/*
+ * Record the result r of row s->received + 1 in the tables at indices
+ * 2 (counts), 3 (errors) and 4 (results, if it is not nil) of the
+ * protected call; 6 is the type table of the connection.
+ */
+static void
+batch_result(lua_State *L, batchState *s, PGresult *r)
 {
-	lua_pushinteger(L,
-	    PQparamtype(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE),
-	    luaL_checkinteger(L, 2)) - 1);
-	return 1;
+	PGresult **res;
+	int row;
+
+	row = s->received + 1;
+	switch (PQresultStatus(r)) {
+	case PGRES_COMMAND_OK:
+	case PGRES_TUPLES_OK:
+		pgsql_pushint64(L, strtoll(PQcmdTuples(r), NULL, 10));
+		lua_rawseti(L, 2, row);
+		if (!lua_isnil(L, 4)) {
+			res = pgsql_res_new(L, 0);
+			*res = r;
+			lua_pushvalue(L, 6);
+			lua_setuservalue(L, -2);
+			lua_rawseti(L, 4, row);
+			return;
+		}
+		break;
+#ifdef LIBPQ_HAS_PIPELINING
+	case PGRES_PIPELINE_ABORTED:
+		lua_pushboolean(L, 0);
+		lua_rawseti(L, 2, row);
+		lua_pushliteral(L, "aborted by an earlier error in the batch");
+		lua_rawseti(L, 3, row);
+		break;
+#endif
+	default:
+		lua_pushboolean(L, 0);
+		lua_rawseti(L, 2, row);
+		lua_pushstring(L, r != NULL ? PQresultErrorMessage(r) :
+		    PQerrorMessage(s->conn));
+		lua_rawseti(L, 3, row);
+	}
+	PQclear(r);
 }
 
-static int
-res_cmdStatus(lua_State *L)
+/* Push the parameters of row n and encode them into the arrays */
+static void
+batch_encode(lua_State *L, batchState *s, int n, char **values,
+    int *lengths, int *formats, uint64_t *scratch)
 {
-	lua_pushstring(L,
-	    PQcmdStatus(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
-	return 1;
+	int base, k;
+
+	lua_rawgeti(L, 1, n);
+	if (!lua_istable(L, -1))
+		luaL_error(L, "row %d is not a table", n);
+	base = lua_gettop(L);
+	for (k = 0; k < s->nparams; k++)
+		lua_rawgeti(L, base, k + 1);
+	for (k = 0; k < s->nparams; k++)
+		stmt_encode(L, base + k + 1, 6, s->types[k], &values[k],
+		    &lengths[k], &formats[k], &scratch[k]);
 }
 
-static int
-res_cmdTuples(lua_State *L)
+#ifdef LIBPQ_HAS_PIPELINING
+/*
+ * Take a result of the pipeline; rows are counted when their NULL
+ * result arrives.  Without L, results are discarded.
+ */
+static void
+batch_take(lua_State *L, batchState *s, PGresult *r)
 {
-	lua_pushstring(L,
-	    PQcmdTuples(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
-	return 1;
+	if (r == NULL) {
+		if (s->answered) {
+			s->received++;
+			s->answered = 0;
+		}
+		return;
+	}
+	if (PQresultStatus(r) == PGRES_PIPELINE_SYNC) {
+		s->syncs--;
+		PQclear(r);
+		return;
+	}
+	s->answered = 1;
+	if (L != NULL)
+		batch_result(L, s, r);
+	else
+		PQclear(r);
 }
 
+/* Run in protected mode: rows, counts, errors, results, state, types */
 static int
-res_oidValue(lua_State *L)
+batch_pipeline(lua_State *L)
 {
-	lua_pushinteger(L,
-	    PQoidValue(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
-	return 1;
+	batchState *s;
+	char **values;
+	int *lengths, *formats;
+	uint64_t *scratch;
+	struct pollfd pfd;
+	int nrows, top, flush;
+
+	s = lua_touserdata(L, 5);
+	nrows = lua_rawlen(L, 1);
+	values = lua_newuserdata(L, s->nparams * (sizeof(char *) +
+	    2 * sizeof(int) + sizeof(uint64_t)) + 1);
+	scratch = (uint64_t *)values;
+	values = (char **)(scratch + s->nparams);
+	lengths = (int *)(values + s->nparams);
+	formats = lengths + s->nparams;
+	top = lua_gettop(L);
+
+	for (;;) {
+		flush = 0;
+		while (s->sent < nrows && s->sent - s->received <
+		    BATCH_WINDOW) {
+			batch_encode(L, s, s->sent + 1, values, lengths,
+			    formats, scratch);
+			if (!PQsendQueryPrepared(s->conn, s->name, s->nparams,
+			    (const char * const *)values, lengths, formats, 0))
+				return luaL_error(L, "%s",
+				    PQerrorMessage(s->conn));
+			lua_settop(L, top);
+			s->sent++;
+			if (s->sent % s->sync == 0 || s->sent == nrows) {
+				if (!PQpipelineSync(s->conn))
+					return luaL_error(L, "%s",
+					    PQerrorMessage(s->conn));
+				s->syncs++;
+			}
+			if ((flush = PQflush(s->conn)) != 0)
+				break;
+		}
+		if (flush == 0)
+			flush = PQflush(s->conn);
+		if (flush == -1 || !PQconsumeInput(s->conn))
+			return luaL_error(L, "%s", PQerrorMessage(s->conn));
+		while ((s->received < s->sent || s->syncs > 0) &&
+		    !PQisBusy(s->conn))
+			batch_take(L, s, PQgetResult(s->conn));
+		if (s->received == nrows && s->syncs == 0)
+			return 0;
+
+		/* wait unless more rows can be sent right away */
+		if (flush == 1 || s->sent == nrows || s->sent - s->received >=
+		    BATCH_WINDOW) {
+			pfd.fd = PQsocket(s->conn);
+			pfd.events = POLLIN | (flush == 1 ? POLLOUT : 0);
+			if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+				return luaL_error(L, "%s", strerror(errno));
+		}
+	}
 }
 
-static int
-res_oidStatus(lua_State *L)
+/* After an error: close the pipeline, read what is left and leave */
+static void
+batch_drain(batchState *s)
 {
-	lua_pushstring(L,
-	    PQoidStatus(*(PGresult **)luaL_checkudata(L, 1, RES_METATABLE)));
-	return 1;
+	PGresult *r;
+
+	if (PQpipelineStatus(s->conn) == PQ_PIPELINE_OFF)
+		return;
+	PQsetnonblocking(s->conn, 0);
+	if (s->sent % s->sync != 0 && PQpipelineSync(s->conn))
+		s->syncs++;
+	PQflush(s->conn);
+	while (s->received < s->sent || s->syncs > 0) {
+		r = PQgetResult(s->conn);
+		if (r == NULL && PQstatus(s->conn) == CONNECTION_BAD)
+			break;
+		batch_take(NULL, s, r);
+	}
+	PQexitPipelineMode(s->conn);
 }
+#endif
 
+/* Without pipelining, every row is a round trip of its own */
 static int
-res_clear(lua_State *L)
+batch_serial(lua_State *L)
 {
-	PGresult **r;
-
-	r = luaL_checkudata(L, 1, RES_METATABLE);
-	if (r && *r)  {
-		PQclear(*r);
-		*r = NULL;
+	batchState *s;
+	char **values;
+	int *lengths, *formats;
+	uint64_t *scratch;
+	int nrows, top;
+
+	s = lua_touserdata(L, 5);
+	nrows = lua_rawlen(L, 1);
+	values = lua_newuserdata(L, s->nparams * (sizeof(char *) +
+	    2 * sizeof(int) + sizeof(uint64_t)) + 1);
+	scratch = (uint64_t *)values;
+	values = (char **)(scratch + s->nparams);
+	lengths = (int *)(values + s->nparams);
+	formats = lengths + s->nparams;
+	top = lua_gettop(L);
+	for (; s->received < nrows; s->received++) {
+		batch_encode(L, s, s->received + 1, values, lengths, formats,
+		    scratch);
+		batch_result(L, s, PQexecPrepared(s->conn, s->name,
+		    s->nparams, (const char * const *)values, lengths, formats,
+		    0));
+		lua_settop(L, top);
 	}
 	return 0;
 }
 
 /*
- * Notifies methods (objects returned by conn:notifies())
+ * conn:execPreparedBatch(name, rows [, opts]) returns an array with
+ * the number of rows affected by each execution, false where it
+ * failed, and an array of error messages for the failed rows or nil.
+ * With opts.results, a third array holds the result objects.
  */
 static int
-notify_relname(lua_State *L)
-{
-	PGnotify **n;
-
-	n = luaL_checkudata(L, 1, NOTIFY_METATABLE);
-	lua_pushstring(L, (*n)->relname);
-	return 1;
-}
-
-static int
-notify_pid(lua_State *L)
-{
-	PGnotify **n;
-
-	n = luaL_checkudata(L, 1, NOTIFY_METATABLE);
-	lua_pushinteger(L, (*n)->be_pid);
-	return 1;
-}
-
-static int
-notify_extra(lua_State *L)
+conn_execPreparedBatch(lua_State *L)
 {
-	PGnotify **n;
+	batchState s;
+	PGresult *r;
+	lua_CFunction run;
+	int n, status, results = 0;
+#ifdef LIBPQ_HAS_PIPELINING
+	int nonblocking;
+#endif
 
-	n = luaL_checkudata(L, 1, NOTIFY_METATABLE);
-	lua_pushstring(L, (*n)->extra);
-	return 1;
-}
+	memset(&s, 0, sizeof s);
+	s.conn = pgsql_conn_query(L, 1);
+	s.name = luaL_checkstring(L, 2);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	s.sync = BATCH_SYNC;
+	lua_settop(L, 4);
+	if (!lua_isnil(L, 4)) {
+		luaL_checktype(L, 4, LUA_TTABLE);
+		lua_getfield(L, 4, "sync");
+		if (!lua_isnil(L, -1)) {
+			s.sync = luaL_checkinteger(L, -1);
+			luaL_argcheck(L, s.sync > 0, 4, "sync must be positive");
+		}
+		lua_getfield(L, 4, "results");
+		results = lua_toboolean(L, -1);
+		lua_pop(L, 2);
+	}
 
-static int
-notify_clear(lua_State *L)
-{
-	PGnotify **n;
+	r = PQdescribePrepared(s.conn, s.name);
+	if (PQresultStatus(r) != PGRES_COMMAND_OK) {
+		lua_pushnil(L);
+		lua_pushstring(L, r != NULL ? PQresultErrorMessage(r) :
+		    PQerrorMessage(s.conn));
+		PQclear(r);
+		return 2;
+	}
+	s.nparams = PQnparams(r);
+	s.types = lua_newuserdata(L, (s.nparams + 1) * sizeof(Oid));
+	for (n = 0; n < s.nparams; n++)
+		s.types[n] = PQparamtype(r, n);
+	PQclear(r);
+	tx_flush(L, 1);
+
+	run = batch_serial;
+#ifdef LIBPQ_HAS_PIPELINING
+	nonblocking = PQisnonblocking(s.conn);
+	if (PQenterPipelineMode(s.conn)) {
+		if (PQsetnonblocking(s.conn, 1) == 0)
+			run = batch_pipeline;
+		else
+			PQexitPipelineMode(s.conn);
+	}
+#endif
 
-	n = luaL_checkudata(L, 1, NOTIFY_METATABLE);
-	if (*n)  {
-		PQfreemem(*n);
-		*n = NULL;
+	lua_newtable(L);
+	lua_newtable(L);
+	if (results)
+		lua_newtable(L);
+	else
+		lua_pushnil(L);
+	lua_pushcfunction(L, run);
+	lua_pushvalue(L, 3);
+	lua_pushvalue(L, 6);
+	lua_pushvalue(L, 7);
+	lua_pushvalue(L, 8);
+	lua_pushlightuserdata(L, &s);
+	conn_types(L, 1);
+	status = lua_pcall(L, 6, 0, 0);
+#ifdef LIBPQ_HAS_PIPELINING
+	if (run == batch_pipeline) {
+		if (status != 0)
+			batch_drain(&s);
+		else
+			PQexitPipelineMode(s.conn);
+		PQsetnonblocking(s.conn, nonblocking);
 	}
-	return 0;
+#endif
+	if (status != 0)
+		return lua_error(L);
+	lua_pushnil(L);
+	if (lua_next(L, 7))
+		lua_pop(L, 2);
+	else {
+		lua_pushnil(L);
+		lua_replace(L, 7);
+	}
+	return 3;
 }
 
 /*
  * Large object functions
  */
+static largeObject **
+pgsql_lo_check(lua_State *L, int n)
+{
+	largeObject **o;
+
+	o = luaL_checkudata(L, n, LO_METATABLE);
+	luaL_argcheck(L, *o != NULL, n, "large object is closed");
+	cursor_drain(L, (*o)->conn);
+	return o;
+}
+
 static int
 pgsql_lo_write(lua_State *L)
 {
@@ -1588,7 +10420,7 @@ pgsql_lo_write(lua_State *L)
 	const char *s;
 	size_t len;
 
-	o = luaL_checkudata(L, 1, LO_METATABLE);
+	o = pgsql_lo_check(L, 1);
 	s = lua_tolstring(L, 2, &len);
 	lua_pushinteger(L, lo_write((*o)->conn, (*o)->fd, s, len));
 	return 1;
@@ -1598,13 +10430,20 @@ static int
 pgsql_lo_read(lua_State *L)
 {
 	largeObject **o;
+	lua_Integer len;
+	char *buf;
 	int res;
-	char buf[256];	/* arbitrary size */
 
-	o = luaL_checkudata(L, 1, LO_METATABLE);
-	/* XXX don't hard code the buffer size */
-	res = lo_read((*o)->conn, (*o)->fd, buf, sizeof buf);
-	lua_pushstring(L, buf);
+	o = pgsql_lo_check(L, 1);
+	len = luaL_optinteger(L, 2, 256);
+	luaL_argcheck(L, len > 0 && len <= INT_MAX, 2,
+	    "length must be positive");
+	buf = malloc(len);
+	if (buf == NULL)
+		return luaL_error(L, "out of memory");
+	res = lo_read((*o)->conn, (*o)->fd, buf, len);
+	lua_pushlstring(L, buf, res > 0 ? res : 0);
+	free(buf);
 	lua_pushinteger(L, res);
 	return 2;
 }
@@ -1614,7 +10453,7 @@ pgsql_lo_lseek(lua_State *L)
 {
 	largeObject **o;
 
-	o = luaL_checkudata(L, 1, LO_METATABLE);
+	o = pgsql_lo_check(L, 1);
 	lua_pushinteger(L, lo_lseek((*o)->conn, (*o)->fd,
 	    luaL_checkinteger(L, 2), luaL_checkinteger(L, 3)));
 	return 1;
@@ -1625,7 +10464,7 @@ pgsql_lo_tell(lua_State *L)
 {
 	largeObject **o;
 
-	o = luaL_checkudata(L, 1, LO_METATABLE);
+	o = pgsql_lo_check(L, 1);
 	lua_pushinteger(L, lo_tell((*o)->conn, (*o)->fd));
 	return 1;
 }
@@ -1635,7 +10474,7 @@ pgsql_lo_truncate(lua_State *L)
 {
 	largeObject **o;
 
-	o = luaL_checkudata(L, 1, LO_METATABLE);
+	o = pgsql_lo_check(L, 1);
 	lua_pushinteger(L, lo_truncate((*o)->conn, (*o)->fd,
 	    luaL_checkinteger(L, 2)));
 	return 1;
@@ -1646,8 +10485,9 @@ pgsql_lo_close(lua_State *L)
 {
 	largeObject **o;
 
-	o = luaL_checkudata(L, 1, LO_METATABLE);
+	o = pgsql_lo_check(L, 1);
 	lua_pushinteger(L, lo_close((*o)->conn, (*o)->fd));
+	free(*o);
 	*o = NULL;	/* prevent close during garbage collection time */
 	return 1;
 }
@@ -1660,6 +10500,7 @@ pgsql_lo_clear(lua_State *L)
 	o = luaL_checkudata(L, 1, LO_METATABLE);
 	if (*o)  {
 		lo_close((*o)->conn, (*o)->fd);
+		free(*o);
 		*o = NULL;
 	}
 	return 0;
@@ -1740,6 +10581,14 @@ static struct constant pgsql_constant[] = {
 	{ "PQPING_NO_ATTEMPT",		PQPING_NO_ATTEMPT },
 #endif
 
+#ifdef LUAPGSQL_BENCH
+	/* PQcopyResult flags */
+	{ "PG_COPYRES_ATTRS",		PG_COPYRES_ATTRS },
+	{ "PG_COPYRES_TUPLES",		PG_COPYRES_TUPLES },
+	{ "PG_COPYRES_EVENTS",		PG_COPYRES_EVENTS },
+	{ "PG_COPYRES_NOTICEHOOKS",	PG_COPYRES_NOTICEHOOKS },
+#endif
+
 	/* Large objects */
 	{ "INV_READ",			INV_READ },
 	{ "INV_WRITE",			INV_WRITE },
@@ -1778,6 +10627,10 @@ luaopen_pgsql(lua_State *L)
 		{ "ping", pgsql_ping },
 #endif
 		{ "encryptPassword", pgsql_encryptPassword },
+		{ "setThreads", pgsql_setThreads },
+		{ "group", pgsql_group },
+		{ "numeric", pgsql_numeric },
+		{ "registerCodec", pgsql_registerCodec },
 		{ NULL, NULL }
 	};
 
@@ -1808,6 +10661,17 @@ luaopen_pgsql(lua_State *L)
 		{ "connectionNeedsPassword", conn_connectionNeedsPassword },
 		{ "connectionUsedPassword", conn_connectionUsedPassword },
 
+		/* Resilient connections */
+		{ "setResilient", conn_setResilient },
+		{ "set", conn_set },
+
+		/* Query deadlines */
+		{ "setTimeout", conn_setTimeout },
+		{ "setExplain", conn_setExplain },
+		{ "explains", conn_explains },
+		{ "setCompositeDecoding", conn_setCompositeDecoding },
+		{ "warmup", conn_warmup },
+
 		/* Command Execution Functions */
 		{ "escapeString", conn_escapeString },
 		{ "escapeLiteral", conn_escapeLiteral },
@@ -1818,8 +10682,13 @@ luaopen_pgsql(lua_State *L)
 		{ "execParams", conn_execParams },
 		{ "prepare", conn_prepare },
 		{ "execPrepared", conn_execPrepared },
+		{ "execPreparedBatch", conn_execPreparedBatch },
 		{ "describePrepared", conn_describePrepared },
 		{ "describePortal", conn_describePortal },
+		{ "prepareStatement", conn_prepareStatement },
+		{ "execSpilled", conn_execSpilled },
+		{ "execAsync", conn_execAsync },
+		{ "transaction", conn_transaction },
 
 		/* Asynchronous command processing */
 		{ "sendQuery", conn_sendQuery },
@@ -1844,12 +10713,25 @@ luaopen_pgsql(lua_State *L)
 		{ "putCopyEnd", conn_putCopyEnd },
 		{ "getCopyData", conn_getCopyData },
 
+		/* Result cache */
+		{ "resultCache", conn_resultCache },
+
+		/* Logical replication */
+		{ "replicationStream", conn_replicationStream },
+
+		/* Server side cursors */
+		{ "cursor", conn_cursor },
+
 		/* Control Functions */
 		{ "clientEncoding", conn_clientEncoding },
 		{ "setClientEncoding", conn_setClientEncoding },
 		{ "setErrorVerbosity", conn_setErrorVerbosity },
 		{ "trace", conn_trace },
 		{ "untrace", conn_untrace },
+#ifdef LIBPQ_HAS_TRACE_FLAGS
+		{ "traceBuffer", conn_traceBuffer },
+		{ "traceDump", conn_traceDump },
+#endif
 
 		/* Miscellaneous Functions */
 		{ "consumeInput", conn_consumeInput },
@@ -1857,6 +10739,9 @@ luaopen_pgsql(lua_State *L)
 		{ "setnonblocking", conn_setnonblocking },
 		{ "isnonblocking", conn_isnonblocking },
 		{ "flush", conn_flush },
+#ifdef LUAPGSQL_BENCH
+		{ "makeEmptyPGresult", conn_makeEmptyPGresult },
+#endif
 
 		/* Notice processing */
 		{ "setNoticeReceiver", conn_setNoticeReceiver },
@@ -1892,6 +10777,12 @@ luaopen_pgsql(lua_State *L)
 		{ "getvalue", res_getvalue },
 		{ "getisnull", res_getisnull },
 		{ "getlength", res_getlength },
+		{ "row", res_row },
+		{ "rows", res_rows },
+		{ "pack", res_pack },
+		{ "slice", res_slice },
+		{ "toCSV", res_toCSV },
+		{ "writeCSV", res_writeCSV },
 		{ "nparams", res_nparams },
 		{ "paramtype", res_paramtype },
 
@@ -1900,6 +10791,14 @@ luaopen_pgsql(lua_State *L)
 		{ "cmdTuples", res_cmdTuples },
 		{ "oidValue", res_oidValue },
 		{ "oidStatus", res_oidStatus },
+		{ "memorySize", res_memorySize },
+#ifdef LUAPGSQL_BENCH
+
+		/* Result construction */
+		{ "copyResult", res_copyResult },
+		{ "setResultAttrs", res_setResultAttrs },
+		{ "setvalue", res_setvalue },
+#endif
 		{ NULL, NULL }
 	};
 	struct luaL_Reg notify_methods[] = {
@@ -1908,6 +10807,101 @@ luaopen_pgsql(lua_State *L)
 		{ "extra", notify_extra },
 		{ NULL, NULL }
 	};
+	struct luaL_Reg cursor_methods[] = {
+		{ "fetch", cursor_fetch },
+		{ "rows", cursor_rows },
+		{ "close", cursor_close },
+		{ NULL, NULL }
+	};
+	struct luaL_Reg stmt_methods[] = {
+		{ "exec", stmt_exec },
+		{ "name", stmt_name },
+		{ "nparams", stmt_nparams },
+		{ "paramtype", stmt_paramtype },
+		{ "nfields", stmt_nfields },
+		{ "fname", stmt_fname },
+		{ "ftype", stmt_ftype },
+		{ "close", stmt_close },
+		{ NULL, NULL }
+	};
+	struct luaL_Reg future_methods[] = {
+		{ "ready", future_ready },
+		{ "wait", future_wait },
+		{ "result", future_result },
+		{ NULL, NULL }
+	};
+	struct luaL_Reg packed_methods[] = {
+		{ "get", packed_get },
+		{ "ntuples", packed_ntuples },
+		{ "nfields", packed_nfields },
+		{ NULL, NULL }
+	};
+	struct luaL_Reg spill_methods[] = {
+		{ "ntuples", spill_ntuples },
+		{ "nfields", spill_nfields },
+		{ "fname", spill_fname },
+		{ "fnumber", spill_fnumber },
+		{ "ftype", spill_ftype },
+		{ "fformat", spill_fformat },
+		{ "fmod", spill_fmod },
+		{ "getvalue", spill_getvalue },
+		{ "getisnull", spill_getisnull },
+		{ "getlength", spill_getlength },
+		{ "get", spill_get },
+		{ "clear", spill_clear },
+		{ NULL, NULL }
+	};
+	struct luaL_Reg slice_methods[] = {
+		{ "len", slice_len },
+		{ "sub", slice_sub },
+		{ "write", slice_write },
+		{ NULL, NULL }
+	};
+	struct luaL_Reg group_methods[] = {
+		{ "exec", group_exec },
+		{ "execParams", group_execParams },
+		{ "execAsync", group_execAsync },
+		{ "reader", group_reader },
+		{ "primary", group_primary },
+		{ "refresh", group_refresh },
+		{ NULL, NULL }
+	};
+	struct luaL_Reg repl_methods[] = {
+		{ "poll", repl_poll },
+		{ "ack", repl_ack },
+		{ "sendFeedback", repl_sendFeedback },
+		{ "flushedLsn", repl_flushedLsn },
+		{ "socket", repl_socket },
+		{ "stop", repl_stop },
+		{ NULL, NULL }
+	};
+	struct luaL_Reg cache_methods[] = {
+		{ "exec", cache_exec },
+		{ "execParams", cache_execParams },
+		{ "invalidate", cache_invalidate },
+		{ "poll", cache_poll },
+		{ "stats", cache_stats },
+		{ NULL, NULL }
+	};
+	struct luaL_Reg numeric_methods[] = {
+		{ "add", numeric_add_ },
+		{ "sub", numeric_sub },
+		{ "mul", numeric_mul_ },
+		{ "cmp", numeric_compare },
+		{ "round", numeric_round_ },
+		{ "scale", numeric_scale },
+		{ "tonumber", numeric_tonumber },
+		{ "tostring", numeric_tostring },
+		{ "__add", numeric_add_ },
+		{ "__sub", numeric_sub },
+		{ "__mul", numeric_mul_ },
+		{ "__unm", numeric_unm },
+		{ "__eq", numeric_eq },
+		{ "__lt", numeric_lt },
+		{ "__le", numeric_le },
+		{ "__tostring", numeric_tostring },
+		{ NULL, NULL }
+	};
 	struct luaL_Reg lo_methods[] = {
 		{ "write", pgsql_lo_write },
 		{ "read", pgsql_lo_read },
@@ -1927,6 +10921,11 @@ luaopen_pgsql(lua_State *L)
 		lua_pushliteral(L, "__gc");
 		lua_pushcfunction(L, conn_finish);
 		lua_settable(L, -3);
+#if LUA_VERSION_NUM >= 504
+		lua_pushliteral(L, "__close");
+		lua_pushcfunction(L, conn_finish);
+		lua_settable(L, -3);
+#endif
 
 		lua_pushliteral(L, "__index");
 		lua_pushvalue(L, -2);
@@ -1947,6 +10946,11 @@ luaopen_pgsql(lua_State *L)
 		lua_pushliteral(L, "__gc");
 		lua_pushcfunction(L, res_clear);
 		lua_settable(L, -3);
+#if LUA_VERSION_NUM >= 504
+		lua_pushliteral(L, "__close");
+		lua_pushcfunction(L, res_clear);
+		lua_settable(L, -3);
+#endif
 
 		lua_pushliteral(L, "__index");
 		lua_pushvalue(L, -2);
@@ -1978,6 +10982,299 @@ luaopen_pgsql(lua_State *L)
 	}
 	lua_pop(L, 1);
 
+	if (luaL_newmetatable(L, ROW_METATABLE)) {
+		lua_pushliteral(L, "__index");
+		lua_pushcfunction(L, row_index);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__len");
+		lua_pushcfunction(L, row_len);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__pairs");
+		lua_pushcfunction(L, row_pairs);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, PACKED_METATABLE)) {
+#if LUA_VERSION_NUM >= 502
+		luaL_setfuncs(L, packed_methods, 0);
+#else
+		luaL_register(L, NULL, packed_methods);
+#endif
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, packed_clear);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__len");
+		lua_pushcfunction(L, packed_ntuples);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, SPILL_METATABLE)) {
+#if LUA_VERSION_NUM >= 502
+		luaL_setfuncs(L, spill_methods, 0);
+#else
+		luaL_register(L, NULL, spill_methods);
+#endif
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, spill_clear);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__len");
+		lua_pushcfunction(L, spill_ntuples);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, SLICE_METATABLE)) {
+#if LUA_VERSION_NUM >= 502
+		luaL_setfuncs(L, slice_methods, 0);
+#else
+		luaL_register(L, NULL, slice_methods);
+#endif
+		lua_pushliteral(L, "__len");
+		lua_pushcfunction(L, slice_len);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__tostring");
+		lua_pushcfunction(L, slice_tostring);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, GROUP_METATABLE)) {
+#if LUA_VERSION_NUM >= 502
+		luaL_setfuncs(L, group_methods, 0);
+#else
+		luaL_register(L, NULL, group_methods);
+#endif
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, REPL_METATABLE)) {
+#if LUA_VERSION_NUM >= 502
+		luaL_setfuncs(L, repl_methods, 0);
+#else
+		luaL_register(L, NULL, repl_methods);
+#endif
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, CACHE_METATABLE)) {
+#if LUA_VERSION_NUM >= 502
+		luaL_setfuncs(L, cache_methods, 0);
+#else
+		luaL_register(L, NULL, cache_methods);
+#endif
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, NUMERIC_METATABLE)) {
+#if LUA_VERSION_NUM >= 502
+		luaL_setfuncs(L, numeric_methods, 0);
+#else
+		luaL_register(L, NULL, numeric_methods);
+#endif
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, CURSOR_METATABLE)) {
+#if LUA_VERSION_NUM >= 502
+		luaL_setfuncs(L, cursor_methods, 0);
+#else
+		luaL_register(L, NULL, cursor_methods);
+#endif
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, cursor_clear);
+		lua_settable(L, -3);
+#if LUA_VERSION_NUM >= 504
+		lua_pushliteral(L, "__close");
+		lua_pushcfunction(L, cursor_close);
+		lua_settable(L, -3);
+#endif
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, STMT_METATABLE)) {
+#if LUA_VERSION_NUM >= 502
+		luaL_setfuncs(L, stmt_methods, 0);
+#else
+		luaL_register(L, NULL, stmt_methods);
+#endif
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, stmt_clear);
+		lua_settable(L, -3);
+#if LUA_VERSION_NUM >= 504
+		lua_pushliteral(L, "__close");
+		lua_pushcfunction(L, stmt_close);
+		lua_settable(L, -3);
+#endif
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+#ifdef LIBPQ_HAS_TRACE_FLAGS
+	if (luaL_newmetatable(L, TRACE_METATABLE)) {
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, trace_clear);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+#endif
+	if (luaL_newmetatable(L, CANCEL_METATABLE)) {
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, cancel_clear);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, LUA_REGISTRYINDEX, CODECS_REGISTRY);
+	if (lua_isnil(L, -1)) {
+		lua_newtable(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, CODECS_REGISTRY);
+	}
+	lua_pop(L, 1);
+	lua_getfield(L, LUA_REGISTRYINDEX, COUNTERS_REGISTRY);
+	if (lua_isnil(L, -1)) {
+		memset(lua_newuserdata(L, sizeof(stateCounters)), 0,
+		    sizeof(stateCounters));
+		lua_setfield(L, LUA_REGISTRYINDEX, COUNTERS_REGISTRY);
+	}
+	lua_pop(L, 1);
+
+	/* weak, a cursor that is collected releases its own FETCH */
+	lua_getfield(L, LUA_REGISTRYINDEX, CURSORS_REGISTRY);
+	if (lua_isnil(L, -1)) {
+		lua_newtable(L);
+		lua_createtable(L, 0, 1);
+		lua_pushliteral(L, "v");
+		lua_setfield(L, -2, "__mode");
+		lua_setmetatable(L, -2);
+		lua_setfield(L, LUA_REGISTRYINDEX, CURSORS_REGISTRY);
+	}
+	lua_pop(L, 1);
+
+	/*
+	 * Our threads must be gone before the module is unloaded, a
+	 * userdata in the registry stops them when the state is closed.
+	 */
+	lua_getfield(L, LUA_REGISTRYINDEX, THREADS_METATABLE);
+	if (lua_isnil(L, -1)) {
+		lua_newuserdata(L, 1);
+		lua_newtable(L);
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, threads_release);
+		lua_settable(L, -3);
+		lua_setmetatable(L, -2);
+		lua_setfield(L, LUA_REGISTRYINDEX, THREADS_METATABLE);
+		pthread_mutex_lock(&pool_lock);
+		threads_users++;
+		pthread_mutex_unlock(&pool_lock);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, FUTURE_METATABLE)) {
+#if LUA_VERSION_NUM >= 502
+		luaL_setfuncs(L, future_methods, 0);
+#else
+		luaL_register(L, NULL, future_methods);
+#endif
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, future_clear);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
 	if (luaL_newmetatable(L, LO_METATABLE)) {
 #if LUA_VERSION_NUM >= 502
 		luaL_setfuncs(L, lo_methods, 0);
@@ -1987,6 +11284,11 @@ luaopen_pgsql(lua_State *L)
 		lua_pushliteral(L, "__gc");
 		lua_pushcfunction(L, pgsql_lo_clear);
 		lua_settable(L, -3);
+#if LUA_VERSION_NUM >= 504
+		lua_pushliteral(L, "__close");
+		lua_pushcfunction(L, pgsql_lo_clear);
+		lua_settable(L, -3);
+#endif
 
 		lua_pushliteral(L, "__index");
 		lua_pushvalue(L, -2);
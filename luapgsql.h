@@ -34,12 +34,269 @@
 #define RES_METATABLE		"pgsql result methods"
 #define NOTIFY_METATABLE	"pgsql asychronous notification methods"
 #define LO_METATABLE		"pgsql large object methods"
+#define CURSOR_METATABLE	"pgsql cursor methods"
+#define ROW_METATABLE		"pgsql row methods"
+#define STMT_METATABLE		"pgsql statement methods"
+#define CANCEL_METATABLE	"pgsql cancel handle"
+#define THREADS_METATABLE	"pgsql threads"
+#define FUTURE_METATABLE	"pgsql future methods"
+#define PACKED_METATABLE	"pgsql packed result methods"
+#define SPILL_METATABLE		"pgsql spilled result methods"
+#define TRACE_METATABLE		"pgsql trace ring"
+#define SLICE_METATABLE		"pgsql value slice methods"
+#define GROUP_METATABLE		"pgsql connection group methods"
+#define REPL_METATABLE		"pgsql replication stream methods"
+#define CACHE_METATABLE		"pgsql result cache methods"
+#define NUMERIC_METATABLE	"pgsql numeric methods"
+
+/* Registry table of type codecs, see pgsql.registerCodec() */
+#define CODECS_REGISTRY		"pgsql codecs"
+
+/* Registry userdata with the per state counters, see stateCounters */
+#define COUNTERS_REGISTRY	"pgsql state counters"
+
+/* Registry table of cursors with a FETCH in flight, by PGconn */
+#define CURSORS_REGISTRY	"pgsql pending fetches"
 
 /* OIDs from server/pg_type.h */
 #define BOOLOID			16
+#define BYTEAOID		17
+#define NAMEOID			19
 #define INT8OID			20
+#define INT2OID			21
+#define INT4OID			23
 #define TEXTOID			25
+#define OIDOID			26
+#define FLOAT4OID		700
 #define FLOAT8OID		701
+#define BPCHAROID		1042
+#define VARCHAROID		1043
+#define DATEOID			1082
+#define TIMEOID			1083
+#define TIMESTAMPOID		1114
+#define TIMESTAMPTZOID		1184
+#define INTERVALOID		1186
+#define NUMERICOID		1700
+#define RECORDOID		2249
+
+/* Converts a field value to a Lua value */
+typedef void (*pgsql_decoder)(lua_State *, const char *, int);
+
+/* Query parameters as passed to PQexecParams() and friends */
+typedef struct sqlParams {
+	int	  n;
+	Oid	 *types;
+	char	**values;
+	int	 *lengths;
+	int	 *formats;
+} sqlParams;
+
+/* Server side cursor, see conn:cursor() */
+typedef struct cursor {
+	PGconn		**conn;		/* of the connection userdata */
+	PGresult	 *res;		/* current batch */
+	PGresult	 *ahead;	/* next batch, collected early */
+	int		  row;		/* next row in current batch */
+	int		  fetch;	/* rows per FETCH */
+	int		  hold;		/* declared WITH HOLD */
+	int		  pending;	/* a FETCH is in flight */
+	int		  done;		/* no more FETCHes to send */
+	int		  closed;
+	char		  name[32];
+} cursor;
+
+/* Row of a result, see res:row() */
+typedef struct resRow {
+	PGresult	**res;		/* of the result userdata */
+	int		  row;
+} resRow;
+
+/* Prepared statement, see conn:prepareStatement() */
+typedef struct statement {
+	PGconn		**conn;		/* of the connection userdata */
+	char		 *name;		/* NULL once closed */
+	int		  nparams;
+	Oid		 *paramTypes;
+	int		  nfields;
+	int		  format;	/* of the results */
+	pgsql_decoder	 *decoders;	/* per result column */
+} statement;
+
+/* Cached cancel handle of a connection */
+typedef struct cancelHandle {
+	PGcancel	*cancel;
+	int		 pid;		/* backend the handle belongs to */
+} cancelHandle;
+
+/* Point in time at which the watchdog cancels a running query */
+typedef struct deadline {
+	struct deadline	*next;
+	PGcancel	*cancel;
+	struct timespec	 at;
+	int		 fired;
+	int		 firing;	/* the cancel request is being sent */
+} deadline;
+
+/* Notice raised while a future's query runs, kept for the Lua thread */
+typedef struct futureNotice {
+	struct futureNotice	*next;
+	char			 message[1];
+} futureNotice;
+
+/* Query running in the thread pool, see conn:execAsync() */
+typedef struct future {
+	struct future	*next;		/* in the queue */
+	PGconn		**connp;	/* of the connection userdata */
+	PGconn		 *conn;		/* detached while the query runs */
+	char		 *command;
+	sqlParams	  params;
+	PGcancel	 *cancel;	/* own copy for the deadline, if any */
+	long		  timeout;
+	PGresult	 *res;
+	PQnoticeReceiver  receiver;	/* of the connection */
+	futureNotice	 *notices, *last;
+	int		  done;		/* the query has finished */
+	int		  collected;	/* the connection is attached again */
+} future;
+
+/* Field value in the memory of a result, see res:slice() */
+typedef struct valueSlice {
+	PGresult	**res;		/* of the result userdata */
+	const char	 *data;
+	size_t		  len;
+} valueSlice;
+
+/* Column of a packed result, see res:pack() */
+#define PACKED_STRING	0	/* converted from the PGresult on access */
+#define PACKED_BOOL	1
+#define PACKED_INT	2
+#define PACKED_FLOAT	3
+
+typedef struct packedColumn {
+	int		 kind;
+	unsigned char	*isnull;	/* per row */
+	union {
+		unsigned char	*b;
+		int64_t		*i;
+		double		*d;
+	} v;
+} packedColumn;
+
+typedef struct packedResult {
+	PGresult	**res;		/* of the result userdata */
+	int		  ntuples;
+	int		  nfields;
+	packedColumn	 *columns;	/* NULL once cleared */
+} packedResult;
+
+/* Result in a memory mapped file, see conn:execSpilled() */
+typedef struct spilledResult {
+	const char	*map;		/* NULL once cleared */
+	size_t		 size;
+	const uint64_t	*rows;		/* offsets of the rows in map */
+	int		 ntuples;
+	int		 nfields;
+	Oid		*types;		/* the formats and mods follow */
+	int		*formats;
+	int		*mods;
+} spilledResult;
+
+/* Protocol message in the trace ring, see conn:traceBuffer() */
+typedef struct traceEvent {
+	uint64_t	at;		/* microseconds since the epoch */
+	uint32_t	size;		/* length field of the message */
+	uint32_t	statement;
+	unsigned char	message;	/* index into trace_messages */
+	char		from;		/* 'F' frontend, 'B' backend */
+} traceEvent;
+
+/* Sync points not answered yet, beyond that they are merged */
+#define TRACE_MARKS	64
+
+typedef struct traceRing {
+	PGconn		**conn;		/* NULL once detached */
+	FILE		 *f;		/* libpq traces to this stream */
+	traceEvent	 *events;
+	uint32_t	  size;
+	uint32_t	  next;
+	uint32_t	  count;
+	uint32_t	  sent;		/* statements */
+	uint32_t	  answered;
+	uint32_t	  marks[TRACE_MARKS];	/* statements sent before syncs */
+	int		  mark;		/* the oldest */
+	int		  nmarks;
+	char		  last;		/* type of the last frontend message */
+
+	/* the line being parsed */
+	int		  field;
+	char		  from;
+	uint32_t	  len;
+	uint64_t	  at;
+	char		  name[32];
+	int		  namelen;
+} traceRing;
+
+/* Primary and replicas, see pgsql.group() */
+#define GROUP_DOWN	0
+#define GROUP_PRIMARY	1
+#define GROUP_REPLICA	2
+
+typedef struct connGroup {
+	int		nnodes;
+	int		primary;	/* node index, -1 if there is none */
+	int		next;		/* where the search for a replica starts */
+	unsigned char	role[1];	/* per node */
+} connGroup;
+
+/* Logical replication stream, see conn:replicationStream() */
+typedef struct replStream {
+	PGconn		**conn;		/* of the connection userdata */
+	uint64_t	  received;	/* LSN of the last data received */
+	uint64_t	  flushed;	/* LSN acknowledged by stream:ack() */
+	long		  interval;	/* between status updates, ms */
+	struct timespec	  sent;		/* last status update */
+	int		  done;
+} replStream;
+
+/* Result cache, see conn:resultCache() */
+typedef struct cacheEntry {
+	struct cacheEntry	*prev;	/* LRU list, most recent first */
+	struct cacheEntry	*next;
+	size_t			 size;	/* accounted bytes */
+	int64_t			 expires;
+	size_t			 keylen;
+	char			 key[1];
+} cacheEntry;
+
+typedef struct resultCache {
+	PGconn		**conn;		/* of the connection userdata */
+	cacheEntry	 *head;
+	cacheEntry	 *tail;
+	size_t		  used;
+	size_t		  budget;
+	long		  ttl;		/* ms */
+	uint64_t	  hits;
+	uint64_t	  misses;
+	int		  entries;
+	int		  listening;
+} resultCache;
+
+/* Arbitrary precision number, see pgsql.numeric() */
+typedef struct numeric {
+	int		ndigits;
+	int		weight;		/* of digits[0], in base 10000 digits */
+	int		sign;		/* as in the binary format */
+	int		dscale;		/* display scale */
+	int16_t		digits[1];
+} numeric;
+
+/* Per Lua state counters that let hot paths skip their lookups */
+typedef struct stateCounters {
+	int	codecs;		/* OIDs that have a codec */
+	int	generation;	/* bumped when a name is registered */
+	int	composites;	/* composite and array types known */
+	int	explains;	/* connections that explain slow statements */
+} stateCounters;
 
 typedef struct largeObject {
 	PGconn	*conn;